@@ -53,6 +53,12 @@ extern EXPORT nh_bool nh_start_game(int fd, const char *name, int role,
 extern EXPORT int nh_command(const char *cmd, int rep, struct nh_cmd_arg *arg);
 extern EXPORT const char *const *nh_get_copyright_banner(void);
 
+/* events.c */
+extern EXPORT void nh_run_event_dispatcher(volatile int *stop);
+
+/* log.c */
+extern EXPORT unsigned long long nh_get_log_result_time(void);
+
 /* logreplay.c */
 extern EXPORT nh_bool nh_view_replay_start(int fd,
                                            struct nh_window_procs *rwinprocs,
@@ -503,6 +503,11 @@ struct nh_dbuf_entry {
     nh_bool visible;    /* can the hero see this location? */
 };
 
+/* a display buffer position that changed, for win_update_screen_changes */
+struct nh_dbuf_change {
+    unsigned char x, y;
+};
+
 # define NH_EFFECT_TYPE(e) ((enum nh_effect_types)((e) >> 16))
 # define NH_EFFECT_ID(e) (((e) - 1) & 0xffff)
 
@@ -625,6 +630,12 @@ struct nh_window_procs {
                         nh_bool tombstone, const char *name, int gold,
                         const char *killbuf, int end_how, int year);
     void (*win_print_message_nonblocking) (int turn, const char *msg);
+    /* optional; if present, it is used instead of win_update_screen and also
+       gets the positions that changed since its last call. changes is NULL if
+       everything needs to be redrawn. */
+    void (*win_update_screen_changes) (struct nh_dbuf_entry dbuf[ROWNO][COLNO],
+                                       const struct nh_dbuf_change *changes,
+                                       int nchanges, int ux, int uy);
 };
 
 #endif
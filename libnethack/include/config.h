@@ -21,6 +21,16 @@
 
 /* #define IS_BIG_ENDIAN */
 
+/* Deflate the levels the hero is not on (see restore.c). This saves memory at
+ * the expense of some time whenever the game is saved, i.e. after every
+ * command. Programs using libnethack must then also link with zlib. */
+/* #define COMPRESS_PACKED_LEVELS */
+
+/* Deflate the save at the end of the log of a saved game. The header status of
+ * such a log is "savz" rather than "save". Compressed saves can always be
+ * restored, but versions that predate them will regard them as crashed. */
+/* #define COMPRESS_SAVES */
+
 # define PANICLOG "paniclog"    /* log of panic and impossible events */
 
 # include "global.h"    /* Define everything else according to choices above */
@@ -382,6 +382,7 @@ enum memfile_tagtype {
     MTAG_TRAP,  /* 30 */
     MTAG_FRUIT,
     MTAG_ENGRAVING,
+    MTAG_LEVELINDEX,
 };
 struct memfile_tag {
     struct memfile_tag *next;
@@ -389,6 +390,14 @@ struct memfile_tag {
     enum memfile_tagtype tagtype;
     int pos;
 };
+/* Tags are allocated from chunks owned by the memfile. Resetting the memfile
+   keeps the chunks for reuse. */
+# define MEMFILE_TAGCHUNK_SIZE 256
+struct memfile_tagchunk {
+    struct memfile_tagchunk *next;
+    int used;
+    struct memfile_tag tags[MEMFILE_TAGCHUNK_SIZE];
+};
 struct memfile {
     /* The basic information: the buffer, its length, and the file position */
     char *buf;
@@ -410,6 +419,8 @@ struct memfile {
     /* Tags to help in diffing. This is a hashtable for efficiency, using
        chaining in the case of collisions */
     struct memfile_tag *tags[MEMFILE_HASHTABLE_SIZE];
+    struct memfile_tagchunk *tagchunks; /* the first chunk */
+    struct memfile_tagchunk *curchunk;  /* the chunk tags are taken from */
 };
 
 extern int logfile;
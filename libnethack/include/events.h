@@ -9,7 +9,10 @@ typedef enum {
 	EVENT_TYPE_MAX
 } EventType;
 
-int event_trigger( EventType type, size_t args_len, char * const args[static args_len], bool async );
+// Returns 0 once the event is queued; the script runs later, or (if sync is
+// set and no dispatcher is running) before this returns. Its exit status is
+// not reported.
+int event_trigger( EventType type, size_t args_len, char * const args[static args_len], bool sync );
 void event_trigger_async( EventType type, size_t args_len, char * const args[static args_len] );
 
 #endif
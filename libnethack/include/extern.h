@@ -229,6 +229,7 @@ extern int dbuf_get_mon(int x, int y);
 extern boolean warning_at(int x, int y);
 extern void clear_display_buffer(void);
 extern void cls(void);
+extern void dbuf_mark_all_dirty(void);
 extern void flush_screen_enable(void);
 extern void flush_screen_disable(void);
 extern void flush_screen(void);
@@ -462,6 +463,7 @@ extern void food_substitution(struct obj *, struct obj *);
 extern void fix_petrification(void);
 extern void consume_oeaten(struct obj *, int);
 extern boolean maybe_finished_meal(boolean);
+extern boolean food_on_level(struct level *lev);
 extern void save_food(struct memfile *mf);
 extern void restore_food(struct memfile *mf);
 extern void reset_food(void);
@@ -624,6 +626,7 @@ extern boolean friday_13th(void);
 extern int night(void);
 extern int midnight(void);
 extern unsigned int get_seedval(void);
+extern unsigned long long get_usec(void);
 
 /* ### history.c ### */
 
@@ -692,6 +695,7 @@ extern int doprinuse(void);
 extern void useupf(struct obj *, long);
 extern char *let_to_name(char, boolean);
 extern void free_invbuf(void);
+extern void free_invnames(void);
 extern void reorder_invent(void);
 extern int doorganize(void);
 extern int count_unpaid(struct obj *);
@@ -755,6 +759,7 @@ extern void log_objmenu(int n, struct nh_objresult *pick_list);
 extern void log_bones(const char *bonesbuf, int buflen);
 extern void log_init(void);
 extern void log_finish(enum nh_log_status status);
+extern boolean log_save_compressed(int fd);
 extern void log_truncate(void);
 extern long get_tz_offset(void);
 
@@ -816,11 +821,14 @@ extern int castum(struct monst *, const struct attack *);
 
 extern void mnew(struct memfile *mf, struct memfile *relativeto);
 extern void mfree(struct memfile *mf);
+extern void mreset(struct memfile *mf, struct memfile *relativeto);
 extern void mwrite(struct memfile *mf, const void *buf, unsigned int num);
 extern void mwrite8(struct memfile *mf, int8_t value);
 extern void mwrite16(struct memfile *mf, int16_t value);
 extern void mwrite32(struct memfile *mf, int32_t value);
 extern void store_mf(int fd, struct memfile *mf);
+extern void store_mf_compressed(int fd, struct memfile *mf);
+extern boolean load_mf_compressed(int fd, struct memfile *mf);
 extern void mtag(struct memfile *mf, long tagdata,
                  enum memfile_tagtype tagtype);
 extern void mdiffflush(struct memfile *mf);
@@ -1397,14 +1405,25 @@ extern int dorecover_fd(int fd);
 extern void trickery(char *);
 extern void restore_flags(struct memfile *mf, struct flag *f);
 extern struct level *getlev(struct memfile *mf, xchar levnum, boolean ghostly);
+extern boolean level_exists(xchar levnum);
+extern struct level *load_level(xchar levnum);
+extern boolean level_is_packed(xchar levnum);
+extern boolean packed_level_has_oid(xchar levnum, unsigned int id);
+extern void save_packed_level(struct memfile *mf, xchar levnum);
+extern boolean obj_on_level(struct obj *obj, struct level *lev);
+extern void pack_other_levels(void);
+extern void free_packed_levels(void);
+extern int packed_level_size(xchar levnum, int *stored);
+extern void get_restore_stats(unsigned long long *restore_usec,
+                              unsigned long long *unpack_usec, int *unpacked);
 extern boolean lookup_id_mapping(unsigned, unsigned *);
 
 /* ### role.c ### */
 
-extern int str2role(char *);
-extern int str2race(char *);
-extern int str2gend(char *);
-extern int str2align(char *);
+extern int str2role(const char *);
+extern int str2race(const char *);
+extern int str2gend(const char *);
+extern int str2align(const char *);
 extern int randrole(void);
 extern boolean validrole(int rolenum);
 extern boolean validrace(int rolenum, int racenum);
@@ -1460,6 +1479,7 @@ extern void make_angry_shk(struct monst *, xchar, xchar);
 extern int dopay(void);
 extern boolean paybill(int);
 extern void finish_paybill(void);
+extern struct obj *find_oid_lev(struct level *lev, unsigned id);
 extern struct obj *find_oid(unsigned id);
 extern int shop_item_cost(const struct obj *obj);
 extern long contained_cost(const struct obj *, struct monst *, long, boolean,
@@ -1644,6 +1664,7 @@ extern struct obj *tt_oname(struct obj *);
 extern void topten_level_name(int dnum, int dlev, char *outbuf);
 extern void write_log_toptenentry(int fd, int how);
 extern void read_log_toptenentry(int fd, struct nh_topten_entry *entry);
+extern void free_topten_cache(void);
 
 /* ### track.c ### */
 
@@ -22,5 +22,6 @@
 # define HISTORY_MAGIC          0x54534948      /* "HIST" */
 # define DIG_MAGIC              0x53474944      /* "DIGS" */
 # define DGN_MAGIC              0x004e4744      /* "DGN\0" */
+# define LEVINDEX_MAGIC         0x58444e49      /* "INDX" */
 
 #endif
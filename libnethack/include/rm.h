@@ -335,6 +335,9 @@ struct rm {
     unsigned mem_door_t:1;      /* player knows whether door is trapped */
 };
 
+/* bytes per location in a saved level; see savelev() */
+# define LOCATION_SAVE_SIZE 8
+
 /*
  * Add wall angle viewing by defining "modes" for each wall type.  Each
  * mode describes which parts of a wall are finished (seen as as wall)
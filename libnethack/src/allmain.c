@@ -49,6 +49,7 @@ nh_lib_init(const struct nh_window_procs *procs, char **paths)
         return;
 
     windowprocs = *procs;
+    dbuf_mark_all_dirty();      /* the new window port hasn't seen anything */
 
     for (i = 0; i < PREFIX_COUNT; i++)
         fqn_prefix[i] = strdup(paths[i]);
@@ -69,6 +70,7 @@ nh_lib_exit(void)
     int i;
 
     xmalloc_cleanup();
+    free_topten_cache();
 
     for (i = 0; i < PREFIX_COUNT; i++) {
         free(fqn_prefix[i]);
@@ -876,6 +878,9 @@ nh_command(const char *cmd, int rep, struct nh_cmd_arg *arg)
     /* do the deed. command_input returns -1 if the command completed normally */
     cmdresult = command_input(cmdidx, rep, arg);
 
+    /* only the current level needs to be unpacked between commands */
+    pack_other_levels();
+
     /* make sure we actually want this command to be logged */
     if (cmdidx >= 0 && (cmdlist[cmdidx].flags & CMD_NOTIME) &&
         pre_rngstate == mt_nextstate() && pre_moves == moves)
@@ -46,6 +46,8 @@ static void mon_invent_chain(struct menulist *, const char *, struct monst *,
 static void mon_chain(struct menulist *, const char *, struct monst *, long *,
                       long *);
 static void contained(struct menulist *, const char *, long *, long *);
+static long level_size(struct level *);
+static void level_memory(struct menulist *);
 static int wiz_show_stats(void);
 static int doattributes(void);
 static int doconduct(void);
@@ -1908,6 +1910,70 @@ mon_chain(struct menulist *menu, const char *src, struct monst *chain,
     add_menutext(menu, buf);
 }
 
+/* the approximate memory use of an unpacked level */
+static long
+level_size(struct level *lev)
+{
+    long count = 0, size = sizeof (struct level);
+    struct monst *mon;
+
+    count_obj(lev->objlist, &count, &size, TRUE, TRUE);
+    count_obj(lev->buriedobjlist, &count, &size, TRUE, TRUE);
+    for (mon = lev->monlist; mon; mon = mon->nmon) {
+        size += sizeof (struct monst) + mon->mxlth + mon->mnamelth;
+        count_obj(mon->minvent, &count, &size, TRUE, TRUE);
+    }
+    return size;
+}
+
+/*
+ * List every level of the game with the memory it takes up. Levels the hero
+ * isn't on are normally packed; see pack_other_levels.
+ */
+static void
+level_memory(struct menulist *menu)
+{
+    char buf[BUFSZ], name[BUFSZ];
+    const char *state;
+    int i, len, stored, unpacked;
+    long size, total = 0, total_raw = 0;
+    unsigned long long restore_usec, unpack_usec;
+
+    add_menutext(menu, "Levels");
+    add_menutext(menu, "");
+    add_menutext(menu, "                   state     bytes  unpacked");
+
+    for (i = 1; i <= maxledgerno(); i++) {
+        if (!level_exists(i))
+            continue;
+        sprintf(name, "%s %d", dungeons[ledger_to_dnum(i)].dname,
+                ledger_to_dlev(i));
+        if (levels[i]) {
+            size = level_size(levels[i]);
+            len = size;
+            state = levels[i] == level ? "current" : "unpacked";
+        } else {
+            len = packed_level_size(i, &stored);
+            size = stored;
+            state = "packed";
+        }
+        total += size;
+        total_raw += len;
+        sprintf(buf, "%-18.18s %-8s %6ld  %8d", name, state, size, len);
+        add_menutext(menu, buf);
+    }
+
+    add_menutext(menu, "------------------ -------- ------  --------");
+    sprintf(buf, "%-18s %-8s %6ld  %8ld", "Total", "", total, total_raw);
+    add_menutext(menu, buf);
+
+    get_restore_stats(&restore_usec, &unpack_usec, &unpacked);
+    add_menutext(menu, "");
+    sprintf(buf, "Restore took %llu us; %d levels unpacked since, in %llu us.",
+            restore_usec, unpacked, unpack_usec);
+    add_menutext(menu, buf);
+}
+
 /*
  * Display memory usage of all monsters and objects on the level.
  */
@@ -1958,6 +2024,10 @@ wiz_show_stats(void)
     sprintf(buf, template, "Total", total_mon_count, total_mon_size);
     add_menutext(&menu, buf);
 
+    add_menutext(&menu, "");
+    add_menutext(&menu, "");
+    level_memory(&menu);
+
     display_menu(menu.items, menu.icount, NULL, PICK_NONE, PLHINT_ANYWHERE,
                  NULL);
     free(menu.items);
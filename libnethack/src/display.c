@@ -123,6 +123,8 @@ static void t_warn(struct rm *);
 static int wall_angle(struct rm *);
 static void dbuf_set_object(int x, int y, int oid, int omn);
 static void dbuf_set_loc(int x, int y);
+static void dbuf_mark_dirty(int x, int y);
+static void send_dbuf(int ux, int uy);
 
 static boolean delay_flushing;
 
@@ -1361,6 +1363,37 @@ doredraw(void)
 /* Display Buffering (3rd screen) ========================================== */
 static struct nh_dbuf_entry dbuf[ROWNO][COLNO];
 
+/* The positions that changed since the last call to win_update_screen_changes.
+ * While dbuf_all_dirty is set, the window port hasn't seen the buffer yet and
+ * nothing else is recorded. */
+static boolean dbuf_dirty[ROWNO][COLNO];
+static struct nh_dbuf_change dbuf_changes[ROWNO * COLNO];
+static int dbuf_nchanges;
+static boolean dbuf_all_dirty = TRUE;
+
+
+static void
+dbuf_mark_dirty(int x, int y)
+{
+    if (dbuf_all_dirty || dbuf_dirty[y][x])
+        return;
+
+    dbuf_dirty[y][x] = TRUE;
+    dbuf_changes[dbuf_nchanges].x = x;
+    dbuf_changes[dbuf_nchanges].y = y;
+    dbuf_nchanges++;
+}
+
+
+/* The window port needs to redraw the whole buffer on the next flush. */
+void
+dbuf_mark_all_dirty(void)
+{
+    memset(dbuf_dirty, 0, sizeof (dbuf_dirty));
+    dbuf_nchanges = 0;
+    dbuf_all_dirty = TRUE;
+}
+
 
 /* 
  * object ids need to be obfuscated for non-identified types to prevent
@@ -1475,16 +1508,23 @@ dbuf_set_effect(int x, int y, int eglyph)
     if (!isok(x, y))
         return;
 
+    if (dbuf[y][x].effect != eglyph)
+        dbuf_mark_dirty(x, y);
     dbuf[y][x].effect = eglyph;
 }
 
 static void
 dbuf_set_object(int x, int y, int oid, int omn)
 {
+    int obj;
+
     if (!isok(x, y))
         return;
 
-    dbuf[y][x].obj = obfuscate_object(oid);
+    obj = obfuscate_object(oid);
+    if (dbuf[y][x].obj != obj || dbuf[y][x].obj_mn != omn)
+        dbuf_mark_dirty(x, y);
+    dbuf[y][x].obj = obj;
     dbuf[y][x].obj_mn = omn;
 }
 
@@ -1530,19 +1570,27 @@ void
 dbuf_set(int x, int y, int bg, int trap, int obj, int obj_mn, boolean invis,
          int mon, int monflags, int effect, int branding)
 {
+    struct nh_dbuf_entry dbe;
+
     if (!isok(x, y))
         return;
 
-    dbuf[y][x].bg = bg;
-    dbuf[y][x].trap = trap;
-    dbuf[y][x].obj = obfuscate_object(obj);
-    dbuf[y][x].obj_mn = obj_mn;
-    dbuf[y][x].invis = invis;
-    dbuf[y][x].mon = mon;
-    dbuf[y][x].monflags = monflags;
-    dbuf[y][x].effect = effect;
-    dbuf[y][x].visible = cansee(x, y);
-    dbuf[y][x].branding = branding;
+    memset(&dbe, 0, sizeof (dbe));
+    dbe.bg = bg;
+    dbe.trap = trap;
+    dbe.obj = obfuscate_object(obj);
+    dbe.obj_mn = obj_mn;
+    dbe.invis = invis;
+    dbe.mon = mon;
+    dbe.monflags = monflags;
+    dbe.effect = effect;
+    dbe.visible = cansee(x, y);
+    dbe.branding = branding;
+
+    if (memcmp(&dbuf[y][x], &dbe, sizeof (dbe))) {
+        dbuf[y][x] = dbe;
+        dbuf_mark_dirty(x, y);
+    }
 }
 
 
@@ -1570,6 +1618,13 @@ warning_at(int x, int y)
 void
 cls(void)
 {
+    static const struct nh_dbuf_entry zero_dbe;
+    int x, y;
+
+    for (y = 0; y < ROWNO; y++)
+        for (x = 0; x < COLNO; x++)
+            if (memcmp(&dbuf[y][x], &zero_dbe, sizeof (zero_dbe)))
+                dbuf_mark_dirty(x, y);
     memset(dbuf, 0, sizeof (struct nh_dbuf_entry) * ROWNO * COLNO);
 }
 
@@ -1588,6 +1643,35 @@ flush_screen_enable(void)
 }
 
 
+/*
+ * Pass the display buffer to the window port. Ports that track changes get
+ * the positions marked by dbuf_mark_dirty; otherwise the list just keeps
+ * growing until a port that wants it is installed.
+ */
+static void
+send_dbuf(int ux, int uy)
+{
+    int x, y;
+
+    if (!windowprocs.win_update_screen_changes) {
+        update_screen(dbuf, ux, uy);
+        return;
+    }
+
+    (*windowprocs.win_update_screen_changes) (dbuf, dbuf_all_dirty ? NULL :
+                                              dbuf_changes, dbuf_nchanges,
+                                              ux, uy);
+
+    while (dbuf_nchanges) {
+        dbuf_nchanges--;
+        x = dbuf_changes[dbuf_nchanges].x;
+        y = dbuf_changes[dbuf_nchanges].y;
+        dbuf_dirty[y][x] = FALSE;
+    }
+    dbuf_all_dirty = FALSE;
+}
+
+
 /*
  * Send the display buffer to the window port.
  */
@@ -1597,7 +1681,7 @@ flush_screen(void)
     if (delay_flushing)
         return;
 
-    update_screen(dbuf, u.ux, u.uy);
+    send_dbuf(u.ux, u.uy);
 
     if (iflags.botl)
         bot();
@@ -1610,7 +1694,7 @@ flush_screen(void)
 void
 flush_screen_nopos(void)
 {
-    update_screen(dbuf, -1, -1);
+    send_dbuf(-1, -1);
 }
 
 /* ========================================================================= */
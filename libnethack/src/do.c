@@ -1000,14 +1000,14 @@ goto_level(d_level * newlevel, boolean at_stairs, boolean falling,
     origlev = level;
     level = NULL;
 
-    if (!levels[new_ledger]) {
+    if (!level_exists(new_ledger)) {
         /* entering this level for first time; make it now */
         historic_event(FALSE, "reached %s.", hist_lev_name(&u.uz, FALSE));
         level = mklev(&u.uz);
         new = TRUE;     /* made the level */
     } else {
         /* returning to previously visited level */
-        level = levels[new_ledger];
+        level = load_level(new_ledger);
 
         /* regenerate animals while on another level */
         for (mtmp = level->monlist; mtmp; mtmp = mtmp2) {
@@ -1460,7 +1460,7 @@ deliver_object(struct obj *obj, xchar dnum, xchar dlevel, int where)
     d_level levnum = { dnum, dlevel };
     int nx, ny;
 
-    lev = levels[ledger_no(&levnum)];
+    lev = load_level(ledger_no(&levnum));
     if (!lev) { /* this can go away if we pre-generate all levels */
         /* Reset the rndmonst state so that it will generate correct monsters
            for the level being created. */
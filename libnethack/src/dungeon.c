@@ -1504,7 +1504,7 @@ lev_by_name(const char *nam)
              (u.uz.dnum == medusa_level.dnum &&
               dlev.dnum == valley_level.dnum)) &&
             /* either wizard mode or else seen and not forgotten */
-            (wizard || (levels [idx] && !levels [idx]->flags.forgotten)))
+            (wizard || (load_level(idx) && !levels[idx]->flags.forgotten)))
         {
             lev = depth(&slev->dlevel);
         }
@@ -1519,9 +1519,9 @@ lev_by_name(const char *nam)
             idx &= 0x00FF;
             if (        /* either wizard mode, or else _both_ sides of branch
                            seen */
-                   wizard || ((levels[idx] && !levels[idx]->flags.forgotten) &&
-                              (levels[idxtoo] &&
-                               !levels[idxtoo]->flags.forgotten))) {
+                   wizard ||
+                   (load_level(idx) && !levels[idx]->flags.forgotten &&
+                    load_level(idxtoo) && !levels[idxtoo]->flags.forgotten)) {
                 if (ledger_to_dnum(idxtoo) == u.uz.dnum)
                     idx = idxtoo;
                 dlev.dnum = ledger_to_dnum(idx);
@@ -1811,7 +1811,7 @@ overview_scan(const struct level *lev, struct overview_info *oi)
             case S_upsstair:
             case S_dnsstair:
                 if (lev->sstairs.sx == x && lev->sstairs.sy == y &&
-                    levels[ledger_no(&lev->sstairs.tolev)]) {
+                    level_exists(ledger_no(&lev->sstairs.tolev))) {
                     oi->branch = TRUE;
                     oi->branch_dst = lev->sstairs.tolev;
                 }
@@ -1861,7 +1861,7 @@ overview_scan(const struct level *lev, struct overview_info *oi)
     /* find the magic portal, if it exists */
     for (trap = lev->lev_traps; trap; trap = trap->ntrap)
         if (trap->tseen && trap->ttyp == MAGIC_PORTAL &&
-            levels[ledger_no(&trap->dst)]) {
+            level_exists(ledger_no(&trap->dst))) {
             oi->portal = TRUE;
             oi->portal_dst = trap->dst;
         }
@@ -2024,7 +2024,7 @@ dooverview(void)
 
     dnum = -1;
     for (i = 0; i < maxledgerno(); i++) {
-        if (!levels[i])
+        if (!load_level(i))
             continue;
         overview_scan(levels[i], &oinfo);
 
@@ -2505,6 +2505,14 @@ maybe_finished_meal(boolean stopping)
 }
 
 
+/* Is the meal or tin save_food remembers on lev? */
+boolean
+food_on_level(struct level *lev)
+{
+    return obj_on_level(victual.piece, lev) || obj_on_level(tin.tin, lev);
+}
+
+
 void
 save_food(struct memfile *mf)
 {
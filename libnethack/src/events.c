@@ -7,46 +7,280 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <fcntl.h>
 #include <sys/wait.h>
 
 // TODO: Make this a configurable option
 #define EVENT_SCRIPT "nethack_event.sh"
 
+// Events are appended to the spool by the game and run by the dispatcher,
+// which remembers how far it got in the position file.
+#define EVENT_SPOOL "nethack_events.spool"
+#define EVENT_SPOOL_POS "nethack_events.pos"
+
+// How long the dispatcher sleeps when the spool is empty.
+#define DISPATCH_INTERVAL_USEC 250000
+
 static const char * const event_type_strings[EVENT_TYPE_MAX] = {
 	[EVENT_TYPE_DEAD] = "EVENT_TYPE_DEAD",
 };
 
-int event_trigger( EventType type, size_t args_len, char * const args[static args_len], bool async ) {
-	if( type >= EVENT_TYPE_MAX ) impossible("unrecognized event type");
+static void run_queued_events( bool sync );
 
-	pid_t pid = fork();
-	if( pid == -1 ) {
-		if( async ) {
-			pline("fork(): %s", strerror(errno));
+// Append str to buf, escaping the field and record separators.
+static size_t escape_field( char *buf, const char *str ) {
+	size_t len = 0;
+	for( ; *str; str++ ) {
+		switch( *str ) {
+			case '\t': buf[len++] = '\\'; buf[len++] = 't'; break;
+			case '\n': buf[len++] = '\\'; buf[len++] = 'n'; break;
+			case '\\': buf[len++] = '\\'; buf[len++] = '\\'; break;
+			default: buf[len++] = *str; break;
+		}
+	}
+	return len;
+}
+
+// Undo escape_field in place.
+static void unescape_field( char *str ) {
+	char *out = str;
+	for( ; *str; str++ ) {
+		if( *str == '\\' && str[1] ) {
+			str++;
+			*out++ = *str == 't' ? '\t' : *str == 'n' ? '\n' : *str;
+		} else {
+			*out++ = *str;
+		}
+	}
+	*out = '\0';
+}
+
+/*
+ * Queue an event for the dispatcher. The record is a single line of tab
+ * separated fields (the event type followed by the arguments) appended to the
+ * spool file with one write, so the game process doesn't have to fork while a
+ * dispatcher is running. Without one, the game runs the queued events itself
+ * (see run_queued_events).
+ * If sync is set, the record is flushed to disk before returning, and if the
+ * game runs the events itself, it waits for the scripts to finish. Returns 0
+ * if the event was queued; the exit status of the script is not reported.
+ */
+int event_trigger( EventType type, size_t args_len, char * const args[static args_len], bool sync ) {
+	if( type >= EVENT_TYPE_MAX ) {
+		impossible("unrecognized event type");
+		return -1;
+	}
+
+	size_t reclen = strlen(event_type_strings[type]) + 2;
+	for( size_t i = 0; i < args_len; i++ ) reclen += 2 * strlen(args[i]) + 1;
+
+	char *record = malloc(reclen);
+	size_t len = escape_field(record, event_type_strings[type]);
+	for( size_t i = 0; i < args_len; i++ ) {
+		record[len++] = '\t';
+		len += escape_field(record + len, args[i]);
+	}
+	record[len++] = '\n';
+
+	int ret = -1;
+	int fd = open_datafile(EVENT_SPOOL, O_WRONLY | O_APPEND | O_CREAT, SCOREPREFIX);
+	if( lock_fd(fd, 10) ) {
+		if( write(fd, record, len) == (ssize_t) len && (!sync || fsync(fd) == 0) ) ret = 0;
+		unlock_fd(fd);
+	}
+	if( ret == -1 ) {
+		if( sync ) {
+			impossible("Could not queue event %s: %s", event_type_strings[type], strerror(errno));
 		} else {
-			impossible("fork(): %s", strerror(errno));
+			pline("Could not queue event %s: %s", event_type_strings[type], strerror(errno));
 		}
-	} else if( pid == 0 ) {
-		const char *argv[args_len + 3];
-		memcpy(argv + 2, args, args_len * sizeof(char *));
-		argv[args_len + 2] = NULL;
-		argv[0] = EVENT_SCRIPT;
-		argv[1] = event_type_strings[type];
+	}
+	if( fd != -1 ) close(fd);
+	free(record);
+
+	if( ret == 0 ) run_queued_events(sync);
+	return ret;
+}
+
+void event_trigger_async( EventType type, size_t args_len, char * const args[static args_len] ) {
+	event_trigger(type, args_len, args, false);
+}
+
+// Run the event script for one spooled record and wait for it to finish.
+static void run_event_script( char *record ) {
+	size_t argc = 1;
+	for( char *p = record; *p; p++ ) if( *p == '\t' ) argc++;
+
+	const char *argv[argc + 2];
+	argv[0] = EVENT_SCRIPT;
+	argc = 1;
+	// strsep rather than strtok: empty fields must keep their place
+	for( char *field; (field = strsep(&record, "\t")); ) {
+		unescape_field(field);
+		argv[argc++] = field;
+	}
+	argv[argc] = NULL;
+
+	pid_t pid = fork();
+	if( pid == 0 ) {
 		chdir(fqn_prefix[DATAPREFIX]);
 		execvp(fqname(EVENT_SCRIPT, DATAPREFIX, DATAPREFIX), (char **) argv);
-		char *str = strerror(errno);
 		exit(errno == ENOENT ? EXIT_SUCCESS : EXIT_FAILURE); // l'impossible!
+	} else if( pid != -1 ) {
+		int child_status;
+		waitpid(pid, &child_status, 0);
 	}
+}
 
-	if( async ) return 0;
+static off_t read_spool_pos( int posfd ) {
+	long long pos = 0;
+	char buf[32];
+	ssize_t len = pread(posfd, buf, sizeof(buf) - 1, 0);
+	if( len > 0 ) {
+		buf[len] = '\0';
+		pos = atoll(buf);
+	}
+	return pos < 0 ? 0 : pos;
+}
 
-	int child_status;
-	pid_t waitpid_ret = waitpid(pid, &child_status, 0);
-	if( waitpid_ret == -1 ) impossible("waitpid(): %s", strerror(errno));
-	// Undefined if the process exited due to a signal.
-	return WEXITSTATUS(child_status);
+static void write_spool_pos( int posfd, off_t pos ) {
+	char buf[32];
+	int len = snprintf(buf, sizeof(buf), "%lld\n", (long long) pos);
+	ftruncate(posfd, 0);
+	pwrite(posfd, buf, len, 0);
 }
 
-void event_trigger_async( EventType type, size_t args_len, char * const args[static args_len] ) {
-	event_trigger(type, args_len, args, true);
+/*
+ * Run the event script for the complete records in the spool from *pos on,
+ * saving the position after each event. Returns false if there was nothing to
+ * run; in that case the spool is emptied if everything has been dispatched.
+ */
+static bool dispatch_spool( int fd, int posfd, off_t *pos, volatile int *stop ) {
+	int size;
+	// The spool was truncated or replaced behind our back; start over at its
+	// beginning.
+	if( *pos > lseek(fd, 0, SEEK_END) ) {
+		*pos = 0;
+		write_spool_pos(posfd, *pos);
+	}
+	lseek(fd, *pos, SEEK_SET);
+	char *data = loadfile(fd, &size);
+	if( !data ) {
+		// Empty the spool, unless an event was added since loadfile looked
+		// at it.
+		if( *pos && lock_fd(fd, 0) ) {
+			if( lseek(fd, 0, SEEK_END) == *pos ) {
+				ftruncate(fd, 0);
+				*pos = 0;
+				write_spool_pos(posfd, *pos);
+			}
+			unlock_fd(fd);
+		}
+		return false;
+	}
+
+	// Only complete records are dispatched; a partial one will be picked up
+	// next time.
+	char *record = data, *end;
+	while( !*stop && (end = strchr(record, '\n')) ) {
+		*end = '\0';
+		*pos += end - record + 1;
+		run_event_script(record);
+		write_spool_pos(posfd, *pos);
+		record = end + 1;
+	}
+	free(data);
+	return record != data;
+}
+
+// Whoever dispatches the spool holds a lock on the position file: the
+// dispatcher for its whole lifetime, a game only while it drains the spool.
+static bool spool_is_dispatched( int posfd ) {
+	struct flock fl;
+	fl.l_type = F_WRLCK;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = 0;
+	fl.l_len = 0;
+	return fcntl(posfd, F_GETLK, &fl) != -1 && fl.l_type != F_UNLCK;
+}
+
+/*
+ * Run the queued events in this process. Games do this after queueing an
+ * event if no dispatcher is running, which is always the case for local
+ * games: only the network server starts one.
+ */
+static void drain_spool( void ) {
+	static volatile int never_stop = 0;
+	int fd = open_datafile(EVENT_SPOOL, O_RDWR, SCOREPREFIX);
+	int posfd = open_datafile(EVENT_SPOOL_POS, O_RDWR | O_CREAT, SCOREPREFIX);
+
+	// The second round picks up an event queued by a game that saw the lock
+	// just before it was released.
+	for( int round = 0; round < 2 && fd != -1 && lock_fd(posfd, 0); round++ ) {
+		off_t pos = read_spool_pos(posfd);
+		while( dispatch_spool(fd, posfd, &pos, &never_stop) )
+			;
+		unlock_fd(posfd);
+		if( lseek(fd, 0, SEEK_END) <= pos ) break;
+	}
+
+	if( fd != -1 ) close(fd);
+	if( posfd != -1 ) close(posfd);
+}
+
+// Drain the spool unless a dispatcher is already running. For an asynchronous
+// event this happens in a detached grandchild, so the game doesn't wait for
+// the script (and doesn't need to reap it).
+static void run_queued_events( bool sync ) {
+	int posfd = open_datafile(EVENT_SPOOL_POS, O_RDWR | O_CREAT, SCOREPREFIX);
+	bool dispatched = posfd == -1 || spool_is_dispatched(posfd);
+	if( posfd != -1 ) close(posfd);
+	if( dispatched ) return;
+
+	if( sync ) {
+		drain_spool();
+		return;
+	}
+
+	pid_t pid = fork();
+	if( pid == 0 ) {
+		if( fork() == 0 ) drain_spool();
+		_exit(EXIT_SUCCESS);
+	} else if( pid != -1 ) {
+		int child_status;
+		waitpid(pid, &child_status, 0);
+	} else {
+		pline("Could not run event scripts: %s", strerror(errno));
+	}
+}
+
+/*
+ * The long-lived consumer side of event_trigger: run the event script for
+ * every record in the spool, in order, until *stop becomes nonzero. The
+ * position of the next record is saved after each event, so no event is run
+ * twice or lost when the dispatcher is restarted. Once everything has been
+ * dispatched, the spool is truncated so it doesn't grow forever.
+ */
+void nh_run_event_dispatcher( volatile int *stop ) {
+	int fd = open_datafile(EVENT_SPOOL, O_RDWR | O_CREAT, SCOREPREFIX);
+	int posfd = open_datafile(EVENT_SPOOL_POS, O_RDWR | O_CREAT, SCOREPREFIX);
+	if( fd == -1 || posfd == -1 ) {
+		if( fd != -1 ) close(fd);
+		if( posfd != -1 ) close(posfd);
+		return;
+	}
+
+	// Wait for a game that is draining the spool itself to finish; from then
+	// on the games leave the spool to us.
+	while( !*stop && !lock_fd(posfd, 0) ) usleep(DISPATCH_INTERVAL_USEC);
+
+	off_t pos = read_spool_pos(posfd);
+	while( !*stop ) {
+		if( !dispatch_spool(fd, posfd, &pos, stop) )
+			usleep(DISPATCH_INTERVAL_USEC);
+	}
+
+	unlock_fd(posfd);
+	close(posfd);
+	close(fd);
 }
@@ -508,4 +508,18 @@ get_seedval(void)
 #endif
 }
 
+/* a clock for measuring short intervals, in microseconds */
+unsigned long long
+get_usec(void)
+{
+#if defined(UNIX)
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (unsigned long long)tv.tv_sec * 1000000 + tv.tv_usec;
+#else
+    return 0;
+#endif
+}
+
 /*hacklib.c*/
@@ -14,6 +14,12 @@ static boolean only_here(const struct obj *);
 static void compactify(char *);
 static boolean taking_off(const char *);
 static boolean putting_on(const char *);
+static boolean invname_context_changed(void);
+static struct invname *find_invname(const struct obj *);
+static void invname_key(struct obj *, const struct obj *);
+static boolean invname_matches(const struct invname *, const struct obj *);
+static void set_invname(struct invname *, const struct obj *);
+static void add_invitem(struct nh_objitem **, int *, int, struct obj *);
 static char display_pickinv(const char *, boolean, long *);
 static boolean this_type_only(const struct obj *);
 static void dounpaid(void);
@@ -1330,6 +1336,152 @@ find_unpaid(struct obj *list, struct obj **last_found)
 }
 
 
+/*
+ * make_invlist keeps the entry it built for each inventory object, together
+ * with a copy of everything doname() looks at. The entry is reused as long as
+ * none of that changed, so only new or changed objects are named again.
+ * Objects with names that change on their own (lit ones show their remaining
+ * fuel, unpaid ones the current price) are always named afresh.
+ */
+struct invname {
+    struct obj obj;     /* the object, with its pointers and position cleared */
+    char oname[256];
+    char uname[BUFSZ];  /* objects[].oc_uname */
+    boolean name_known; /* objects[].oc_name_known */
+    boolean egg_known;  /* MV_KNOWS_EGG */
+    boolean seen;       /* still in the inventory */
+    struct nh_objitem item;
+};
+
+static struct invname *invnames;
+static int invname_count, invname_alloc;
+
+/* state outside the objects that doname() depends on */
+static struct {
+    boolean twoweap, water_known, show_uncursed, mrg_to_wielded;
+    const struct permonst *form;        /* for body_part() */
+} invname_context;
+
+
+static boolean
+invname_context_changed(void)
+{
+    boolean changed =
+        invname_context.twoweap != u.twoweap ||
+        invname_context.water_known != objects[POT_WATER].oc_name_known ||
+        invname_context.show_uncursed != iflags.show_uncursed ||
+        invname_context.mrg_to_wielded != mrg_to_wielded ||
+        invname_context.form != youmonst.data;
+
+    invname_context.twoweap = u.twoweap;
+    invname_context.water_known = objects[POT_WATER].oc_name_known;
+    invname_context.show_uncursed = iflags.show_uncursed;
+    invname_context.mrg_to_wielded = mrg_to_wielded;
+    invname_context.form = youmonst.data;
+    return changed;
+}
+
+
+static struct invname *
+find_invname(const struct obj *obj)
+{
+    int i;
+
+    for (i = 0; i < invname_count; i++)
+        if (invnames[i].obj.o_id == obj->o_id)
+            return &invnames[i];
+
+    if (invname_count == invname_alloc) {
+        invname_alloc = invname_alloc ? invname_alloc * 2 : 64;
+        invnames = realloc(invnames, invname_alloc * sizeof (struct invname));
+    }
+    memset(&invnames[invname_count], 0, sizeof (struct invname));
+    return &invnames[invname_count++];
+}
+
+
+/* copy the parts of obj that don't depend on where it is */
+static void
+invname_key(struct obj *key, const struct obj *obj)
+{
+    memcpy(key, obj, sizeof (struct obj));      /* including any padding */
+    key->nobj = key->v.v_nexthere = key->cobj = NULL;
+    key->olev = NULL;
+    key->ox = key->oy = 0;
+}
+
+
+static boolean
+invname_matches(const struct invname *in, const struct obj *obj)
+{
+    struct obj key;
+    const char *uname = objects[obj->otyp].oc_uname;
+
+    invname_key(&key, obj);
+    return !memcmp(&in->obj, &key, sizeof (struct obj)) &&
+        !strcmp(in->oname, obj->onamelth ? ONAME(obj) : "") &&
+        !strcmp(in->uname, uname ? uname : "") &&
+        in->name_known == objects[obj->otyp].oc_name_known &&
+        in->egg_known == (obj->otyp == EGG && obj->corpsenm >= LOW_PM &&
+                          (mvitals[obj->corpsenm].mvflags & MV_KNOWS_EGG));
+}
+
+
+static void
+set_invname(struct invname *in, const struct obj *obj)
+{
+    const char *uname = objects[obj->otyp].oc_uname;
+
+    invname_key(&in->obj, obj);
+    strcpy(in->oname, obj->onamelth ? ONAME(obj) : "");
+    strncpy(in->uname, uname ? uname : "", BUFSZ - 1);
+    in->uname[BUFSZ - 1] = '\0';
+    in->name_known = objects[obj->otyp].oc_name_known;
+    in->egg_known = obj->otyp == EGG && obj->corpsenm >= LOW_PM &&
+        (mvitals[obj->corpsenm].mvflags & MV_KNOWS_EGG);
+}
+
+
+/* add_objitem for an inventory object, reusing its old entry if possible */
+static void
+add_invitem(struct nh_objitem **items, int *nr_items, int idx, struct obj *obj)
+{
+    struct invname *in;
+
+    examine_object(obj);
+    in = find_invname(obj);
+    in->seen = TRUE;
+
+    if (obj->unpaid || obj->lamplit) {
+        in->obj.o_id = obj->o_id;
+        in->item.caption[0] = '\0';    /* never matches */
+    } else if (in->item.caption[0] && invname_matches(in, obj)) {
+        if (idx >= *nr_items) {
+            *nr_items = *nr_items * 2;
+            *items = realloc(*items, *nr_items * sizeof (struct nh_objitem));
+        }
+        (*items)[idx] = in->item;
+        return;
+    }
+
+    add_objitem(items, nr_items, MI_NORMAL, idx, obj->invlet, doname(obj), obj,
+                TRUE);
+    if (!obj->unpaid && !obj->lamplit) {
+        set_invname(in, obj);
+        in->item = (*items)[idx];
+    }
+}
+
+
+void
+free_invnames(void)
+{
+    free(invnames);
+    invnames = NULL;
+    invname_count = invname_alloc = 0;
+}
+
+
 static struct nh_objitem *
 make_invlist(const char *lets, int *icount)
 {
@@ -1338,6 +1490,12 @@ make_invlist(const char *lets, int *icount)
     int nr_items = 10, cur_entry = 0, classcount;
     const char *invlet = flags.inv_order;
     struct nh_objitem *items = malloc(nr_items * sizeof (struct nh_objitem));
+    int i, j;
+
+    if (invname_context_changed())
+        invname_count = 0;
+    for (i = 0; i < invname_count; i++)
+        invnames[i].seen = FALSE;
 
 nextclass:
     classcount = 0;
@@ -1350,9 +1508,7 @@ nextclass:
                                 let_to_name(*invlet, FALSE), otmp, FALSE);
                     classcount++;
                 }
-                examine_object(otmp);
-                add_objitem(&items, &nr_items, MI_NORMAL, cur_entry++, ilet,
-                            doname(otmp), otmp, TRUE);
+                add_invitem(&items, &nr_items, cur_entry++, otmp);
             }
         }
     }
@@ -1365,6 +1521,14 @@ nextclass:
         }
     }
 
+    /* forget objects that have left the inventory */
+    if (!lets || !*lets) {
+        for (i = j = 0; i < invname_count; i++)
+            if (invnames[i].seen)
+                invnames[j++] = invnames[i];
+        invname_count = j;
+    }
+
     *icount = cur_entry;
     return items;
 }
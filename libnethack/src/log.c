@@ -19,6 +19,9 @@ static const char *const statuscodes[] = { "save", "done", "inpr" };
 
 static int last_curline;
 
+/* total time spent in log_command_result, in microseconds */
+static unsigned long long log_result_time;
+
 static const unsigned char b64e[64] =
     "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 
@@ -267,10 +270,14 @@ log_command(int cmd, int rep, struct nh_cmd_arg *arg)
 void
 log_command_result(void)
 {
+    unsigned long long start_time;
+
     if (iflags.disable_log || !program_state.something_worth_saving ||
         logfile == -1)
         return;
 
+    start_time = get_usec();
+
     if (!multi && !occupation) {
         /* We want to log all the messages produced since the last command,
            especially nonblocking ones, so we can let the user know what
@@ -290,7 +297,8 @@ log_command_result(void)
             (last_cmd_state ==
              recent_cmd_states ? recent_cmd_states + 1 : recent_cmd_states);
 
-        mnew(this_cmd_state, last_cmd_state);
+        /* the two states take turns; each keeps its buffers */
+        mreset(this_cmd_state, last_cmd_state);
         savegame(this_cmd_state);       /* both records the state, and calcs a
                                            diff */
         lprintf("\n~");
@@ -322,7 +330,6 @@ log_command_result(void)
         lprintf(" (%d edits (%d bytes), %d copies (%d bytes), %d seeks)", edits,
                 editbytes, copies, copybytes, seeks);
 #endif
-        mfree(last_cmd_state);
         last_cmd_state = this_cmd_state;
         action_count++;
     }
@@ -332,6 +339,18 @@ log_command_result(void)
     lprintf("NHGAME %4s %08x %08x", statuscodes[LS_IN_PROGRESS], last_cmd_pos,
             action_count);
     lseek(logfile, last_cmd_pos, SEEK_SET);
+
+    log_result_time += get_usec() - start_time;
+}
+
+
+/* How much time logging command results (recording the game state and
+ * calculating the diff) has taken so far. The server uses this to break down
+ * the time taken by commands. */
+unsigned long long
+nh_get_log_result_time(void)
+{
+    return log_result_time;
 }
 
 
@@ -474,6 +493,8 @@ log_bones(const char *bonesbuf, int buflen)
 void
 log_finish(enum nh_log_status status)
 {
+    const char *code = statuscodes[status];
+
     if (!program_state.something_worth_saving || logfile == -1 ||
         iflags.disable_log)
         return;
@@ -481,7 +502,11 @@ log_finish(enum nh_log_status status)
     lseek(logfile, last_cmd_pos++, SEEK_SET);
     lprintf("\n");
     lseek(logfile, 0, SEEK_SET);
-    lprintf("NHGAME %4s %08x", statuscodes[status], last_cmd_pos);
+#ifdef COMPRESS_SAVES
+    if (status == LS_SAVED)
+        code = "savz";  /* dosave0 deflates the save */
+#endif
+    lprintf("NHGAME %4s %08x", code, last_cmd_pos);
     lseek(logfile, last_cmd_pos, SEEK_SET);
 
     if (status != LS_IN_PROGRESS)
@@ -489,6 +514,19 @@ log_finish(enum nh_log_status status)
     logfile = -1;
 }
 
+/* Is the save at the end of the log in fd deflated? */
+boolean
+log_save_compressed(int fd)
+{
+    char header[12];
+
+    if (pread(fd, header, 11, 0) != 11)
+        return FALSE;
+    header[11] = '\0';
+    return !strcmp(header, "NHGAME savz");
+}
+
+
 void
 log_truncate(void)
 {
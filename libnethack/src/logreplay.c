@@ -93,6 +93,15 @@ struct replay_checkpoint {
 static struct replay_checkpoint *checkpoints;
 static char **commands;
 static int cmdcount, cpcount;
+
+/* The states after the most recent actions of a replay, kept in a ring buffer
+   so that stepping backwards doesn't have to replay forward from the previous
+   checkpoint every time. These are copies of diff_base, which holds the state
+   after each action anyway, so recording them is cheap. The entries are in
+   order of actions; the newest one is just before recent_head. */
+#define RECENT_STATES 32
+static struct replay_checkpoint recent_states[RECENT_STATES];
+static int recent_head, recent_count;
 static struct nh_option_desc *saved_options;
 static struct nh_window_procs replay_windowprocs, orig_windowprocs;
 
@@ -914,7 +923,6 @@ replay_check_diff(char *token, boolean optonly, boolean fast)
 {
     char *b64data, *buf, *bufp;
     int buflen, dbpos = 0;
-    boolean do_realloc;
     struct memfile mf;
 
     if (!token)
@@ -960,13 +968,11 @@ replay_check_diff(char *token, boolean optonly, boolean fast)
             break;
         case MDIFF_COPY:
         case MDIFF_EDIT:
-            do_realloc = FALSE;
-            while (mf.len < mf.pos + n) {
-                mf.len += 4096;
-                do_realloc = TRUE;
-            }
-            if (do_realloc)
+            if (mf.len < mf.pos + n) {
+                while (mf.len < mf.pos + n)
+                    mf.len = mf.len ? mf.len * 2 : 4096;
                 mf.buf = realloc(mf.buf, mf.len);
+            }
             if ((unsigned char)(bufp[1]) >> 6 == MDIFF_COPY) {
                 if (dbpos + n > diff_base.pos) {
                     free(buf);
@@ -1182,21 +1188,103 @@ make_checkpoint(int actions)
     checkpoints[cpcount - 1].opt = clone_optlist(options);
     mnew(&checkpoints[cpcount - 1].cpdata, NULL);
     savegame(&checkpoints[cpcount - 1].cpdata);
+    /* checkpoints are kept for the whole replay; drop the slack left by the
+       buffer growth */
+    checkpoints[cpcount - 1].cpdata.buf =
+        realloc(checkpoints[cpcount - 1].cpdata.buf,
+                checkpoints[cpcount - 1].cpdata.pos);
     checkpoints[cpcount - 1].cpdata.len = checkpoints[cpcount - 1].cpdata.pos;
     checkpoints[cpcount - 1].cpdata.pos = 0;
 }
 
 
+static struct replay_checkpoint *
+newest_recent_state(int age)
+{
+    return &recent_states[(recent_head + RECENT_STATES - 1 - age) %
+                          RECENT_STATES];
+}
+
+
+static void
+free_recent_state(struct replay_checkpoint *rs)
+{
+    free_optlist(rs->opt);
+    rs->opt = NULL;
+    mfree(&rs->cpdata);
+}
+
+
+static void
+record_recent_state(int actions)
+{
+    struct replay_checkpoint *rs;
+
+    /* the same restrictions as for checkpoints apply; also don't record an
+       action twice after stepping back. Once the diffs are found to be
+       invalid, replay_check_diff no longer updates diff_base, so it doesn't
+       hold the state after this action any more. */
+    if (!diff_base.pos || loginfo.diffs_are_invalid || multi || occupation ||
+        (recent_count && newest_recent_state(0)->actions >= actions))
+        return;
+
+    rs = &recent_states[recent_head];
+    if (recent_count == RECENT_STATES)
+        free_recent_state(rs);  /* drop the oldest state */
+    else
+        recent_count++;
+    recent_head = (recent_head + 1) % RECENT_STATES;
+
+    rs->actions = actions;
+    rs->moves = true_moves();
+    rs->nexttoken = ftell(loginfo.flog);
+    rs->opt = clone_optlist(options);
+    mnew(&rs->cpdata, NULL);
+    rs->cpdata.buf = malloc(diff_base.pos);
+    memcpy(rs->cpdata.buf, diff_base.buf, diff_base.pos);
+    rs->cpdata.len = diff_base.pos;
+}
+
+
+/* Find the most recent state at or before the given number of actions. */
+static struct replay_checkpoint *
+find_recent_state(int actions)
+{
+    int i;
+
+    /* the recorded states came from diffs that turned out to be unusable */
+    if (loginfo.diffs_are_invalid)
+        return NULL;
+
+    for (i = 0; i < recent_count; i++)
+        if (newest_recent_state(i)->actions <= actions)
+            return newest_recent_state(i);
+    return NULL;
+}
+
+
+/* Forget the states after the given number of actions, so that the ones that
+   are left stay in order once the replay continues from there. */
+static void
+discard_recent_states(int actions)
+{
+    while (recent_count && newest_recent_state(0)->actions > actions) {
+        free_recent_state(newest_recent_state(0));
+        recent_head = (recent_head + RECENT_STATES - 1) % RECENT_STATES;
+        recent_count--;
+    }
+}
+
+
+/* Rewind the entire game state to a checkpoint or recent state. Returns the
+   number of actions at that point. */
 static int
-load_checkpoint(int idx)
+load_replay_state(struct replay_checkpoint *cp)
 {
     int playmode, i, irole, irace, igend, ialign;
     boolean cmd_invalid, diff_invalid;
     char namebuf[BUFSZ];
 
-    if (idx < 0 || idx >= cpcount)
-        return -1;
-
     cmd_invalid = loginfo.cmds_are_invalid;
     diff_invalid = loginfo.diffs_are_invalid;
     loginfo.out_of_sync = FALSE;        /* we're destroying saved state anyway */
@@ -1207,15 +1295,15 @@ load_checkpoint(int idx)
     replay_begin();
     replay_read_newgame(&turntime, &playmode, namebuf, &irole, &irace, &igend,
                         &ialign);
-    fseek(loginfo.flog, checkpoints[idx].nexttoken, SEEK_SET);
+    fseek(loginfo.flog, cp->nexttoken, SEEK_SET);
 
     loginfo.cmds_are_invalid = cmd_invalid;
     loginfo.diffs_are_invalid = diff_invalid;
 
     program_state.restoring = TRUE;
     startup_common(namebuf, playmode);
-    dorecover(&checkpoints[idx].cpdata);
-    checkpoints[idx].cpdata.pos = 0;
+    dorecover(&cp->cpdata);
+    cp->cpdata.pos = 0;
 
     mfree(&diff_base);
     mnew(&diff_base, NULL);
@@ -1225,13 +1313,23 @@ load_checkpoint(int idx)
     program_state.game_running = TRUE;
 
     /* restore the full option state of the time of the checkpoint */
-    for (i = 0; checkpoints[idx].opt[i].name; i++)
-        nh_set_option(checkpoints[idx].opt[i].name,
-                      checkpoints[idx].opt[i].value, FALSE);
+    for (i = 0; cp->opt[i].name; i++)
+        nh_set_option(cp->opt[i].name, cp->opt[i].value, FALSE);
 
     savegame(&diff_base);
+    discard_recent_states(cp->actions);
 
-    return checkpoints[idx].actions;
+    return cp->actions;
+}
+
+
+static int
+load_checkpoint(int idx)
+{
+    if (idx < 0 || idx >= cpcount)
+        return -1;
+
+    return load_replay_state(&checkpoints[idx]);
 }
 
 
@@ -1247,6 +1345,9 @@ free_checkpoints(void)
     free(checkpoints);
     checkpoints = NULL;
     cpcount = 0;
+
+    discard_recent_states(-1);
+    recent_head = 0;
 }
 
 
@@ -1328,6 +1429,7 @@ nh_view_replay_step(struct nh_replay_info * info, enum replay_control action,
 {
     boolean did_action = FALSE;
     int i, prev_actions, target;
+    struct replay_checkpoint *rs;
     volatile int moves_this_step = true_moves();
 
     if (!program_state.viewing) {
@@ -1363,8 +1465,13 @@ nh_view_replay_step(struct nh_replay_info * info, enum replay_control action,
             if (checkpoints[i + 1].actions >= target)
                 break;
 
-        /* rewind the entire game state to the checkpoint */
-        info->actions = load_checkpoint(i);
+        /* rewind the entire game state to the checkpoint, or to a recent state
+           if that is closer */
+        rs = find_recent_state(target);
+        if (rs && (i >= cpcount || rs->actions >= checkpoints[i].actions))
+            info->actions = load_replay_state(rs);
+        else
+            info->actions = load_checkpoint(i);
         count = target - info->actions;
         if (count == 0) {
             did_action = TRUE;
@@ -1381,6 +1488,7 @@ nh_view_replay_step(struct nh_replay_info * info, enum replay_control action,
             if (did_action) {
                 info->actions++;
                 make_checkpoint(info->actions);
+                record_recent_state(info->actions);
             }
         }
         break;
@@ -1401,6 +1509,7 @@ nh_view_replay_step(struct nh_replay_info * info, enum replay_control action,
             if (did_action) {
                 info->actions++;
                 make_checkpoint(info->actions);
+                record_recent_state(info->actions);
             }
         }
         replay_sync_save();
@@ -1449,6 +1558,7 @@ nh_get_savegame_status(int fd, struct nh_game_info *gi)
     char header[128], status[8], encplname[PL_NSIZ * 2];
     char role[PLRBUFSZ], race[PLRBUFSZ], gend[PLRBUFSZ], algn[PLRBUFSZ];
     int n, v1, v2, v3;
+    boolean compressed = FALSE;
     unsigned int savepos, endpos, seed, playmode;
     struct memfile mf;
     volatile enum nh_log_status ret;
@@ -1475,7 +1585,10 @@ nh_get_savegame_status(int fd, struct nh_game_info *gi)
         ret = LS_CRASHED;
     else if (!strcmp(status, "save"))
         ret = LS_SAVED;
-    else
+    else if (!strcmp(status, "savz")) {
+        ret = LS_SAVED;
+        compressed = TRUE;
+    } else
         return LS_INVALID;
 
     if (ret == LS_SAVED && endpos == savepos)
@@ -1508,10 +1621,15 @@ nh_get_savegame_status(int fd, struct nh_game_info *gi)
 
     lseek(fd, savepos, SEEK_SET);
     if (ret == LS_SAVED) {
-        mf.pos = 0;
-        mf.buf = loadfile(fd, &mf.len);
-        if (!mf.buf)
-            return 0;
+        mnew(&mf, NULL);
+        if (compressed) {
+            if (!load_mf_compressed(fd, &mf))
+                return 0;
+        } else {
+            mf.buf = loadfile(fd, &mf.len);
+            if (!mf.buf)
+                return 0;
+        }
 
         if (!uptodate(&mf, NULL)) {
             free(mf.buf);
@@ -3,6 +3,7 @@
 /* NetHack may be freely redistributed.  See license for details. */
 
 #include "hack.h"
+#include <zlib.h>
 
 #ifdef IS_BIG_ENDIAN
 static unsigned short
@@ -66,27 +67,80 @@ mnew(struct memfile *mf, struct memfile *relativeto)
     mf->curcmd = MDIFF_INVALID; /* no command yet */
     for (i = 0; i < MEMFILE_HASHTABLE_SIZE; i++)
         mf->tags[i] = 0;
+    mf->tagchunks = mf->curchunk = NULL;
 }
 
 void
 mfree(struct memfile *mf)
 {
     int i;
+    struct memfile_tagchunk *chunk, *next;
 
     free(mf->buf);
     mf->buf = 0;
     free(mf->diffbuf);
     mf->diffbuf = 0;
-    for (i = 0; i < MEMFILE_HASHTABLE_SIZE; i++) {
-        struct memfile_tag *tag, *otag;
+    for (i = 0; i < MEMFILE_HASHTABLE_SIZE; i++)
+        mf->tags[i] = 0;
+    for (chunk = mf->tagchunks; chunk; chunk = next) {
+        next = chunk->next;
+        free(chunk);
+    }
+    mf->tagchunks = mf->curchunk = NULL;
+}
 
-        for ((tag = mf->tags[i]), (otag = NULL); tag; tag = tag->next) {
-            free(otag);
-            otag = tag;
-        }
-        free(otag);
+/* Empty a memfile that is going to be written again, like mfree followed by
+   mnew, but keep the buffers and tag chunks it has already allocated. This
+   saves rebuilding them from scratch when the same memfile is reused for
+   every command. */
+void
+mreset(struct memfile *mf, struct memfile *relativeto)
+{
+    int i;
+
+    mf->pos = mf->diffpos = mf->relativepos = 0;
+    mf->relativeto = relativeto;
+    mf->curcmd = MDIFF_INVALID;
+    for (i = 0; i < MEMFILE_HASHTABLE_SIZE; i++)
         mf->tags[i] = 0;
+    mf->curchunk = mf->tagchunks;
+    if (mf->curchunk)
+        mf->curchunk->used = 0;
+}
+
+/* Buffers grow geometrically, so that writing a whole save only needs a few
+   reallocs. */
+static int
+mgrowlen(int len, int needed)
+{
+    if (len < 4096)
+        len = 4096;
+    while (len < needed)
+        len *= 2;
+    return len;
+}
+
+static struct memfile_tag *
+mnewtag(struct memfile *mf)
+{
+    struct memfile_tagchunk *chunk = mf->curchunk;
+
+    if (chunk && chunk->used < MEMFILE_TAGCHUNK_SIZE)
+        return &chunk->tags[chunk->used++];
+
+    if (chunk && chunk->next)
+        chunk = chunk->next;
+    else {
+        chunk = malloc(sizeof (struct memfile_tagchunk));
+        chunk->next = NULL;
+        if (mf->curchunk)
+            mf->curchunk->next = chunk;
+        else
+            mf->tagchunks = chunk;
     }
+    mf->curchunk = chunk;
+    chunk->used = 1;
+    return &chunk->tags[0];
 }
 
 /* Functions for writing to a memory file.
@@ -100,15 +154,10 @@ mfree(struct memfile *mf)
 void
 mwrite(struct memfile *mf, const void *buf, unsigned int num)
 {
-    boolean do_realloc = FALSE;
-
-    while (mf->len < mf->pos + num) {
-        mf->len += 4096;
-        do_realloc = TRUE;
-    }
-
-    if (do_realloc)
+    if (mf->len < mf->pos + num) {
+        mf->len = mgrowlen(mf->len, mf->pos + num);
         mf->buf = realloc(mf->buf, mf->len);
+    }
     memcpy(&mf->buf[mf->pos], buf, num);
 
     if (!mf->relativeto) {
@@ -164,38 +213,116 @@ mwrite32(struct memfile *mf, int32_t value)
 }
 
 
-void
-store_mf(int fd, struct memfile *mf)
+static boolean
+write_all(int fd, const char *buf, int len)
 {
-    int len, left, ret;
+    int ret;
 
-    len = left = mf->pos;
-    while (left) {
-        ret = write(fd, &mf->buf[len - left], left);
+    while (len) {
+        ret = write(fd, buf, len);
         if (ret == -1)  /* error */
-            goto out;
-        left -= ret;
+            return FALSE;
+        buf += ret;
+        len -= ret;
     }
+    return TRUE;
+}
+
+
+void
+store_mf(int fd, struct memfile *mf)
+{
+    write_all(fd, mf->buf, mf->pos);
 
-out:
     mfree(mf);
     mnew(mf, NULL);
 }
 
+
+/* Like store_mf, but the data is deflated on the way to the file. The output
+   goes out in small chunks, so there is never a second copy of the save in
+   memory. */
+void
+store_mf_compressed(int fd, struct memfile *mf)
+{
+    z_stream strm;
+    unsigned char out[16384];
+
+    memset(&strm, 0, sizeof (strm));
+    if (deflateInit(&strm, Z_DEFAULT_COMPRESSION) != Z_OK)
+        panic("Could not initialize the save compression!");
+
+    strm.next_in = (unsigned char *)mf->buf;
+    strm.avail_in = mf->pos;
+    do {
+        strm.next_out = out;
+        strm.avail_out = sizeof (out);
+        if (deflate(&strm, Z_FINISH) == Z_STREAM_ERROR ||
+            !write_all(fd, (char *)out, sizeof (out) - strm.avail_out))
+            break;
+    } while (strm.avail_out == 0);
+    deflateEnd(&strm);
+
+    mfree(mf);
+    mnew(mf, NULL);
+}
+
+
+/* Read the deflated data written by store_mf_compressed, from the current
+   position of fd up to the end of the file. The data is inflated directly
+   into the buffer of mf, which must be empty. Returns FALSE if the data is
+   damaged. */
+boolean
+load_mf_compressed(int fd, struct memfile *mf)
+{
+    z_stream strm;
+    unsigned char in[16384];
+    int ret = Z_OK, n;
+
+    memset(&strm, 0, sizeof (strm));
+    if (inflateInit(&strm) != Z_OK)
+        return FALSE;
+
+    while (ret == Z_OK) {
+        if (strm.avail_in == 0) {
+            n = read(fd, in, sizeof (in));
+            if (n <= 0)
+                break;  /* the stream ended early */
+            strm.next_in = in;
+            strm.avail_in = n;
+        }
+        if (mf->pos == mf->len) {
+            mf->len = mgrowlen(mf->len, mf->len + 1);
+            mf->buf = realloc(mf->buf, mf->len);
+        }
+        strm.next_out = (unsigned char *)&mf->buf[mf->pos];
+        strm.avail_out = mf->len - mf->pos;
+        ret = inflate(&strm, Z_NO_FLUSH);
+        mf->pos = mf->len - strm.avail_out;
+    }
+    inflateEnd(&strm);
+
+    if (ret != Z_STREAM_END) {
+        free(mf->buf);
+        mf->buf = NULL;
+        mf->len = mf->pos = 0;
+        return FALSE;
+    }
+
+    mf->len = mf->pos;
+    mf->pos = 0;
+    return TRUE;
+}
+
 /* Writing to the diff portion of memfiles; more complicated than
    regular writes, because it's RLEd. */
 static void
 mdiffwrite(struct memfile *mf, const void *buf, unsigned int num)
 {
-    boolean do_realloc = FALSE;
-
-    while (mf->difflen < mf->diffpos + num) {
-        mf->difflen += 4096;
-        do_realloc = TRUE;
-    }
-
-    if (do_realloc)
+    if (mf->difflen < mf->diffpos + num) {
+        mf->difflen = mgrowlen(mf->difflen, mf->diffpos + num);
         mf->diffbuf = realloc(mf->diffbuf, mf->difflen);
+    }
     memcpy(&mf->diffbuf[mf->diffpos], buf, num);
     mf->diffpos += num;
 }
@@ -235,7 +362,7 @@ mtag(struct memfile *mf, long tagdata, enum memfile_tagtype tagtype)
     /* 619 is chosen here because it's a prime number, and it's approximately
        in the golden ratio with MEMFILE_HASHTABLE_SIZE. */
     int bucket = (tagdata * 619 + (int)tagtype) % MEMFILE_HASHTABLE_SIZE;
-    struct memfile_tag *tag = malloc(sizeof (struct memfile_tag));
+    struct memfile_tag *tag = mnewtag(mf);
 
     tag->next = mf->tags[bucket];
     tag->tagdata = tagdata;
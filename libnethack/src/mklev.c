@@ -886,7 +886,7 @@ mklev(d_level * levnum)
     int ln = ledger_no(levnum);
     struct level *lev;
 
-    if (levels[ln])
+    if (load_level(ln))
         return levels[ln];
 
     if (getbones(levnum))
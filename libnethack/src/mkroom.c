@@ -25,7 +25,7 @@ static void mktemple(struct level *lev);
 static coord *shrine_pos(struct level *lev, int roomno);
 static const struct permonst *morguemon(const d_level * dlev);
 static const struct permonst *squadmon(const d_level * dlev);
-static void save_room(struct memfile *mf, struct mkroom *);
+static unsigned char *pack_room(unsigned char *p, const struct mkroom *r);
 static void rest_room(struct memfile *mf, struct level *lev, struct mkroom *r);
 static boolean has_dnstairs(struct level *lev, struct mkroom *);
 static boolean has_upstairs(struct level *lev, struct mkroom *);
@@ -663,30 +663,34 @@ gotone:
         return NULL;
 }
 
+/* bytes per room (or subroom) in a saved level */
+#define ROOM_SAVE_SIZE 10
+
 /*
- * save_room : A recursive function that saves a room and its subrooms
- * (if any).
+ * pack_room : A recursive function that packs a room and its subrooms
+ * (if any) into p. Returns the position after the last byte written.
  */
-static void
-save_room(struct memfile *mf, struct mkroom *r)
+static unsigned char *
+pack_room(unsigned char *p, const struct mkroom *r)
 {
     short i;
 
     /* no tag; we tag room saving once per level, because the rooms don't
        change in number once the level is created */
-    mwrite8(mf, r->lx);
-    mwrite8(mf, r->hx);
-    mwrite8(mf, r->ly);
-    mwrite8(mf, r->hy);
-    mwrite8(mf, r->rtype);
-    mwrite8(mf, r->rlit);
-    mwrite8(mf, r->doorct);
-    mwrite8(mf, r->fdoor);
-    mwrite8(mf, r->nsubrooms);
-    mwrite8(mf, r->irregular);
+    *p++ = r->lx;
+    *p++ = r->hx;
+    *p++ = r->ly;
+    *p++ = r->hy;
+    *p++ = r->rtype;
+    *p++ = r->rlit;
+    *p++ = r->doorct;
+    *p++ = r->fdoor;
+    *p++ = r->nsubrooms;
+    *p++ = r->irregular;
 
     for (i = 0; i < r->nsubrooms; i++)
-        save_room(mf, r->sbrooms[i]);
+        p = pack_room(p, r->sbrooms[i]);
+    return p;
 }
 
 /*
@@ -696,13 +700,17 @@ void
 save_rooms(struct memfile *mf, struct level *lev)
 {
     short i;
+    /* rooms[] holds the subrooms as well */
+    unsigned char buf[SIZE(lev->rooms) * ROOM_SAVE_SIZE], *p = buf;
 
     mtag(mf, ledger_no(&lev->z), MTAG_ROOMS);
     mfmagic_set(mf, ROOMS_MAGIC);       /* "RDAT" */
     /* First, write the number of rooms */
     mwrite32(mf, lev->nroom);
+    /* then all the rooms in one go */
     for (i = 0; i < lev->nroom; i++)
-        save_room(mf, &lev->rooms[i]);
+        p = pack_room(p, &lev->rooms[i]);
+    mwrite(mf, buf, p - buf);
 }
 
 static void
@@ -5,6 +5,10 @@
 #include "hack.h"
 #include "lev.h"
 
+#ifdef COMPRESS_PACKED_LEVELS
+# include <zlib.h>
+#endif
+
 static void find_lev_obj(struct level *lev);
 static void restlevchn(struct memfile *mf);
 static void restdamage(struct memfile *mf, struct level *lev, boolean ghostly);
@@ -17,6 +21,9 @@ static void freefruitchn(struct fruit *);
 static void ghostfruit(struct obj *);
 static void restgamestate(struct memfile *mf);
 static void reset_oattached_mids(boolean ghostly, struct level *lev);
+static int *read_level_index(struct memfile *mf, int count, int end);
+static void keep_packed_level(struct memfile *mf, xchar levnum, int len);
+static void pack_level(xchar levnum);
 
 /*
  * Save a mapping of IDs from ghost levels to the current level.  This
@@ -43,6 +50,41 @@ static struct bucket *id_map = 0;
 boolean restoring = FALSE;
 static struct fruit *oldfruit;
 
+/*
+ * Levels the hero is not on are kept packed, as a copy of their part of the
+ * save, and only unpacked by load_level() when something needs them. Levels
+ * are packed when the hero leaves them (see pack_other_levels), and when a
+ * game is restored only the current one is unpacked; the latter needs the
+ * level index at the end of the save (see savegame), so saves without one are
+ * restored in full. While a level is packed, savegame() writes the copy back
+ * out as it is.
+ */
+struct packed_level {
+    char *data; /* the level as getlev reads it, possibly deflated */
+    int len;    /* its length */
+    int stored; /* the number of bytes in data */
+    unsigned int *oids; /* sorted IDs of the objects on the level */
+    int noids;  /* their number; -1 if the level was packed by the restore */
+};
+
+/* mfmagic_check must not see a file position below 4 */
+#define PACKED_LEVEL_PAD 4
+
+static struct packed_level packed_levels[MAXLINFO];
+
+static void index_packed_level(struct packed_level *pl, struct level *lev);
+
+/* Set while load_level unpacks a level in the middle of the game. That can
+   happen at any time, e.g. for #overview, so getlev must not touch the
+   display, vision or the RNG then. */
+static boolean unpacking_level;
+
+static struct {
+    unsigned long long restore_usec;    /* the last call to dorecover */
+    unsigned long long unpack_usec;     /* unpacking levels since then */
+    int unpacked;       /* levels unpacked since then */
+} restore_stats;
+
 #define Is_IceBox(o) ((o)->otyp == ICE_BOX ? TRUE : FALSE)
 
 /* Recalculate lev->objects[x][y], since this info was not saved. */
@@ -146,13 +188,18 @@ restdamage(struct memfile *mf, struct level *lev, boolean ghostly)
         strcpy(damaged_shops,
                in_rooms(lev, tmp_dam->place.x, tmp_dam->place.y, SHOPBASE));
 
-        for (shp = damaged_shops; *shp; shp++) {
-            struct monst *shkp = shop_keeper(lev, *shp);
+        /* Only repair shop damage on a real restore; on a level that was just
+           unpacked, it's left for pay_for_damage and remote_burglary. */
+        if (unpacking_level)
+            shp = NULL;
+        else
+            for (shp = damaged_shops; *shp; shp++) {
+                struct monst *shkp = shop_keeper(lev, *shp);
 
-            if (shkp && inhishop(shkp) &&
-                repair_damage(lev, shkp, tmp_dam, TRUE))
-                break;
-        }
+                if (shkp && inhishop(shkp) &&
+                    repair_damage(lev, shkp, tmp_dam, TRUE))
+                    break;
+            }
 
         if (!shp || !*shp) {
             tmp_dam->next = lev->damagelist;
@@ -553,10 +600,11 @@ restore_flags(struct memfile *mf, struct flag *f)
 int
 dorecover(struct memfile *mf)
 {
-    int count;
+    int count, i, *index;
     xchar ltmp;
     struct obj *otmp;
     struct monst *mtmp;
+    unsigned long long start_time = get_usec();
 
     int temp_pos;       /* in case we're both reading and writing the file */
 
@@ -587,12 +635,22 @@ dorecover(struct memfile *mf)
     restore_dungeon(mf);
     restlevchn(mf);
 
-    /* restore levels */
+    /* restore levels; a memfile that was being written ends at its old
+       position, one that was loaded at its length */
     count = mread32(mf);
-    for (; count; count--) {
+    index = read_level_index(mf, count, temp_pos ? temp_pos : mf->len);
+    for (i = 0; i < count; i++) {
         ltmp = mread8(mf);
-        getlev(mf, ltmp, FALSE);
+        if (index && index[2 * i] != mf->pos) {
+            free(index);        /* doesn't match the save; don't trust it */
+            index = NULL;
+        }
+        if (index && ltmp != ledger_no(&u.uz))
+            keep_packed_level(mf, ltmp, index[2 * i + 1]);
+        else
+            getlev(mf, ltmp, FALSE);
     }
+    free(index);
 
     restgamestate(mf);
 
@@ -626,6 +684,10 @@ dorecover(struct memfile *mf)
 
     flags.move = 0;
 
+    restore_stats.restore_usec = get_usec() - start_time;
+    restore_stats.unpack_usec = 0;
+    restore_stats.unpacked = 0;
+
     /* Success! */
     mf->pos = temp_pos;
     return 1;
@@ -645,9 +707,14 @@ dorecover_fd(int infd)
     restoring = TRUE;
 
     initial_pos = lseek(infd, 0, SEEK_CUR);
-    mf.buf = loadfile(infd, &mf.len);
-    if (!mf.buf)
-        return 0;
+    if (log_save_compressed(infd)) {
+        if (!load_mf_compressed(infd, &mf))
+            return 0;
+    } else {
+        mf.buf = loadfile(infd, &mf.len);
+        if (!mf.buf)
+            return 0;
+    }
 
     ret = dorecover(&mf);
 
@@ -663,6 +730,319 @@ dorecover_fd(int infd)
 }
 
 
+/*
+ * Find the level index at the end of a save that ends at end. It consists of
+ * LEVINDEX_MAGIC, the position and length of each of the count levels, then
+ * count and LEVINDEX_MAGIC again. Returns the positions and lengths, or NULL
+ * if there's no index.
+ */
+static int *
+read_level_index(struct memfile *mf, int count, int end)
+{
+    int i, pos = mf->pos, start = end - 8 * count - 12;
+    int *index;
+
+    if (count <= 0 || start < pos)
+        return NULL;
+
+    mf->pos = end - 8;
+    if (mread32(mf) != count || mread32(mf) != LEVINDEX_MAGIC) {
+        mf->pos = pos;
+        return NULL;
+    }
+    mf->pos = start;
+    if (mread32(mf) != LEVINDEX_MAGIC) {
+        mf->pos = pos;
+        return NULL;
+    }
+
+    index = malloc(2 * count * sizeof (int));
+    for (i = 0; i < 2 * count; i++)
+        index[i] = mread32(mf);
+    mf->pos = pos;
+
+    for (i = 0; i < count; i++)
+        if (index[2 * i] < pos || index[2 * i + 1] <= 0 ||
+            index[2 * i] + index[2 * i + 1] > start) {
+            free(index);
+            return NULL;
+        }
+    return index;
+}
+
+
+/* Store len bytes from buf as the packed copy of a level. */
+static void
+set_packed_level(struct packed_level *pl, const char *buf, int len)
+{
+#ifdef COMPRESS_PACKED_LEVELS
+    uLongf clen = compressBound(len);
+
+    pl->data = malloc(clen);
+    if (compress2((Bytef *) pl->data, &clen, (const Bytef *)buf, len,
+                  Z_BEST_SPEED) == Z_OK && clen < len) {
+        pl->data = realloc(pl->data, clen);
+        pl->stored = clen;
+    } else {
+        pl->data = realloc(pl->data, len);
+        memcpy(pl->data, buf, len);
+        pl->stored = len;
+    }
+#else
+    pl->data = malloc(len);
+    memcpy(pl->data, buf, len);
+    pl->stored = len;
+#endif
+    pl->len = len;
+}
+
+
+/* Copy a packed level into buf, which has room for pl->len bytes. */
+static void
+get_packed_level(const struct packed_level *pl, char *buf)
+{
+#ifdef COMPRESS_PACKED_LEVELS
+    uLongf len = pl->len;
+
+    if (pl->stored != pl->len) {
+        if (uncompress((Bytef *) buf, &len, (const Bytef *)pl->data,
+                       pl->stored) != Z_OK || len != pl->len)
+            panic("get_packed_level: a packed level is corrupt");
+        return;
+    }
+#endif
+    memcpy(buf, pl->data, pl->len);
+}
+
+
+static void
+keep_packed_level(struct memfile *mf, xchar levnum, int len)
+{
+    if (level_exists(levnum))
+        panic("Unsupported: trying to restore level %d which already exists.\n",
+              levnum);
+    if (mf->pos + len > mf->len)
+        panic("Error reading game data.");
+
+    set_packed_level(&packed_levels[levnum], mf->buf + mf->pos, len);
+    packed_levels[levnum].oids = NULL;
+    packed_levels[levnum].noids = -1;   /* unknown until it's unpacked */
+    mf->pos += len;
+}
+
+
+boolean
+level_exists(xchar levnum)
+{
+    return levels[levnum] || packed_levels[levnum].data;
+}
+
+
+boolean
+level_is_packed(xchar levnum)
+{
+    return !levels[levnum] && packed_levels[levnum].data;
+}
+
+
+/* Return levels[levnum], unpacking it first if necessary. Returns NULL if the
+   level hasn't been created yet. */
+struct level *
+load_level(xchar levnum)
+{
+    struct packed_level *pl = &packed_levels[levnum];
+    struct memfile mf;
+    unsigned long long start_time;
+
+    if (levels[levnum] || !pl->data)
+        return levels[levnum];
+
+    start_time = get_usec();
+    mnew(&mf, NULL);
+    mf.len = PACKED_LEVEL_PAD + pl->len;
+    mf.buf = malloc(mf.len);
+    memset(mf.buf, 0, PACKED_LEVEL_PAD);
+    get_packed_level(pl, mf.buf + PACKED_LEVEL_PAD);
+    mf.pos = PACKED_LEVEL_PAD;
+    free(pl->data);
+    pl->data = NULL;    /* getlev must see the level as new */
+    free(pl->oids);
+    pl->oids = NULL;
+
+    unpacking_level = TRUE;
+    getlev(&mf, levnum, FALSE);
+    unpacking_level = FALSE;
+    if (mf.pos != mf.len)
+        impossible("load_level: level %d has %d bytes left over", levnum,
+                   mf.len - mf.pos);
+    mfree(&mf);
+
+    restore_stats.unpack_usec += get_usec() - start_time;
+    restore_stats.unpacked++;
+    return levels[levnum];
+}
+
+
+/* Turn a level into its packed copy; the reverse of load_level. */
+static void
+pack_level(xchar levnum)
+{
+    static const char pad[PACKED_LEVEL_PAD];
+    struct memfile mf;
+
+    mnew(&mf, NULL);
+    mwrite(&mf, pad, PACKED_LEVEL_PAD);
+    savelev(&mf, levnum);
+    set_packed_level(&packed_levels[levnum], mf.buf + PACKED_LEVEL_PAD,
+                     mf.pos - PACKED_LEVEL_PAD);
+    mfree(&mf);
+    index_packed_level(&packed_levels[levnum], levels[levnum]);
+    freelev(levnum);
+}
+
+
+static void
+collect_oids(const struct obj *chain, unsigned int **oids, int *count,
+             int *size)
+{
+    for (; chain; chain = chain->nobj) {
+        if (*count == *size) {
+            *size = *size ? *size * 2 : 64;
+            *oids = realloc(*oids, *size * sizeof (unsigned int));
+        }
+        (*oids)[(*count)++] = chain->o_id;
+        if (Has_contents(chain))
+            collect_oids(chain->cobj, oids, count, size);
+    }
+}
+
+
+static int
+compare_oids(const void *a, const void *b)
+{
+    unsigned int ida = *(const unsigned int *)a, idb = *(const unsigned int *)b;
+
+    return ida < idb ? -1 : ida > idb;
+}
+
+
+/* Record the IDs of the objects find_oid_lev would find on lev, so that
+   find_oid can skip packed levels without unpacking them. */
+static void
+index_packed_level(struct packed_level *pl, struct level *lev)
+{
+    const struct monst *mon;
+    int size = 0;
+
+    pl->oids = NULL;
+    pl->noids = 0;
+    collect_oids(lev->objlist, &pl->oids, &pl->noids, &size);
+    collect_oids(lev->buriedobjlist, &pl->oids, &pl->noids, &size);
+    for (mon = lev->monlist; mon; mon = mon->nmon)
+        collect_oids(mon->minvent, &pl->oids, &pl->noids, &size);
+
+    if (pl->noids)
+        qsort(pl->oids, pl->noids, sizeof (unsigned int), compare_oids);
+}
+
+
+/* Could the object with the given ID be on the packed level? Levels that
+   have been packed since the restore know their objects; any other one has to
+   be unpacked to find out. */
+boolean
+packed_level_has_oid(xchar levnum, unsigned int id)
+{
+    const struct packed_level *pl = &packed_levels[levnum];
+
+    if (!level_is_packed(levnum))
+        return FALSE;
+    if (pl->noids < 0)
+        return TRUE;
+    return pl->noids && bsearch(&id, pl->oids, pl->noids,
+                                sizeof (unsigned int), compare_oids);
+}
+
+
+boolean
+obj_on_level(struct obj *obj, struct level *lev)
+{
+    return obj && (obj->olev == lev || find_oid_lev(lev, obj->o_id) == obj);
+}
+
+
+/*
+ * Pack all levels apart from the current one. This is called between
+ * commands, when nothing outside the current level should point into a level,
+ * just like when the game is saved. The exceptions are the objects that
+ * savegamestate() remembers by ID; levels they are on stay unpacked.
+ */
+void
+pack_other_levels(void)
+{
+    int i, cur = ledger_no(&u.uz);
+
+    for (i = 1; i <= maxledgerno(); i++)
+        if (levels[i] && i != cur && !obj_on_level(book, levels[i]) &&
+            !food_on_level(levels[i]))
+            pack_level(i);
+}
+
+
+/* the counterpart of savelev for levels that are still packed */
+void
+save_packed_level(struct memfile *mf, xchar levnum)
+{
+    struct packed_level *pl = &packed_levels[levnum];
+    char *buf;
+
+    if (pl->stored == pl->len) {
+        mwrite(mf, pl->data, pl->len);
+        return;
+    }
+
+    buf = malloc(pl->len);
+    get_packed_level(pl, buf);
+    mwrite(mf, buf, pl->len);
+    free(buf);
+}
+
+
+void
+free_packed_levels(void)
+{
+    int i;
+
+    for (i = 0; i < MAXLINFO; i++) {
+        free(packed_levels[i].data);
+        packed_levels[i].data = NULL;
+        free(packed_levels[i].oids);
+        packed_levels[i].oids = NULL;
+    }
+}
+
+
+/* Returns the unpacked size of a packed level and sets *stored to the number
+   of bytes it takes up; returns 0 if the level isn't packed. */
+int
+packed_level_size(xchar levnum, int *stored)
+{
+    if (!level_is_packed(levnum))
+        return 0;
+    *stored = packed_levels[levnum].stored;
+    return packed_levels[levnum].len;
+}
+
+
+void
+get_restore_stats(unsigned long long *restore_usec,
+                  unsigned long long *unpack_usec, int *unpacked)
+{
+    *restore_usec = restore_stats.restore_usec;
+    *unpack_usec = restore_stats.unpack_usec;
+    *unpacked = restore_stats.unpacked;
+}
+
+
 void
 trickery(char *reason)
 {
@@ -675,16 +1055,17 @@ trickery(char *reason)
 
 
 static void
-restore_location(struct memfile *mf, struct rm *loc)
+unpack_location(const unsigned char *p, struct rm *loc)
 {
     unsigned int lflags1;
     unsigned short lflags2;
     int l = 0, t = 0;
 
-    lflags1 = mread32(mf);
-    loc->typ = mread8(mf);
-    loc->seenv = mread8(mf);
-    lflags2 = mread16(mf);
+    /* see pack_location() in save.c */
+    lflags1 = p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+    loc->typ = (schar) p[4];
+    loc->seenv = p[5];
+    lflags2 = p[6] | (p[7] << 8);
     loc->mem_bg = (lflags1 >> 26) & 63;
     loc->mem_trap = (lflags1 >> 21) & 31;
     loc->mem_obj = (lflags1 >> 11) & 1023;
@@ -801,6 +1182,7 @@ getlev(struct memfile *mf, xchar levnum, boolean ghostly)
     int x, y;
     unsigned int lflags;
     struct level *lev;
+    unsigned char locbuf[COLNO * ROWNO * LOCATION_SAVE_SIZE], *p;
 
     if (ghostly)
         clear_id_mapping();
@@ -813,7 +1195,7 @@ getlev(struct memfile *mf, xchar levnum, boolean ghostly)
     /* for bones files, there is fruit chain data before the level data */
     mfmagic_check(mf, LEVEL_MAGIC);
 
-    if (levels[levnum])
+    if (level_exists(levnum))
         panic("Unsupported: trying to restore level %d which already exists.\n",
               levnum);
     lev = levels[levnum] = alloc_level(NULL);
@@ -821,9 +1203,13 @@ getlev(struct memfile *mf, xchar levnum, boolean ghostly)
     lev->z.dnum = mread8(mf);
     lev->z.dlevel = mread8(mf);
     mread(mf, lev->levname, sizeof (lev->levname));
+    mread(mf, locbuf, sizeof (locbuf));
+    p = locbuf;
     for (x = 0; x < COLNO; x++)
-        for (y = 0; y < ROWNO; y++)
-            restore_location(mf, &lev->locations[x][y]);
+        for (y = 0; y < ROWNO; y++) {
+            unpack_location(p, &lev->locations[x][y]);
+            p += LOCATION_SAVE_SIZE;
+        }
 
     lev->lastmoves = mread32(mf);
     mread(mf, &lev->upstair, sizeof (stairway));
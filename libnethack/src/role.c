@@ -477,7 +477,7 @@ randrole(void)
 
 
 int
-str2role(char *str)
+str2role(const char *str)
 {
     int i, len;
 
@@ -545,7 +545,7 @@ randrace(int rolenum)
 
 
 int
-str2race(char *str)
+str2race(const char *str)
 {
     int i, len;
 
@@ -584,7 +584,7 @@ validgend(int rolenum, int racenum, int gendnum)
 
 
 int
-str2gend(char *str)
+str2gend(const char *str)
 {
     int i, len;
 
@@ -650,7 +650,7 @@ randalign(int rolenum, int racenum)
 
 
 int
-str2align(char *str)
+str2align(const char *str)
 {
     int i, len;
 
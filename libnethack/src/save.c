@@ -78,7 +78,11 @@ dosave0(boolean emergency)
                            an impossible() call */
 
     savegame(&mf);
+#ifdef COMPRESS_SAVES
+    store_mf_compressed(fd, &mf);       /* also frees mf */
+#else
     store_mf(fd, &mf);  /* also frees mf */
+#endif
 
     freedynamicdata();
 
@@ -89,7 +93,8 @@ dosave0(boolean emergency)
 void
 savegame(struct memfile *mf)
 {
-    int count = 0;
+    int count = 0, i, start = mf->pos;
+    int levindex[2 * MAXLINFO];
     xchar ltmp;
 
     /* no tag useful here as store_version adds one */
@@ -110,17 +115,33 @@ savegame(struct memfile *mf)
     /* store levels */
     mtag(mf, 0, MTAG_LEVELS);
     for (ltmp = 1; ltmp <= maxledgerno(); ltmp++)
-        if (levels[ltmp])
+        if (level_exists(ltmp))
             count++;
     mwrite32(mf, count);
-    for (ltmp = 1; ltmp <= maxledgerno(); ltmp++) {
-        if (!levels[ltmp])
+    for (ltmp = 1, i = 0; ltmp <= maxledgerno(); ltmp++) {
+        if (!level_exists(ltmp))
             continue;
         mtag(mf, ltmp, MTAG_LEVELS);
         mwrite8(mf, ltmp);      /* level number */
-        savelev(mf, ltmp);      /* actual level */
+        levindex[i] = mf->pos - start;
+        if (level_is_packed(ltmp))
+            save_packed_level(mf, ltmp);        /* not changed since restore */
+        else
+            savelev(mf, ltmp);  /* actual level */
+        levindex[i + 1] = mf->pos - start - levindex[i];
+        i += 2;
     }
     savegamestate(mf);
+
+    /* The level index lets dorecover find the levels without reading them.
+       It's at the very end so that it can be found from there, and ignored by
+       anything that doesn't care about it. */
+    mtag(mf, 0, MTAG_LEVELINDEX);
+    mwrite32(mf, LEVINDEX_MAGIC);
+    for (i = 0; i < 2 * count; i++)
+        mwrite32(mf, levindex[i]);
+    mwrite32(mf, count);
+    mwrite32(mf, LEVINDEX_MAGIC);
 }
 
 
@@ -278,8 +299,11 @@ savegamestate(struct memfile *mf)
 }
 
 
+/* Pack a location into LOCATION_SAVE_SIZE bytes. The layout is the one that
+   mwrite32, mwrite8, mwrite8, mwrite16 of memflags, typ, seenv and rflags
+   would write, so that a whole level can be written in one go. */
 static void
-save_location(struct memfile *mf, struct rm *loc)
+pack_location(unsigned char *p, const struct rm *loc)
 {
     unsigned int memflags;
     unsigned short rflags;
@@ -327,10 +351,14 @@ save_location(struct memfile *mf, struct rm *loc)
         (loc->mem_stepped << 0);
     rflags = (loc->flags << 11) | (loc->horizontal << 10) | (loc->lit << 9) |
         (loc->waslit << 8) | (loc->roomno << 2) | (loc->edge << 1);
-    mwrite32(mf, memflags);
-    mwrite8(mf, loc->typ);
-    mwrite8(mf, loc->seenv);
-    mwrite16(mf, rflags);
+    p[0] = memflags & 0xff;
+    p[1] = (memflags >> 8) & 0xff;
+    p[2] = (memflags >> 16) & 0xff;
+    p[3] = (memflags >> 24) & 0xff;
+    p[4] = (unsigned char)loc->typ;
+    p[5] = loc->seenv;
+    p[6] = rflags & 0xff;
+    p[7] = (rflags >> 8) & 0xff;
 }
 
 
@@ -340,6 +368,7 @@ savelev(struct memfile *mf, xchar levnum)
     int x, y;
     unsigned int lflags;
     struct level *lev = levels[levnum];
+    unsigned char locbuf[COLNO * ROWNO * LOCATION_SAVE_SIZE], *p;
 
     /* The purge_monsters count refers to monsters on the current level. */
     if (iflags.purge_monsters && levnum == ledger_no(&u.uz)) {
@@ -357,9 +386,13 @@ savelev(struct memfile *mf, xchar levnum)
     mwrite8(mf, lev->z.dlevel);
     mwrite(mf, lev->levname, sizeof (lev->levname));
 
+    p = locbuf;
     for (x = 0; x < COLNO; x++)
-        for (y = 0; y < ROWNO; y++)
-            save_location(mf, &lev->locations[x][y]);
+        for (y = 0; y < ROWNO; y++) {
+            pack_location(p, &lev->locations[x][y]);
+            p += LOCATION_SAVE_SIZE;
+        }
+    mwrite(mf, locbuf, sizeof (locbuf));
 
     mwrite32(mf, lev->lastmoves);
     mwrite(mf, &lev->upstair, sizeof (stairway));
@@ -665,10 +698,12 @@ freedynamicdata(void)
 
     unload_qtlist();
     free_invbuf();      /* let_to_name (invent.c) */
+    free_invnames();    /* make_invlist (invent.c) */
     free_youbuf();      /* You_buf,&c (pline.c) */
     tmpsym_freeall();    /* temporary display effects */
 #define free_animals()   mon_animal_list(FALSE)
 
+    free_packed_levels();
     for (i = 0; i < MAXLINFO; i++) {
         lev = levels[i];
         levels[i] = NULL;
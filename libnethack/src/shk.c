@@ -59,7 +59,6 @@ static void dropped_container(struct obj *, struct monst *, boolean);
 static void add_to_billobjs(struct obj *);
 static void bill_box_content(struct obj *, boolean, boolean, struct monst *);
 static boolean rob_shop(struct monst *);
-static struct obj *find_oid_lev(struct level *lev, unsigned id);
 
 /*
     invariants: obj->unpaid iff onbill(obj) [unless bp->useup]
@@ -173,7 +172,7 @@ void
 shkgone(struct monst *mtmp)
 {
     struct eshk *eshk = ESHK(mtmp);
-    struct level *shoplev = levels[ledger_no(&eshk->shoplevel)];
+    struct level *shoplev = load_level(ledger_no(&eshk->shoplevel));
     struct mkroom *sroom = &shoplev->rooms[eshk->shoproom - ROOMOFFSET];
     struct obj *otmp;
     char *p;
@@ -1648,7 +1647,7 @@ bp_to_obj(struct bill_x *bp)
 }
 
 
-static struct obj *
+struct obj *
 find_oid_lev(struct level *lev, unsigned id)
 {
     struct obj *obj;
@@ -1699,6 +1698,13 @@ find_oid(unsigned id)
         if (levels[i] && (obj = find_oid_lev(levels[i], id)))
             return obj;
 
+    /* and finally the packed ones; only a level that has the object (or that
+       hasn't been unpacked since the restore, so it might) is unpacked */
+    for (i = 0; i < maxledgerno(); i++)
+        if (packed_level_has_oid(i, id) &&
+            (obj = find_oid_lev(load_level(i), id)))
+            return obj;
+
     /* not found at all */
     return NULL;
 }
@@ -2847,7 +2853,7 @@ remove_damage(struct monst *shkp, boolean croaked)
     boolean saw_floor = FALSE, stop_picking = FALSE;
     boolean saw_untrap = FALSE;
     uchar saw_walls = 0;
-    struct level *lev = levels[ledger_no(&ESHK(shkp)->shoplevel)];
+    struct level *lev = load_level(ledger_no(&ESHK(shkp)->shoplevel));
 
     tmp_dam = lev->damagelist;
     tmp2_dam = 0;
@@ -9,9 +9,10 @@
 #include "events.h"
 
 #include <fcntl.h>
+#include <sys/mman.h>
 
 /* 10000 highscore entries should be enough for _anybody_
- * <500 bytes per entry * 10000 ~= 5MB max file size. Seems reasonable. */
+ * 192 bytes per entry * 10000 ~= 2MB max file size. Seems reasonable. */
 #define TTLISTLEN 10000
 
 /* maximum number of highscore entries per player */
@@ -41,17 +42,45 @@ struct toptenentry {
 
 #define validentry(x) ((x).points > 0 || (x).deathlev)
 
+/*
+ * The record file is a small header followed by fixed-width binary entries
+ * sorted by descending score. Inserting a new score only shifts the entries
+ * below it by one slot and readers can decode the file without parsing.
+ * Record files in the old text format are converted on the first update.
+ */
+#define RECORD_MAGIC    0x5454484e      /* "NHTT" in little endian */
+#define RECORD_VERSION  1
+#define RECORD_HDRSZ    16      /* magic, version, generation, count */
+#define RECORD_NUMINTS  15      /* number of int fields in struct toptenentry */
+#define RECORD_ENTSZ    (RECORD_NUMINTS * 4 + 4 * (ROLESZ + 1) + \
+                         (NAMSZ + 1) + (DTHSZ + 1))
+
+struct record_header {
+    int magic;
+    int version;
+    int generation;     /* incremented by every change to the file */
+    int count;
+};
+
+/* Decoded copy of the record file, kept until the file changes. */
+static struct topten_cache {
+    dev_t dev;
+    ino_t ino;
+    int generation;
+    int count;
+    struct toptenentry *entries;
+} ttcache = { 0, 0, -1, 0, NULL };
+
 static void writeentry(int fd, const struct toptenentry *tt);
-static void write_topten(int fd, const struct toptenentry *ttlist);
 static void update_log(const struct toptenentry *newtt);
 static boolean readentry(char *line, struct toptenentry *tt);
-static struct toptenentry *read_topten(int fd, int limit);
+static const struct toptenentry *read_topten(int fd, int *count);
 static void fill_topten_entry(struct toptenentry *newtt, int how);
-static boolean toptenlist_insert(struct toptenentry *ttlist,
-                                 struct toptenentry *newtt);
-static int classmon(char *plch, boolean fem);
-static void topten_death_description(struct toptenentry *in, char *outbuf);
-static void fill_nh_score_entry(struct toptenentry *in,
+static boolean toptenlist_insert(int fd, struct toptenentry *newtt);
+static int classmon(const char *plch, boolean fem);
+static void topten_death_description(const struct toptenentry *in,
+                                     char *outbuf);
+static void fill_nh_score_entry(const struct toptenentry *in,
                                 struct nh_topten_entry *out, int rank,
                                 boolean highlight);
 
@@ -240,18 +269,6 @@ writeentry(int fd, const struct toptenentry *tt)
 }
 
 
-static void
-write_topten(int fd, const struct toptenentry *ttlist)
-{
-    int i;
-
-    lseek(fd, 0, SEEK_SET);
-    ftruncate(fd, 0);
-    for (i = 0; i < TTLISTLEN && validentry(ttlist[i]); i++)
-        writeentry(fd, &ttlist[i]);
-}
-
-
 static void
 update_log(const struct toptenentry *newtt)
 {
@@ -301,28 +318,139 @@ readentry(char *line, struct toptenentry *tt)
 }
 
 
+/* Fixed-width encoding of a toptenentry for the binary record file. All ints
+ * are stored little-endian, strings are stored in zero-padded fields. */
+static void
+put_int(unsigned char *out, int val)
+{
+    unsigned int uval = val;
+
+    out[0] = uval & 0xff;
+    out[1] = (uval >> 8) & 0xff;
+    out[2] = (uval >> 16) & 0xff;
+    out[3] = (uval >> 24) & 0xff;
+}
+
+
+static int
+get_int(const unsigned char *in)
+{
+    return (int)((unsigned int)in[0] | (unsigned int)in[1] << 8 |
+                 (unsigned int)in[2] << 16 | (unsigned int)in[3] << 24);
+}
+
+
+static void
+pack_entry(unsigned char *out, const struct toptenentry *tt)
+{
+    const int ints[RECORD_NUMINTS] = {
+        tt->points, tt->deathdnum, tt->deathlev, tt->maxlvl, tt->hp,
+        tt->maxhp, tt->deaths, tt->ver_major, tt->ver_minor, tt->patchlevel,
+        tt->deathdate, tt->birthdate, tt->uid, tt->moves, tt->how
+    };
+    int i;
+
+    memset(out, 0, RECORD_ENTSZ);
+    for (i = 0; i < RECORD_NUMINTS; i++, out += 4)
+        put_int(out, ints[i]);
+
+    strncpy((char *)out, tt->plrole, ROLESZ);
+    out += ROLESZ + 1;
+    strncpy((char *)out, tt->plrace, ROLESZ);
+    out += ROLESZ + 1;
+    strncpy((char *)out, tt->plgend, ROLESZ);
+    out += ROLESZ + 1;
+    strncpy((char *)out, tt->plalign, ROLESZ);
+    out += ROLESZ + 1;
+    strncpy((char *)out, tt->name, NAMSZ);
+    out += NAMSZ + 1;
+    strncpy((char *)out, tt->death, DTHSZ);
+}
+
+
+static void
+unpack_entry(const unsigned char *in, struct toptenentry *tt)
+{
+    int *const ints[RECORD_NUMINTS] = {
+        &tt->points, &tt->deathdnum, &tt->deathlev, &tt->maxlvl, &tt->hp,
+        &tt->maxhp, &tt->deaths, &tt->ver_major, &tt->ver_minor,
+        &tt->patchlevel, &tt->deathdate, &tt->birthdate, &tt->uid,
+        &tt->moves, &tt->how
+    };
+    int i;
+
+    /* zero-fill, so that entries can be compared with memcmp */
+    memset(tt, 0, sizeof (struct toptenentry));
+    for (i = 0; i < RECORD_NUMINTS; i++, in += 4)
+        *ints[i] = get_int(in);
+
+    memcpy(tt->plrole, in, ROLESZ);
+    in += ROLESZ + 1;
+    memcpy(tt->plrace, in, ROLESZ);
+    in += ROLESZ + 1;
+    memcpy(tt->plgend, in, ROLESZ);
+    in += ROLESZ + 1;
+    memcpy(tt->plalign, in, ROLESZ);
+    in += ROLESZ + 1;
+    memcpy(tt->name, in, NAMSZ);
+    in += NAMSZ + 1;
+    memcpy(tt->death, in, DTHSZ);
+}
+
+
+static void
+pack_header(unsigned char *out, const struct record_header *hdr)
+{
+    put_int(out, hdr->magic);
+    put_int(out + 4, hdr->version);
+    put_int(out + 8, hdr->generation);
+    put_int(out + 12, hdr->count);
+}
+
+
+/* Read the header of a binary record file. Returns FALSE if the file is empty,
+ * not in the binary format or has an unusable header. */
+static boolean
+read_record_header(int fd, struct record_header *hdr)
+{
+    unsigned char buf[RECORD_HDRSZ];
+
+    memset(hdr, 0, sizeof (struct record_header));
+    if (pread(fd, buf, RECORD_HDRSZ, 0) != RECORD_HDRSZ)
+        return FALSE;
+
+    hdr->magic = get_int(buf);
+    hdr->version = get_int(buf + 4);
+    hdr->generation = get_int(buf + 8);
+    hdr->count = get_int(buf + 12);
+
+    return hdr->magic == RECORD_MAGIC && hdr->version == RECORD_VERSION &&
+        hdr->count >= 0 && hdr->count <= TTLISTLEN;
+}
+
+
+/* Parse a record file in the old text format (one line per entry, as written
+ * by writeentry). Returns a malloc'd list and the number of entries in it. */
 static struct toptenentry *
-read_topten(int fd, int limit)
+read_text_topten(int fd, int *count)
 {
-    int i, size;
+    int size;
     struct toptenentry *ttlist;
     char *data, *line;
 
+    *count = 0;
     lseek(fd, 0, SEEK_SET);
     data = loadfile(fd, &size);
     if (!data)
-        /* the only sensible reason for not getting any data is that the record
-           file doesn't exist or is empty. If it does have data but is
-           unreadable for some other reason, writing will fail later on, so
-           pretending it's empty won't hurt anything. */
-        return calloc(limit + 1, sizeof (struct toptenentry));
+        return NULL;
 
-    ttlist = calloc(limit + 1, sizeof (struct toptenentry));
+    ttlist = calloc(TTLISTLEN, sizeof (struct toptenentry));
     line = data;
-    for (i = 0; i < limit; i++) {
-        if (!readentry(line, &ttlist[i]))
-            break;
-        line = strchr(line, '\n') + 1;
+    while (*count < TTLISTLEN && line && readentry(line, &ttlist[*count])) {
+        (*count)++;
+        line = strchr(line, '\n');
+        if (line)
+            line++;
     }
 
     free(data);
@@ -330,6 +458,111 @@ read_topten(int fd, int limit)
 }
 
 
+/* Convert a text record file to the binary format in place. The caller must
+ * hold the lock on fd. */
+static void
+convert_record(int fd)
+{
+    struct record_header hdr;
+    struct toptenentry *ttlist;
+    unsigned char *buf;
+    int count, i, len;
+
+    if (read_record_header(fd, &hdr) || hdr.magic == RECORD_MAGIC)
+        return; /* already converted */
+
+    ttlist = read_text_topten(fd, &count);
+
+    hdr.magic = RECORD_MAGIC;
+    hdr.version = RECORD_VERSION;
+    hdr.generation = 0;
+    hdr.count = count;
+
+    len = RECORD_HDRSZ + count * RECORD_ENTSZ;
+    buf = malloc(len);
+    pack_header(buf, &hdr);
+    for (i = 0; i < count; i++)
+        pack_entry(buf + RECORD_HDRSZ + i * RECORD_ENTSZ, &ttlist[i]);
+
+    if (ftruncate(fd, 0) == -1 || pwrite(fd, buf, len, 0) != len)
+        panic("Failed to write topten. Out of disk?");
+
+    free(buf);
+    free(ttlist);
+}
+
+
+/* Get the sorted score list. The returned list belongs to the cache and stays
+ * valid until the next call; it is only re-read if the file has changed since
+ * it was last loaded. */
+static const struct toptenentry *
+read_topten(int fd, int *count)
+{
+    struct record_header hdr;
+    struct stat st;
+    unsigned char *map;
+    size_t maplen;
+    int i;
+
+    *count = 0;
+    if (fd == -1 || fstat(fd, &st) == -1)
+        return NULL;
+
+    if (!read_record_header(fd, &hdr)) {
+        if (hdr.magic == RECORD_MAGIC)
+            return NULL;        /* damaged or from a newer version */
+
+        /* An old text file that has not been converted yet, because no game
+           has ended since the upgrade. Don't cache it. */
+        free(ttcache.entries);
+        ttcache.entries = read_text_topten(fd, &ttcache.count);
+        ttcache.generation = -1;
+        *count = ttcache.count;
+        return ttcache.entries;
+    }
+
+    if (ttcache.entries && ttcache.dev == st.st_dev &&
+        ttcache.ino == st.st_ino && ttcache.generation == hdr.generation &&
+        ttcache.count == hdr.count) {
+        *count = ttcache.count;
+        return ttcache.entries;
+    }
+
+    maplen = RECORD_HDRSZ + (size_t)hdr.count * RECORD_ENTSZ;
+    if (st.st_size < maplen)
+        return NULL;    /* truncated file */
+
+    map = mmap(NULL, maplen, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+        return NULL;
+
+    free(ttcache.entries);
+    ttcache.entries = calloc(hdr.count + 1, sizeof (struct toptenentry));
+    for (i = 0; i < hdr.count; i++)
+        unpack_entry(map + RECORD_HDRSZ + i * RECORD_ENTSZ,
+                     &ttcache.entries[i]);
+    munmap(map, maplen);
+
+    ttcache.dev = st.st_dev;
+    ttcache.ino = st.st_ino;
+    ttcache.generation = hdr.generation;
+    ttcache.count = hdr.count;
+
+    *count = ttcache.count;
+    return ttcache.entries;
+}
+
+
+void
+free_topten_cache(void)
+{
+    free(ttcache.entries);
+    ttcache.entries = NULL;
+    ttcache.generation = -1;
+    ttcache.count = 0;
+}
+
+
 static void
 fill_topten_entry(struct toptenentry *newtt, int how)
 {
@@ -388,30 +621,68 @@ fill_topten_entry(struct toptenentry *newtt, int how)
 }
 
 
+/* Insert newtt into the binary record file at fd, which must be locked.
+ * Only the entries below the insertion point are moved. */
 static boolean
-toptenlist_insert(struct toptenentry *ttlist, struct toptenentry *newtt)
+toptenlist_insert(int fd, struct toptenentry *newtt)
 {
-    int i, ins, del, occ_cnt;
+    struct record_header hdr;
+    struct toptenentry cur;
+    unsigned char *map;
+    size_t maplen;
+    int lo, hi, mid, ins, del, occ_cnt, count;
 
-    occ_cnt = 0;
+    if (!read_record_header(fd, &hdr))
+        return FALSE;
+    count = hdr.count;
 
-    for (ins = 0; ins < TTLISTLEN && validentry(ttlist[ins]); ins++) {
-        if (newtt->points > ttlist[ins].points)
-            break;
+    maplen = RECORD_HDRSZ + (size_t)(count + 1) * RECORD_ENTSZ;
+    if (count < TTLISTLEN && ftruncate(fd, maplen) == -1)
+        return FALSE;
+    if (count == TTLISTLEN)
+        maplen -= RECORD_ENTSZ;
 
-        if (!strncmp(newtt->name, ttlist[ins].name, NAMSZ))
-            occ_cnt++;
+    map = mmap(NULL, maplen, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        ftruncate(fd, RECORD_HDRSZ + (size_t)count * RECORD_ENTSZ);
+        return FALSE;
     }
+#define ENTRY(i) (map + RECORD_HDRSZ + (size_t)(i) * RECORD_ENTSZ)
+#define ENTRY_NAME(i) ((const char *)ENTRY(i) + RECORD_NUMINTS * 4 + \
+                       4 * (ROLESZ + 1))
+
+    /* The list is sorted by descending score, so the insertion point (the
+       first entry with fewer points than the new one) can be found with a
+       binary search. */
+    lo = 0;
+    hi = count;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        unpack_entry(ENTRY(mid), &cur);
+        if (newtt->points > cur.points)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    ins = lo;
+
+    occ_cnt = 0;
+    for (mid = 0; mid < ins; mid++)
+        if (!strncmp(newtt->name, ENTRY_NAME(mid), NAMSZ))
+            occ_cnt++;
 
-    if (occ_cnt >= PLAYERMAX || ins == TTLISTLEN)
+    if (occ_cnt >= PLAYERMAX || ins == TTLISTLEN) {
         /* this game doesn't get onto the list */
+        munmap(map, maplen);
+        ftruncate(fd, RECORD_HDRSZ + (size_t)count * RECORD_ENTSZ);
         return FALSE;
+    }
 
     /* If the player already has PLAYERMAX entries in the list, find the last
        one. Otherwise del is either the first empty entry or TTLISTLEN if the
        list is full */
-    for (del = ins; del < TTLISTLEN && validentry(ttlist[del]); del++) {
-        if (!strncmp(newtt->name, ttlist[ins].name, NAMSZ)) {
+    for (del = ins; del < count; del++) {
+        if (!strncmp(newtt->name, ENTRY_NAME(del), NAMSZ)) {
             occ_cnt++;
             if (occ_cnt >= PLAYERMAX)
                 break;
@@ -422,11 +693,20 @@ toptenlist_insert(struct toptenentry *ttlist, struct toptenentry *newtt)
         del--;
 
     /* shift the entries in the range [ins;del[ down by one, overwriting del */
-    for (i = del; i > ins; i--)
-        ttlist[i] = ttlist[i - 1];
+    memmove(ENTRY(ins + 1), ENTRY(ins), (size_t)(del - ins) * RECORD_ENTSZ);
+    pack_entry(ENTRY(ins), newtt);
+
+#undef ENTRY_NAME
+#undef ENTRY
 
-    ttlist[ins] = *newtt;
+    if (del == count)
+        hdr.count++;
+    else
+        ftruncate(fd, RECORD_HDRSZ + (size_t)count * RECORD_ENTSZ);
+    hdr.generation++;
+    pack_header(map, &hdr);
 
+    munmap(map, maplen);
     return TRUE;
 }
 
@@ -455,8 +735,7 @@ emit_dead_event(struct toptenentry *tt)
 void
 update_topten(int how)
 {
-    struct toptenentry *toptenlist, newtt;
-    boolean need_rewrite;
+    struct toptenentry newtt;
     int fd;
 
     if (program_state.panicking)
@@ -479,21 +758,19 @@ update_topten(int how)
         return;
     }
 
-    toptenlist = read_topten(fd, TTLISTLEN);
+    /* the first update after an upgrade converts an old text record file */
+    convert_record(fd);
 
-    /* possibly rearrange the score list to include the new entry */
-    need_rewrite = toptenlist_insert(toptenlist, &newtt);
-    if (need_rewrite)
-        write_topten(fd, toptenlist);
+    /* possibly insert the new entry into the score list */
+    toptenlist_insert(fd, &newtt);
 
     unlock_fd(fd);
     close(fd);
-    free(toptenlist);
 }
 
 
 static int
-classmon(char *plch, boolean fem)
+classmon(const char *plch, boolean fem)
 {
     int i;
 
@@ -520,24 +797,28 @@ classmon(char *plch, boolean fem)
 struct obj *
 tt_oname(struct obj *otmp)
 {
-    int rank, fd;
-    struct toptenentry *toptenlist, *tt;
+    int rank, fd, count;
+    const struct toptenentry *toptenlist, *tt;
 
     if (!otmp)
         return NULL;
 
     fd = open_datafile(RECORD, O_RDONLY, SCOREPREFIX);
-    toptenlist = read_topten(fd, 100);  /* load the top 100 scores */
+    toptenlist = read_topten(fd, &count);
     close(fd);
 
+    /* only the top 100 scores are used */
+    if (count > 100)
+        count = 100;
+
     /* try to find a valid entry, reducing the value range for rank each time */
     rank = rn2(100);
-    while (!validentry(toptenlist[rank]) && rank)
+    while ((rank >= count || !validentry(toptenlist[rank])) && rank)
         rank = rn2(rank);
 
     tt = &toptenlist[rank];
 
-    if (!validentry(toptenlist[rank]))
+    if (rank >= count || !validentry(toptenlist[rank]))
         otmp = NULL;    /* the topten list is empty */
     else {
         /* reset timer in case corpse started out as lizard or troll */
@@ -550,7 +831,6 @@ tt_oname(struct obj *otmp)
             start_corpse_timeout(otmp);
     }
 
-    free(toptenlist);
     return otmp;
 }
 
@@ -593,7 +873,7 @@ topten_level_name(int dnum, int dlev, char *outbuf)
 
 
 static void
-topten_death_description(struct toptenentry *in, char *outbuf)
+topten_death_description(const struct toptenentry *in, char *outbuf)
 {
     char *bp;
     boolean second_line = TRUE;
@@ -652,7 +932,7 @@ topten_death_description(struct toptenentry *in, char *outbuf)
 
 
 static void
-fill_nh_score_entry(struct toptenentry *in, struct nh_topten_entry *out,
+fill_nh_score_entry(const struct toptenentry *in, struct nh_topten_entry *out,
                     int rank, boolean highlight)
 {
 
@@ -699,12 +979,13 @@ nh_get_topten(int *out_len, char *statusbuf,
               const char * volatile player, int top,
               int around, boolean own)
 {
-    struct toptenentry *ttlist, newtt;
+    const struct toptenentry *ttlist;
+    struct toptenentry newtt;
     struct nh_topten_entry *score_list;
     boolean game_inited = (wiz1_level.dlevel != 0);
     boolean game_complete = game_inited && moves && program_state.gameover;
     int rank = -1;      /* index of the completed game in the topten list */
-    int fd, i, j, sel_count;
+    int fd, i, j, count, sel_count;
     boolean *selected, off_list = FALSE;
 
     statusbuf[0] = '\0';
@@ -727,21 +1008,19 @@ nh_get_topten(int *out_len, char *statusbuf,
             player = "";
     }
 
+    /* a missing record file just means that nobody has made it onto the list
+       yet */
     fd = open_datafile(RECORD, O_RDONLY, SCOREPREFIX);
-    ttlist = read_topten(fd, TTLISTLEN);
-    close(fd);
-    if (!ttlist) {
-        strcpy(statusbuf, "Cannot open record file!");
-        api_exit();
-        return NULL;
-    }
+    ttlist = read_topten(fd, &count);
+    if (fd != -1)
+        close(fd);
 
     /* find the rank of a completed game in the score list */
     if (game_complete && !strcmp(player, plname)) {
         fill_topten_entry(&newtt, end_how);
 
         /* find this entry in the list */
-        for (i = 0; i < TTLISTLEN && validentry(ttlist[i]); i++)
+        for (i = 0; i < count && validentry(ttlist[i]); i++)
             if (!memcmp(&ttlist[i], &newtt, sizeof (struct toptenentry)))
                 rank = i;
 
@@ -760,7 +1039,7 @@ nh_get_topten(int *out_len, char *statusbuf,
     sel_count = 0;
     selected = calloc(TTLISTLEN, sizeof (boolean));
 
-    for (i = 0; i < TTLISTLEN && validentry(ttlist[i]); i++) {
+    for (i = 0; i < count && validentry(ttlist[i]); i++) {
         if (top == -1 || i < top)
             selected[i] = TRUE;
 
@@ -776,8 +1055,6 @@ nh_get_topten(int *out_len, char *statusbuf,
 
     if (game_complete && sel_count == 0) {
         /* didn't make it onto the list and nothing else is selected */
-        ttlist[0] = newtt;
-        selected[0] = TRUE;
         sel_count++;
         off_list = TRUE;
     }
@@ -787,12 +1064,13 @@ nh_get_topten(int *out_len, char *statusbuf,
     memset(score_list, 0, sel_count * sizeof (struct nh_topten_entry));
     *out_len = sel_count;
     j = 0;
-    for (i = 0; i < TTLISTLEN && validentry(ttlist[i]); i++) {
+    for (i = 0; !off_list && i < count && validentry(ttlist[i]); i++) {
         if (selected[i])
             fill_nh_score_entry(&ttlist[i], &score_list[j++], i + 1, i == rank);
     }
 
     if (off_list) {
+        fill_nh_score_entry(&newtt, &score_list[0], -1, TRUE);
         score_list[0].rank = -1;
         score_list[0].highlight = TRUE;
     }
@@ -803,7 +1081,6 @@ nh_get_topten(int *out_len, char *statusbuf,
     }
 
     free(selected);
-    free(ttlist);
 
     api_exit();
     return score_list;
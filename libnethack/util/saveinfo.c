@@ -305,6 +305,8 @@ main(int argc, char *argv[])
                tokens[3]);
     } else if (!strcmp(tokens[1], "save")) {
         printf("The game was saved.  ");
+    } else if (!strcmp(tokens[1], "savz")) {
+        printf("The game was saved with a compressed save.  ");
     } else if (!strcmp(tokens[1], "done")) {
         printf("The game has finished.  ");
     } else {
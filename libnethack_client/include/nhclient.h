@@ -36,6 +36,7 @@ extern int current_game;
 extern jmp_buf ex_jmp_buf;
 extern int ex_jmp_buf_valid;
 extern int conn_err;
+extern int server_caches_responses;
 extern int error_retry_ok;
 extern char saved_password[];
 
@@ -49,6 +50,7 @@ extern int restart_connection(void);
 
 /* netcmd.c */
 extern json_t *handle_netcmd(const char *key, json_t * jmsg);
+extern void free_item_lists(void);
 extern void handle_display_list(json_t * display_list);
 
 /* xmalloc.c */
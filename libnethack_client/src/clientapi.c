@@ -16,6 +16,22 @@ struct nh_option_desc *option_lists[OPTION_LIST_COUNT];
 static struct sigaction oldaction;
 #endif
 
+/* The responses to get_drawing_info, get_roles and get_commands only change
+ * with the server build. The last copy of each is kept together with the
+ * version the server gave it; the server doesn't resend a current copy. */
+struct cached_response {
+    const char *cmd;
+    char *version;
+    json_t *data;
+};
+
+static struct cached_response cached_responses[] = {
+    {"get_drawing_info"},
+    {"get_roles"},
+    {"get_commands"},
+    {NULL}
+};
+
 
 void
 nhnet_lib_init(const struct nh_window_procs *winprocs)
@@ -41,12 +57,23 @@ nhnet_lib_init(const struct nh_window_procs *winprocs)
 void
 nhnet_lib_exit(void)
 {
+    int i;
+
     if (nhnet_connected())
         nhnet_disconnect();
 
     xmalloc_cleanup();
+    free_item_lists();
     conn_err = FALSE;
 
+    for (i = 0; cached_responses[i].cmd; i++) {
+        free(cached_responses[i].version);
+        if (cached_responses[i].data)
+            json_decref(cached_responses[i].data);
+        cached_responses[i].version = NULL;
+        cached_responses[i].data = NULL;
+    }
+
 #ifdef WIN32
     WSACleanup();
 #else
@@ -336,6 +363,51 @@ nhnet_view_replay_finish(void)
 }
 
 
+/*
+ * send_receive_msg for the commands in cached_responses: the request carries
+ * the version of the cached copy, which is returned instead of the server's
+ * response if the server says it is still current. Servers that don't set
+ * "cache" in the auth response get an empty request, as before.
+ */
+static json_t *
+send_receive_cached(const char *cmd)
+{
+    struct cached_response *cr;
+    json_t *jmsg, *jver;
+
+    if (!server_caches_responses)
+        return send_receive_msg(cmd, json_object());
+
+    for (cr = cached_responses; strcmp(cr->cmd, cmd); cr++)
+        ;
+
+    jmsg = send_receive_msg(cmd, json_pack("{ss}", "version",
+                                           cr->version ? cr->version : ""));
+    jver = json_object_get(jmsg, "version");
+    if (!jver || !json_is_string(jver))
+        return jmsg;
+
+    if (json_object_size(jmsg) == 1) {
+        if (cr->data && !strcmp(json_string_value(jver), cr->version)) {
+            json_decref(jmsg);
+            json_incref(cr->data);
+            return cr->data;
+        }
+        return jmsg;    /* there is nothing to fall back on */
+    }
+
+    free(cr->version);
+    cr->version = strdup(json_string_value(jver));
+    json_object_del(jmsg, "version");
+    if (cr->data)
+        json_decref(cr->data);
+    json_incref(jmsg);
+    cr->data = jmsg;
+
+    return jmsg;
+}
+
+
 struct nh_cmd_desc *
 nhnet_get_commands(int *count)
 {
@@ -350,8 +422,7 @@ nhnet_get_commands(int *count)
     if (!api_entry())
         return 0;
 
-    jmsg = json_object();
-    jmsg = send_receive_msg("get_commands", jmsg);
+    jmsg = send_receive_cached("get_commands");
     if (json_unpack(jmsg, "{so!}", "cmdlist", &jarr) == -1 ||
         !json_is_array(jarr)) {
         print_error("Incorrect return object in nhnet_restore_game");
@@ -456,7 +527,7 @@ nhnet_get_drawing_info(void)
     if (!api_entry())
         return 0;
 
-    jmsg = send_receive_msg("get_drawing_info", json_object());
+    jmsg = send_receive_cached("get_drawing_info");
     di = xmalloc(sizeof (struct nh_drawing_info));
     if (json_unpack
         (jmsg,
@@ -823,7 +894,7 @@ nhnet_get_roles(void)
     if (!api_entry())
         return NULL;
 
-    jmsg = send_receive_msg("get_roles", json_object());
+    jmsg = send_receive_cached("get_roles");
     ri = xmalloc(sizeof (struct nh_roles_info));
     if (json_unpack
         (jmsg, "{si,si,si,si,si,si,si,si,so,so,so,so,so,so}", "num_roles",
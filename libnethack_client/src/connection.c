@@ -6,6 +6,7 @@
  */
 
 #include "nhclient.h"
+#include <zlib.h>
 
 struct nhnet_server_version nhnet_server_ver;
 
@@ -20,6 +21,11 @@ int conn_err, error_retry_ok;
  * already is */
 static int in_connect_disconnect;
 
+/* set once the server compresses everything it sends on this connection */
+static z_stream inflate_stream;
+static int decompressing;
+int server_caches_responses;
+
 /* saved connection details */
 static char saved_hostname[256];
 static int saved_port;
@@ -97,6 +103,48 @@ send_json_msg(json_t * jmsg)
 }
 
 
+static void
+stop_decompression(void)
+{
+    if (decompressing)
+        inflateEnd(&inflate_stream);
+    decompressing = FALSE;
+}
+
+
+/* Decompress len bytes from the socket and append the result to *rbuf at
+ * datalen, growing the buffer as needed. Returns the number of bytes added,
+ * or -1 if the data is broken or too big. */
+static int
+decompress_data(unsigned char *data, int len, char **rbuf, int *rbufsize,
+                int datalen)
+{
+    int ret, start = datalen;
+
+    inflate_stream.next_in = data;
+    inflate_stream.avail_in = len;
+    while (1) {
+        /* leave the last byte in the buffer free for the '\0' */
+        inflate_stream.next_out = (unsigned char *)*rbuf + datalen;
+        inflate_stream.avail_out = *rbufsize - datalen - 1;
+        ret = inflate(&inflate_stream, Z_SYNC_FLUSH);
+        datalen = *rbufsize - 1 - inflate_stream.avail_out;
+        if (ret != Z_OK && ret != Z_BUF_ERROR)
+            return -1;
+        if (inflate_stream.avail_in == 0 && inflate_stream.avail_out != 0)
+            break;
+
+        /* same limit as for uncompressed data */
+        if (*rbufsize >= 16 * 1024 * 1024)
+            return -1;
+        *rbufsize *= 2;
+        *rbuf = realloc(*rbuf, *rbufsize);
+    }
+
+    return datalen - start;
+}
+
+
 /* receive one JSON object from the server.
  * Returns: - NULL after a network error OR
  *          - an empty JSON object if there is a parsing error OR
@@ -105,6 +153,7 @@ static json_t *
 receive_json_msg(void)
 {
     char *rbuf, *bp;
+    unsigned char zbuf[16 * 1024];
     int datalen, ret, rbufsize;
     json_t *recv_msg;
     json_error_t err;
@@ -134,14 +183,28 @@ receive_json_msg(void)
             return NULL;
         }
 
-        /* leave the last byte in the buffer free for the '\0' */
-        ret = recv(sockfd, &rbuf[datalen], rbufsize - datalen - 1, 0);
+        if (decompressing)
+            ret = recv(sockfd, zbuf, sizeof (zbuf), 0);
+        else    /* leave the last byte in the buffer free for the '\0' */
+            ret = recv(sockfd, &rbuf[datalen], rbufsize - datalen - 1, 0);
         if (ret == -1 && errno == EINTR)
             continue;
         else if (ret <= 0) {
             free(rbuf);
             return NULL;
         }
+
+        if (decompressing) {
+            ret = decompress_data(zbuf, ret, &rbuf, &rbufsize, datalen);
+            if (ret == -1) {
+                /* the stream can't be resynchronized; start over */
+                print_error("Broken compressed data received from server.");
+                free(rbuf);
+                return NULL;
+            }
+            if (ret == 0)
+                continue;
+        }
         datalen += ret;
 
         rbuf[datalen] = '\0';   /* terminate the string */
@@ -361,11 +424,40 @@ connect_server(const char *host, int port, int want_v4, char *errmsg,
 }
 
 
+/* Ask the server to compress everything it sends from now on. If it agrees,
+ * its response is the last uncompressed message. */
+static void
+start_decompression(void)
+{
+    json_t *jmsg;
+    int ret = 0;
+
+    jmsg = send_receive_msg("set_compression",
+                            json_pack("{ss}", "method", "deflate"));
+    if (!jmsg)
+        return;
+    json_unpack(jmsg, "{si*}", "return", &ret);
+    json_decref(jmsg);
+
+    if (ret != 1)
+        return;
+    memset(&inflate_stream, 0, sizeof (inflate_stream));
+    if (inflateInit(&inflate_stream) == Z_OK)
+        decompressing = TRUE;
+    else {
+        /* the server compresses anyway; nothing could be read */
+        print_error("Failed to set up decompression.");
+        close(sockfd);
+        sockfd = -1;
+    }
+}
+
+
 static int
 do_connect(const char *host, int port, const char *user, const char *pass,
            const char *email, int reg_user, int connid)
 {
-    int fd = -1, authresult, copylen;
+    int fd = -1, authresult, copylen, i;
     char ipv6_error[120], ipv4_error[120], errmsg[256];
     json_t *jmsg, *jarr;
 
@@ -418,6 +510,7 @@ do_connect(const char *host, int port, const char *user, const char *pass,
 
     in_connect_disconnect = TRUE;
     sockfd = fd;
+    stop_decompression();
     jmsg = json_pack("{ss,ss}", "username", user, "password", pass);
     if (reg_user) {
         if (email)
@@ -428,11 +521,11 @@ do_connect(const char *host, int port, const char *user, const char *pass,
             json_object_set_new(jmsg, "reconnect", json_integer(connid));
         jmsg = send_receive_msg("auth", jmsg);
     }
-    in_connect_disconnect = FALSE;
 
     if (!jmsg ||
         json_unpack(jmsg, "{si,si*}", "return", &authresult, "connection",
                     &connection_id) == -1) {
+        in_connect_disconnect = FALSE;
         if (jmsg)
             json_decref(jmsg);
         close(fd);
@@ -446,7 +539,27 @@ do_connect(const char *host, int port, const char *user, const char *pass,
         nhnet_server_ver.patchlevel =
             json_integer_value(json_array_get(jarr, 2));
     }
+    /* so is "compression", the list of methods the server offers */
+    if ((authresult == AUTH_SUCCESS_NEW || authresult == AUTH_SUCCESS_RECONNECT)
+        && json_unpack(jmsg, "{so*}", "compression", &jarr) != -1 &&
+        json_is_array(jarr)) {
+        for (i = 0; i < json_array_size(jarr); i++)
+            if (json_is_string(json_array_get(jarr, i)) &&
+                !strcmp(json_string_value(json_array_get(jarr, i)),
+                        "deflate")) {
+                start_decompression();
+                break;
+            }
+    }
+    /* and "cache", which allows versions in the get_* requests */
+    server_caches_responses =
+        (authresult == AUTH_SUCCESS_NEW ||
+         authresult == AUTH_SUCCESS_RECONNECT) &&
+        json_is_true(json_object_get(jmsg, "cache"));
+    in_connect_disconnect = FALSE;
     json_decref(jmsg);
+    if (sockfd == -1)
+        return NO_CONNECTION;
 
     if (host != saved_hostname)
         strncpy(saved_hostname, host, sizeof (saved_hostname));
@@ -487,6 +600,8 @@ nhnet_disconnect(void)
         close(sockfd);
     }
     sockfd = -1;
+    stop_decompression();
+    server_caches_responses = FALSE;
     connection_id = 0;
     current_game = 0;
     conn_err = FALSE;
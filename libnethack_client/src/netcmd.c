@@ -62,6 +62,10 @@ struct netcmd netcmd_list[] = {
 
 static struct nh_window_procs cur_wndprocs;
 
+/* the last inventory and floor item lists, which list_items deltas refer to */
+static struct nh_objitem *last_items[2];
+static int last_icount[2];
+
 /*---------------------------------------------------------------------------*/
 
 static const char *
@@ -566,12 +570,12 @@ static json_t *
 cmd_list_items(json_t * params, int display_only)
 {
     struct nh_objitem *items;
-    int icount, i, invent;
-    json_t *jarr;
+    int icount, i, j, id, invent, delta = FALSE;
+    json_t *jarr, *jobj;
 
     if (json_unpack
-        (params, "{so,si,si!}", "items", &jarr, "icount", &icount, "invent",
-         &invent) == -1) {
+        (params, "{so,si,si,s?b!}", "items", &jarr, "icount", &icount,
+         "invent", &invent, "delta", &delta) == -1) {
         print_error("Incorrect parameter type in cmd_list_items");
         return NULL;
     }
@@ -580,10 +584,33 @@ cmd_list_items(json_t * params, int display_only)
         print_error("Damaged items array in cmd_list_items");
         return NULL;
     }
+    invent = ! !invent;
 
     items = malloc(icount * sizeof (struct nh_objitem));
-    for (i = 0; i < icount; i++)
-        json_read_objitem(json_array_get(jarr, i), &items[i]);
+    for (i = 0; i < icount; i++) {
+        jobj = json_array_get(jarr, i);
+        if (!json_is_integer(jobj)) {
+            json_read_objitem(jobj, &items[i]);
+            continue;
+        }
+
+        /* an unchanged item from the last list */
+        id = json_integer_value(jobj);
+        for (j = 0; j < last_icount[invent]; j++)
+            if (last_items[invent][j].id == id)
+                break;
+        if (!delta || j == last_icount[invent]) {
+            print_error("Unknown item in cmd_list_items");
+            memset(&items[i], 0, sizeof (struct nh_objitem));
+        } else
+            items[i] = last_items[invent][j];
+    }
+
+    free(last_items[invent]);
+    last_items[invent] = malloc(icount * sizeof (struct nh_objitem));
+    memcpy(last_items[invent], items, icount * sizeof (struct nh_objitem));
+    last_icount[invent] = icount;
+
     cur_wndprocs.win_list_items(items, icount, invent);
     free(items);
 
@@ -591,6 +618,19 @@ cmd_list_items(json_t * params, int display_only)
 }
 
 
+void
+free_item_lists(void)
+{
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        free(last_items[i]);
+        last_items[i] = NULL;
+        last_icount[i] = 0;
+    }
+}
+
+
 static json_t *
 cmd_query_key(json_t * params, int display_only)
 {
@@ -343,6 +343,7 @@ extern int get_map_key(int place_cursor);
 extern void curses_update_screen(struct nh_dbuf_entry dbuf[ROWNO][COLNO],
                                  int ux, int uy);
 extern int curses_getpos(int *x, int *y, nh_bool force, const char *goal);
+extern void invalidate_map_cache(void);
 extern void draw_map(int cx, int cy);
 
 /* menu.c */
@@ -18,6 +18,17 @@ struct coord {
 };
 
 static struct nh_dbuf_entry (*display_buffer)[COLNO] = NULL;
+
+/* What draw_map last put into each cell of mapwin. A cell is only drawn again
+ * if its display buffer entry changed, or if it blinks and the frame did. */
+struct drawn_cell {
+    struct nh_dbuf_entry dbe;
+    int symcount;
+};
+static struct drawn_cell drawn[ROWNO][COLNO];
+static unsigned int drawn_frame;
+static nh_bool drawn_valid = FALSE;
+
 static const int xdir[DIR_SELF + 1] = { -1, -1, 0, 1, 1, 1, 0, -1, 0, 0 };
 static const int ydir[DIR_SELF + 1] = { 0, -1, -1, -1, 0, 1, 1, 1, 0, 0 };
 
@@ -84,12 +95,22 @@ curses_update_screen(struct nh_dbuf_entry dbuf[ROWNO][COLNO], int ux, int uy)
 }
 
 
+/* The map window was re-created, or the way symbols are drawn changed; the
+ * next draw_map must draw every cell. */
+void
+invalidate_map_cache(void)
+{
+    drawn_valid = FALSE;
+}
+
+
 void
 draw_map(int cx, int cy)
 {
     int x, y, symcount, attr, cursx, cursy;
     unsigned int frame;
     struct curses_symdef syms[4];
+    struct drawn_cell *dc;
 
     if (!display_buffer || !mapwin)
         return;
@@ -104,12 +125,20 @@ draw_map(int cx, int cy)
         for (x = 1; x < COLNO; x++) {
             int bg_color = 0;
 
+            dc = &drawn[y][x];
+            if (drawn_valid &&
+                !memcmp(&dc->dbe, &display_buffer[y][x], sizeof (dc->dbe)) &&
+                (dc->symcount == 1 || frame == drawn_frame))
+                continue;
+            dc->dbe = display_buffer[y][x];
+
             /* set the position for each character to prevent incorrect
                positioning due to charset issues (IBM chars on a unicode term
                or vice versa) */
             wmove(mapwin, y, x - 1);
 
             symcount = mapglyph(&display_buffer[y][x], syms, &bg_color);
+            dc->symcount = symcount;
             attr = A_NORMAL;
             if (!(COLOR_PAIRS >= 113 || (COLORS < 16 && COLOR_PAIRS >= 57))) {
                 /* we don't have background colors available */
@@ -134,6 +163,8 @@ draw_map(int cx, int cy)
             print_sym(mapwin, &syms[frame % symcount], attr, bg_color);
         }
     }
+    drawn_frame = frame;
+    drawn_valid = TRUE;
 
     wmove(mapwin, cursy, cursx);
     wnoutrefresh(mapwin);
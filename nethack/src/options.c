@@ -155,6 +155,7 @@ option_change_callback(struct nh_option_desc *option)
         curses_update_status(NULL);
     } else if (!strcmp(option->name, "darkgray")) {
         set_darkgray();
+        invalidate_map_cache();
         draw_map(player.x, player.y);
     } else if (!strcmp(option->name, "menu_headings")) {
         settings.menu_headings = option->value.e;
@@ -162,6 +163,7 @@ option_change_callback(struct nh_option_desc *option)
         settings.graphics = option->value.e;
         switch_graphics(option->value.e);
         if (ui_flags.ingame) {
+            invalidate_map_cache();
             draw_map(player.x, player.y);
             redraw_game_windows();
         }
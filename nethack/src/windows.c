@@ -231,6 +231,7 @@ create_game_windows(void)
                 derwin(basewin, ui_flags.viewheight, COLS - COLNO, 0, COLNO);
     }
 
+    invalidate_map_cache();
     keypad(mapwin, TRUE);
     keypad(msgwin, TRUE);
     leaveok(mapwin, FALSE);
@@ -366,6 +367,7 @@ rebuild_ui(void)
 
         /* some windows are now empty because they were re-created */
         draw_msgwin();
+        invalidate_map_cache();
         draw_map(player.x, player.y);
         curses_update_status(&player);
         draw_sidebar();
@@ -0,0 +1,757 @@
+/* vim:set cin ft=c sw=4 sts=4 ts=8 et ai cino=Ls\:0t0(0 : -*- mode:c;fill-column:80;tab-width:8;c-basic-offset:4;indent-tabs-mode:nil;c-file-style:"k&r" -*-*/
+/* The NetHack server may be freely redistributed under the terms of either:
+ *  - the NetHack license
+ *  - the GNU General Public license v2 or later
+ */
+
+/*
+ * A load generator for nethack_server.
+ *
+ * Every session is a separate process (libnethack_client only handles one
+ * connection per process) that logs in as its own user, starts a game and
+ * plays a fixed number of commands, either a random walk or a script. When
+ * all sessions are done, the command round-trip times are collected and
+ * reported as percentiles, together with the throughput and the CPU time and
+ * memory used by the server processes.
+ *
+ * The server's resource use is sampled from /proc: any process named
+ * nethack_server that didn't exist before the sessions started is counted as
+ * a game process. The sessions keep their games open until the final sample,
+ * so the numbers cover the whole run. Everything runs on one machine; the
+ * server can use the SQLite backend so no database server is needed:
+ *
+ *   nethack_server -n -b sqlite -w /tmp/nhload    (dbbackend=sqlite)
+ *   nethack_loadgen -n 50 -c 500
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <dirent.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "nethack_client.h"
+
+#define DEFAULT_HOST "127.0.0.1"
+#define SAMPLE_INTERVAL 1000    /* ms between samples of the server processes */
+#define MAX_SCRIPT 1024
+
+/* what each session sends back to the main process, followed by the
+ * latencies of all its commands in microseconds */
+struct session_result {
+    int ok;     /* FALSE if the session couldn't log in or start a game */
+    int commands, errors, games;
+    unsigned long long start, end;      /* CLOCK_MONOTONIC, in us */
+};
+
+struct script_cmd {
+    char cmd[64];
+    enum nh_direction dir;      /* DIR_NONE if the command has no argument */
+};
+
+/* resource use of one server process, as last seen in /proc */
+struct proc_sample {
+    int pid;
+    int is_game;
+    unsigned long long cputicks;
+    long rss_pages, max_rss_pages;
+};
+
+static const char *host = DEFAULT_HOST;
+static int port;
+static const char *userprefix = "loadbot";
+static const char *password = "loadbot";
+static int sessions = 10;
+static int commands_per_session = 200;
+static int rampup_ms = 50;
+static int think_ms;
+
+static struct script_cmd script[MAX_SCRIPT];
+static int script_len;
+
+static struct proc_sample *procs;
+static int proc_count, proc_max;
+
+
+/*---------------------------------------------------------------------------*/
+
+/* The bots never look at the game, so the window procs only need to keep it
+ * going: every prompt is answered with its default or cancelled. */
+
+static void
+bot_pause(enum nh_pause_reason reason)
+{
+}
+
+static void
+bot_display_buffer(const char *buf, nh_bool trymove)
+{
+}
+
+static void
+bot_update_status(struct nh_player_info *pi)
+{
+}
+
+static void
+bot_print_message(int turn, const char *msg)
+{
+}
+
+static int
+bot_display_menu(struct nh_menuitem *items, int icount, const char *title,
+                 int how, int placement_hint, int *results)
+{
+    return 0;
+}
+
+static int
+bot_display_objects(struct nh_objitem *items, int icount, const char *title,
+                    int how, int placement_hint, struct nh_objresult *results)
+{
+    return 0;
+}
+
+static nh_bool
+bot_list_items(struct nh_objitem *items, int icount, nh_bool invent)
+{
+    return TRUE;
+}
+
+static void
+bot_update_screen(struct nh_dbuf_entry dbuf[ROWNO][COLNO], int ux, int uy)
+{
+}
+
+static void
+bot_raw_print(const char *str)
+{
+}
+
+static char
+bot_query_key(const char *query, int *count)
+{
+    return '\033';
+}
+
+static int
+bot_getpos(int *x, int *y, nh_bool force, const char *goal)
+{
+    return -1;
+}
+
+static enum nh_direction
+bot_getdir(const char *query, nh_bool restricted)
+{
+    return DIR_NONE;
+}
+
+static char
+bot_yn_function(const char *query, const char *rset, char defchoice)
+{
+    if (defchoice)
+        return defchoice;
+    return strchr(rset, 'q') ? 'q' : rset[0];
+}
+
+static void
+bot_getlin(const char *query, char *buf)
+{
+    strcpy(buf, "\033");
+}
+
+static void
+bot_delay(void)
+{
+}
+
+static void
+bot_level_changed(int displaymode)
+{
+}
+
+static void
+bot_outrip(struct nh_menuitem *items, int icount, nh_bool tombstone,
+           const char *name, int gold, const char *killbuf, int end_how,
+           int year)
+{
+}
+
+static struct nh_window_procs bot_windowprocs = {
+    bot_pause,
+    bot_display_buffer,
+    bot_update_status,
+    bot_print_message,
+    bot_display_menu,
+    bot_display_objects,
+    bot_list_items,
+    bot_update_screen,
+    bot_raw_print,
+    bot_query_key,
+    bot_getpos,
+    bot_getdir,
+    bot_yn_function,
+    bot_getlin,
+    bot_delay,
+    bot_level_changed,
+    bot_outrip,
+    bot_print_message,
+};
+
+/*---------------------------------------------------------------------------*/
+
+
+static unsigned long long
+now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+static int
+write_all(int fd, const void *buf, size_t len)
+{
+    ssize_t ret;
+    size_t pos = 0;
+
+    while (pos < len) {
+        ret = write(fd, (const char *)buf + pos, len - pos);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return FALSE;
+        pos += ret;
+    }
+    return TRUE;
+}
+
+
+static int
+read_all(int fd, void *buf, size_t len)
+{
+    ssize_t ret;
+    size_t pos = 0;
+
+    while (pos < len) {
+        ret = read(fd, (char *)buf + pos, len - pos);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return FALSE;
+        pos += ret;
+    }
+    return TRUE;
+}
+
+
+/*
+ * Script files have one command per line, optionally followed by a direction
+ * (one of h j k l y u b n < > .), e.g. "move l" or "search". Empty lines and
+ * lines starting with '#' are ignored. The script is repeated as often as
+ * necessary.
+ */
+static int
+read_script(const char *filename)
+{
+    static const char dirchars[] = "hykulnjb<>.";
+    FILE *fp;
+    char line[256], dirbuf[8];
+    const char *dc;
+    int n;
+
+    fp = fopen(filename, "r");
+    if (!fp) {
+        fprintf(stderr, "Can't open %s: %s\n", filename, strerror(errno));
+        return FALSE;
+    }
+
+    while (fgets(line, sizeof (line), fp) && script_len < MAX_SCRIPT) {
+        struct script_cmd *sc = &script[script_len];
+
+        if (line[0] == '#')
+            continue;
+        n = sscanf(line, "%63s %7s", sc->cmd, dirbuf);
+        if (n < 1)
+            continue;
+
+        sc->dir = DIR_NONE;
+        if (n == 2) {
+            dc = strchr(dirchars, dirbuf[0]);
+            if (!dc || dirbuf[1]) {
+                fprintf(stderr, "Bad direction \"%s\" in %s\n", dirbuf,
+                        filename);
+                fclose(fp);
+                return FALSE;
+            }
+            sc->dir = DIR_W + (dc - dirchars);
+        }
+        script_len++;
+    }
+
+    fclose(fp);
+    if (!script_len) {
+        fprintf(stderr, "%s contains no commands.\n", filename);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+
+/* The random walk: mostly single steps, with the odd search or rest. */
+static const char *
+next_command(int n, struct nh_cmd_arg *arg)
+{
+    int r;
+
+    if (script_len) {
+        const struct script_cmd *sc = &script[n % script_len];
+
+        if (sc->dir == DIR_NONE)
+            arg->argtype = CMD_ARG_NONE;
+        else {
+            arg->argtype = CMD_ARG_DIR;
+            arg->d = sc->dir;
+        }
+        return sc->cmd;
+    }
+
+    r = random() % 100;
+    if (r < 85) {
+        arg->argtype = CMD_ARG_DIR;
+        arg->d = DIR_W + random() % 8;
+        return "move";
+    }
+
+    arg->argtype = CMD_ARG_NONE;
+    return r < 95 ? "search" : "wait";
+}
+
+
+static int
+start_random_game(const char *name)
+{
+    struct nh_roles_info *ri;
+    int role, race, gend, align, tries;
+
+    ri = nhnet_get_roles();
+    if (!ri)
+        return FALSE;
+
+    for (tries = 0; tries < 1000; tries++) {
+        role = random() % ri->num_roles;
+        race = random() % ri->num_races;
+        gend = random() % ri->num_genders;
+        align = random() % ri->num_aligns;
+        if (ri->matrix[nh_cm_idx(*ri, role, race, gend, align)])
+            return nhnet_start_game(name, role, race, gend, align,
+                                    MODE_NORMAL);
+    }
+    return FALSE;
+}
+
+
+/*
+ * One bot session; runs in its own process. The results go to resfd. The
+ * session then waits until gofd is closed before it ends its game, so the
+ * game process still exists for the final sample.
+ */
+static void
+run_session(int id, int resfd, int gofd)
+{
+    struct session_result res;
+    struct nh_cmd_arg arg;
+    unsigned long long t, *latencies;
+    const char *cmd;
+    char user[64], dummy;
+    int ret, i;
+
+    memset(&res, 0, sizeof (res));
+    latencies = calloc(commands_per_session, sizeof (*latencies));
+    snprintf(user, sizeof (user), "%s%d", userprefix, id);
+    srandom(getpid() ^ (unsigned)now_us());
+
+    nhnet_lib_init(&bot_windowprocs);
+    ret = nhnet_connect(host, port, user, password, NULL, FALSE);
+    if (ret == AUTH_FAILED_UNKNOWN_USER)
+        ret = nhnet_connect(host, port, user, password, NULL, TRUE);
+    if (ret != AUTH_SUCCESS_NEW && ret != AUTH_SUCCESS_RECONNECT) {
+        fprintf(stderr, "Session %d: login as %s failed (%d).\n", id, user,
+                ret);
+        goto out;
+    }
+
+    if (!start_random_game(user)) {
+        fprintf(stderr, "Session %d: couldn't start a game.\n", id);
+        goto out;
+    }
+    res.ok = TRUE;
+    res.games = 1;
+
+    res.start = now_us();
+    for (i = 0; i < commands_per_session; i++) {
+        cmd = next_command(i, &arg);
+        t = now_us();
+        ret = nhnet_command(cmd, 0, &arg);
+        latencies[res.commands++] = now_us() - t;
+
+        if (ret == ERR_NETWORK_ERROR) {
+            res.errors++;
+            if (!nhnet_connected())
+                break;
+        } else if (ret >= GAME_OVER) {
+            /* died or the game was ended on the server; play on in a new one */
+            if (!start_random_game(user))
+                break;
+            res.games++;
+        }
+
+        if (think_ms)
+            usleep(think_ms * 1000);
+    }
+    res.end = now_us();
+
+out:
+    write_all(resfd, &res, sizeof (res));
+    write_all(resfd, latencies, res.commands * sizeof (*latencies));
+    close(resfd);
+
+    while (read(gofd, &dummy, 1) == -1 && errno == EINTR)
+        ;
+
+    if (res.ok)
+        nhnet_exit_game(EXIT_FORCE_QUIT);
+    nhnet_disconnect();
+    nhnet_lib_exit();
+    free(latencies);
+    exit(0);
+}
+
+
+/*---------------------------------------------------------------------------*/
+
+static struct proc_sample *
+find_proc(int pid, int is_game)
+{
+    int i;
+
+    for (i = 0; i < proc_count; i++)
+        if (procs[i].pid == pid)
+            return &procs[i];
+
+    if (proc_count == proc_max) {
+        proc_max = proc_max ? proc_max * 2 : 64;
+        procs = realloc(procs, proc_max * sizeof (*procs));
+    }
+    memset(&procs[proc_count], 0, sizeof (*procs));
+    procs[proc_count].pid = pid;
+    procs[proc_count].is_game = is_game;
+    return &procs[proc_count++];
+}
+
+
+/*
+ * Update the samples of all nethack_server processes. Processes that show up
+ * after the baseline (is_game == TRUE) are counted as game processes. The
+ * samples of processes that have exited are kept as they were last seen.
+ */
+static void
+sample_server(int baseline)
+{
+    DIR *dir;
+    struct dirent *de;
+    struct proc_sample *ps;
+    char path[64], buf[1024], comm[64], *p;
+    unsigned long utime, stime;
+    long rss;
+    FILE *fp;
+    int pid;
+
+    dir = opendir("/proc");
+    if (!dir)
+        return;
+
+    while ((de = readdir(dir))) {
+        pid = atoi(de->d_name);
+        if (pid <= 0)
+            continue;
+
+        snprintf(path, sizeof (path), "/proc/%d/stat", pid);
+        fp = fopen(path, "r");
+        if (!fp)
+            continue;
+        if (!fgets(buf, sizeof (buf), fp)) {
+            fclose(fp);
+            continue;
+        }
+        fclose(fp);
+
+        /* "pid (comm) state ..."; comm may contain spaces */
+        p = strrchr(buf, ')');
+        if (!p || sscanf(buf, "%*d (%63[^)]", comm) != 1 ||
+            strcmp(comm, "nethack_server"))
+            continue;
+        if (sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu "
+                   "%*d %*d %*d %*d %*d %*d %*u %*u %ld", &utime, &stime,
+                   &rss) != 3)
+            continue;
+
+        ps = find_proc(pid, !baseline);
+        ps->cputicks = utime + stime;
+        ps->rss_pages = rss;
+        if (rss > ps->max_rss_pages)
+            ps->max_rss_pages = rss;
+    }
+    closedir(dir);
+}
+
+
+static int
+compare_ull(const void *a, const void *b)
+{
+    unsigned long long x = *(const unsigned long long *)a;
+    unsigned long long y = *(const unsigned long long *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+
+static double
+percentile(const unsigned long long *sorted, int n, double p)
+{
+    int idx;
+
+    if (!n)
+        return 0;
+    idx = (int)(p / 100.0 * (n - 1) + 0.5);
+    return sorted[idx] / 1000.0;
+}
+
+
+static void
+report(struct session_result *res, unsigned long long *lat, int nlat,
+       unsigned long long *base_ticks)
+{
+    unsigned long long first = 0, last = 0, sum = 0, game_ticks = 0;
+    unsigned long long other_ticks = 0;
+    long game_rss = 0, game_max_rss = 0;
+    int i, ok = 0, commands = 0, errors = 0, games = 0, game_procs = 0;
+    double wall, ticks = sysconf(_SC_CLK_TCK);
+    double pagekb = sysconf(_SC_PAGESIZE) / 1024.0;
+
+    for (i = 0; i < sessions; i++) {
+        if (!res[i].ok)
+            continue;
+        ok++;
+        commands += res[i].commands;
+        errors += res[i].errors;
+        games += res[i].games;
+        if (!first || res[i].start < first)
+            first = res[i].start;
+        if (res[i].end > last)
+            last = res[i].end;
+    }
+    wall = last > first ? (last - first) / 1000000.0 : 0;
+
+    qsort(lat, nlat, sizeof (*lat), compare_ull);
+    for (i = 0; i < nlat; i++)
+        sum += lat[i];
+
+    for (i = 0; i < proc_count; i++) {
+        if (procs[i].is_game) {
+            game_procs++;
+            game_ticks += procs[i].cputicks;
+            game_rss += procs[i].rss_pages;
+            game_max_rss += procs[i].max_rss_pages;
+        } else
+            other_ticks += procs[i].cputicks;
+    }
+    other_ticks -= *base_ticks;
+
+    printf("sessions:     %d of %d ran, %d games, %d commands, %d errors\n",
+           ok, sessions, games, commands, errors);
+    printf("duration:     %.2f s\n", wall);
+    printf("throughput:   %.1f commands/s\n", wall > 0 ? commands / wall : 0);
+    printf("latency (ms): avg %.2f  p50 %.2f  p90 %.2f  p99 %.2f  "
+           "p99.9 %.2f  max %.2f\n", nlat ? sum / 1000.0 / nlat : 0,
+           percentile(lat, nlat, 50), percentile(lat, nlat, 90),
+           percentile(lat, nlat, 99), percentile(lat, nlat, 99.9),
+           nlat ? lat[nlat - 1] / 1000.0 : 0);
+
+    if (!proc_count) {
+        printf("server:       no nethack_server processes found\n");
+        return;
+    }
+    printf("server:       %d game processes; other server processes used "
+           "%.2f s CPU\n", game_procs, other_ticks / ticks);
+    if (game_procs)
+        printf("per game:     %.3f s CPU (%.2f ms per command), "
+               "RSS %.0f kB (peak %.0f kB)\n",
+               game_ticks / ticks / game_procs,
+               commands ? game_ticks / ticks * 1000 / commands : 0,
+               game_rss * pagekb / game_procs,
+               game_max_rss * pagekb / game_procs);
+}
+
+
+static void
+usage(const char *argv0)
+{
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -H host      server address (default %s)\n"
+            "  -P port      server port\n"
+            "  -n count     number of concurrent sessions (default %d)\n"
+            "  -c count     commands per session (default %d)\n"
+            "  -r ms        delay between session starts (default %d)\n"
+            "  -t ms        delay between commands of a session (default 0)\n"
+            "  -f file      play this script instead of a random walk\n"
+            "  -u prefix    user name prefix (default %s)\n"
+            "  -p password  password of the bot users (default %s)\n",
+            argv0, DEFAULT_HOST, sessions, commands_per_session, rampup_ms,
+            userprefix, password);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    struct session_result *res;
+    unsigned long long *lat = NULL, base_ticks = 0;
+    int *resfds, gofd[2], fds[2], opt, i, nlat = 0, pid, done, ret;
+    struct pollfd *pfd;
+
+    while ((opt = getopt(argc, argv, "H:P:n:c:r:t:f:u:p:h")) != -1) {
+        switch (opt) {
+        case 'H':
+            host = optarg;
+            break;
+        case 'P':
+            port = atoi(optarg);
+            break;
+        case 'n':
+            sessions = atoi(optarg);
+            break;
+        case 'c':
+            commands_per_session = atoi(optarg);
+            break;
+        case 'r':
+            rampup_ms = atoi(optarg);
+            break;
+        case 't':
+            think_ms = atoi(optarg);
+            break;
+        case 'f':
+            if (!read_script(optarg))
+                return 1;
+            break;
+        case 'u':
+            userprefix = optarg;
+            break;
+        case 'p':
+            password = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return opt != 'h';
+        }
+    }
+    if (sessions < 1 || commands_per_session < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    sample_server(TRUE);
+    for (i = 0; i < proc_count; i++)
+        base_ticks += procs[i].cputicks;
+
+    if (pipe(gofd) == -1) {
+        perror("pipe");
+        return 1;
+    }
+
+    resfds = calloc(sessions, sizeof (int));
+    res = calloc(sessions, sizeof (*res));
+    pfd = calloc(sessions, sizeof (*pfd));
+    for (i = 0; i < sessions; i++) {
+        if (pipe(fds) == -1) {
+            perror("pipe");
+            return 1;
+        }
+        fflush(stdout);
+        pid = fork();
+        if (pid == 0) {
+            close(fds[0]);
+            close(gofd[1]);
+            run_session(i, fds[1], gofd[0]);
+        } else if (pid == -1) {
+            perror("fork");
+            return 1;
+        }
+        close(fds[1]);
+        resfds[i] = fds[0];
+        if (rampup_ms)
+            usleep(rampup_ms * 1000);
+    }
+    close(gofd[0]);
+
+    /* collect the results, sampling the server while the sessions run */
+    for (i = 0; i < sessions; i++) {
+        pfd[i].fd = resfds[i];
+        pfd[i].events = POLLIN;
+    }
+    done = 0;
+    while (done < sessions) {
+        ret = poll(pfd, sessions, SAMPLE_INTERVAL);
+        if (ret == -1 && errno != EINTR) {
+            perror("poll");
+            break;
+        }
+        sample_server(FALSE);
+
+        for (i = 0; ret > 0 && i < sessions; i++) {
+            if (pfd[i].fd == -1 || !pfd[i].revents)
+                continue;
+
+            if (read_all(resfds[i], &res[i], sizeof (res[i]))) {
+                lat = realloc(lat, (nlat + res[i].commands + 1) *
+                              sizeof (*lat));
+                if (!read_all(resfds[i], &lat[nlat],
+                              res[i].commands * sizeof (*lat)))
+                    res[i].commands = 0;
+                nlat += res[i].commands;
+            } else
+                memset(&res[i], 0, sizeof (res[i]));
+
+            close(resfds[i]);
+            pfd[i].fd = -1;
+            done++;
+        }
+    }
+
+    /* the final sample, while all the games still exist */
+    sample_server(FALSE);
+    close(gofd[1]);
+    while (wait(NULL) > 0 || errno == EINTR)
+        ;
+
+    report(res, lat, nlat, &base_ticks);
+
+    free(lat);
+    free(res);
+    free(resfds);
+    free(pfd);
+    free(procs);
+    return 0;
+}
+
+/* loadgen.c */
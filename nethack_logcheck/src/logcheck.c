@@ -0,0 +1,562 @@
+/* vim:set cin ft=c sw=4 sts=4 ts=8 et ai cino=Ls\:0t0(0 : -*- mode:c;fill-column:80;tab-width:8;c-basic-offset:4;indent-tabs-mode:nil;c-file-style:"k&r" -*-*/
+/* NetHack may be freely redistributed.  See license for details. */
+
+/*
+ * Batch verifier for game logs.
+ *
+ * Every .nhgame file in the given directories is replayed one action at a
+ * time, which makes the replay code compare the game state after each action
+ * with the save diff in the log (see replay_check_diff). libnethack reports
+ * problems through raw_print: a desync, a log it can't parse or a panic while
+ * replaying. The first such message and the action it happened at are the
+ * result for the game.
+ *
+ * Each game is replayed in a process of its own, so a crash only loses that
+ * game, and up to -j of them run at once. The results go to stdout as one
+ * tab-separated line per game followed by a summary line:
+ *
+ *   game <file> <status> <actions> <max actions> <moves> <problem action>
+ *        <problem moves> <replay us> <message>
+ *   summary games=<n> ok=<n> desync=<n> incomplete=<n> invalid=<n>
+ *           crashed=<n> timeout=<n> seconds=<s> games/s=<r> actions/s=<r>
+ *
+ * where the problem fields are -1 if there was none. Games that didn't
+ * replay cleanly are also described on stderr. The exit status is 0 only if
+ * every game was ok.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "nethack.h"
+
+enum check_status {
+    CHECK_OK,
+    CHECK_DESYNC,       /* libnethack complained during the replay */
+    CHECK_INCOMPLETE,   /* the replay stopped before the end of the log */
+    CHECK_INVALID,      /* not a game log, or it couldn't be opened */
+    CHECK_CRASHED,      /* the worker died */
+    CHECK_TIMEOUT,
+    CHECK_STATUS_COUNT
+};
+
+static const char *const status_names[CHECK_STATUS_COUNT] = {
+    "ok", "desync", "incomplete", "invalid", "crashed", "timeout"
+};
+
+/* what a worker sends back to the main process */
+struct check_result {
+    int status;
+    int actions, max_actions, moves;
+    int problem_action, problem_moves;
+    unsigned long long usec;
+    char message[256];
+};
+
+/* a worker that is running */
+struct worker {
+    int pid;
+    int fd;     /* the read end of its result pipe */
+    int game;   /* index into games */
+    unsigned long long start;
+};
+
+static char **games;
+static int game_count;
+
+static int jobs;
+static int timeout_sec;
+
+/* the game being replayed by this worker */
+static struct check_result result;
+static struct nh_replay_info replay;
+
+/*---------------------------------------------------------------------------*/
+
+/* Only raw_print matters; everything else the replay shows is ignored. */
+
+static void
+check_pause(enum nh_pause_reason reason)
+{
+}
+
+static void
+check_display_buffer(const char *buf, nh_bool trymove)
+{
+}
+
+static void
+check_update_status(struct nh_player_info *pi)
+{
+}
+
+static void
+check_print_message(int turn, const char *msg)
+{
+}
+
+static int
+check_display_menu(struct nh_menuitem *items, int icount, const char *title,
+                   int how, int placement_hint, int *results)
+{
+    return 0;
+}
+
+static int
+check_display_objects(struct nh_objitem *items, int icount, const char *title,
+                      int how, int placement_hint,
+                      struct nh_objresult *results)
+{
+    return 0;
+}
+
+static void
+check_update_screen(struct nh_dbuf_entry dbuf[ROWNO][COLNO], int ux, int uy)
+{
+}
+
+static void
+check_raw_print(const char *str)
+{
+    if (result.problem_action != -1)
+        return; /* only the first problem is reported */
+
+    /* replay.actions only counts the actions that are done */
+    result.problem_action = replay.actions + 1;
+    result.problem_moves = replay.moves;
+    strncpy(result.message, str, sizeof (result.message) - 1);
+}
+
+static char
+check_query_key(const char *query, int *count)
+{
+    return '\033';
+}
+
+static int
+check_getpos(int *x, int *y, nh_bool force, const char *goal)
+{
+    return -1;
+}
+
+static enum nh_direction
+check_getdir(const char *query, nh_bool restricted)
+{
+    return DIR_NONE;
+}
+
+static char
+check_yn_function(const char *query, const char *rset, char defchoice)
+{
+    if (defchoice)
+        return defchoice;
+    return strchr(rset, 'q') ? 'q' : rset[0];
+}
+
+static void
+check_getlin(const char *query, char *buf)
+{
+    strcpy(buf, "\033");
+}
+
+static void
+check_delay(void)
+{
+}
+
+static void
+check_level_changed(int displaymode)
+{
+}
+
+static void
+check_outrip(struct nh_menuitem *items, int icount, nh_bool tombstone,
+             const char *name, int gold, const char *killbuf, int end_how,
+             int year)
+{
+}
+
+static struct nh_window_procs check_windowprocs = {
+    check_pause,
+    check_display_buffer,
+    check_update_status,
+    check_print_message,
+    check_display_menu,
+    check_display_objects,
+    NULL,       /* win_list_items */
+    check_update_screen,
+    check_raw_print,
+    check_query_key,
+    check_getpos,
+    check_getdir,
+    check_yn_function,
+    check_getlin,
+    check_delay,
+    check_level_changed,
+    check_outrip,
+    check_print_message,
+};
+
+/*---------------------------------------------------------------------------*/
+
+
+static unsigned long long
+now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+static int
+write_all(int fd, const void *buf, size_t len)
+{
+    ssize_t ret;
+    size_t pos = 0;
+
+    while (pos < len) {
+        ret = write(fd, (const char *)buf + pos, len - pos);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return FALSE;
+        pos += ret;
+    }
+    return TRUE;
+}
+
+
+static int
+read_all(int fd, void *buf, size_t len)
+{
+    ssize_t ret;
+    size_t pos = 0;
+
+    while (pos < len) {
+        ret = read(fd, (char *)buf + pos, len - pos);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return FALSE;
+        pos += ret;
+    }
+    return TRUE;
+}
+
+
+static char **
+init_game_paths(void)
+{
+    char **pathlist = malloc(sizeof (char *) * PREFIX_COUNT);
+    char *dir = NULL;
+    int i, len;
+
+    if (getgid() == getegid()) {
+        dir = getenv("NETHACKDIR");
+        if (!dir)
+            dir = getenv("HACKDIR");
+    }
+    if (!dir)
+        dir = NETHACKDIR;
+
+    len = strlen(dir);
+    for (i = 0; i < PREFIX_COUNT; i++) {
+        pathlist[i] = malloc(len + 2);
+        strcpy(pathlist[i], dir);
+        if (len && dir[len - 1] != '/')
+            strcat(pathlist[i], "/");
+    }
+    return pathlist;
+}
+
+
+/* Replay games[idx] and send the result to fd. Runs in a worker process. */
+static void
+check_game(int idx, int fd)
+{
+    char **gamepaths;
+    int i, gamefd, prev_actions;
+    unsigned long long start;
+
+    memset(&result, 0, sizeof (result));
+    result.problem_action = result.problem_moves = -1;
+
+    if (timeout_sec)
+        alarm(timeout_sec);
+
+    gamepaths = init_game_paths();
+    nh_lib_init(&check_windowprocs, gamepaths);
+    for (i = 0; i < PREFIX_COUNT; i++)
+        free(gamepaths[i]);
+    free(gamepaths);
+
+    start = now_us();
+    gamefd = open(games[idx], O_RDWR);
+    if (gamefd == -1 || !nh_view_replay_start(gamefd, &check_windowprocs,
+                                              &replay)) {
+        result.status = CHECK_INVALID;
+        if (gamefd == -1)
+            snprintf(result.message, sizeof (result.message), "%s",
+                     strerror(errno));
+        else
+            close(gamefd);
+        write_all(fd, &result, sizeof (result));
+        _exit(0);
+    }
+
+    /* stepping one action at a time checks the diff after every action */
+    do {
+        prev_actions = replay.actions;
+    } while (replay.actions < replay.max_actions &&
+             nh_view_replay_step(&replay, REPLAY_FORWARD, 1) &&
+             replay.actions > prev_actions);
+
+    result.usec = now_us() - start;
+    result.actions = replay.actions;
+    result.max_actions = replay.max_actions;
+    result.moves = replay.moves;
+    if (result.problem_action != -1)
+        result.status = CHECK_DESYNC;
+    else if (replay.actions < replay.max_actions)
+        result.status = CHECK_INCOMPLETE;
+    else
+        result.status = CHECK_OK;
+
+    nh_view_replay_finish();
+    close(gamefd);
+    nh_lib_exit();
+
+    write_all(fd, &result, sizeof (result));
+    _exit(0);
+}
+
+
+static int
+is_game_file(const char *name)
+{
+    int len = strlen(name);
+
+    return len > 7 && !strcmp(name + len - 7, ".nhgame");
+}
+
+
+static int
+compare_names(const void *p1, const void *p2)
+{
+    return strcmp(*(char *const *)p1, *(char *const *)p2);
+}
+
+
+/* Add a .nhgame file, or all .nhgame files in a directory, to games. */
+static int
+add_games(const char *path)
+{
+    DIR *dir;
+    struct dirent *ent;
+    int first = game_count;
+
+    dir = opendir(path);
+    if (!dir) {
+        if (errno == ENOTDIR && is_game_file(path)) {
+            games = realloc(games, (game_count + 1) * sizeof (char *));
+            games[game_count++] = strdup(path);
+            return TRUE;
+        }
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return FALSE;
+    }
+
+    while ((ent = readdir(dir))) {
+        if (!is_game_file(ent->d_name))
+            continue;
+        games = realloc(games, (game_count + 1) * sizeof (char *));
+        games[game_count] = malloc(strlen(path) + strlen(ent->d_name) + 2);
+        sprintf(games[game_count++], "%s/%s", path, ent->d_name);
+    }
+    closedir(dir);
+
+    qsort(games + first, game_count - first, sizeof (char *), compare_names);
+    return TRUE;
+}
+
+
+static void
+report_game(int idx, struct check_result *res)
+{
+    printf("game\t%s\t%s\t%d\t%d\t%d\t%d\t%d\t%llu\t%s\n", games[idx],
+           status_names[res->status], res->actions, res->max_actions,
+           res->moves, res->problem_action, res->problem_moves, res->usec,
+           res->message);
+    fflush(stdout);
+
+    if (res->status == CHECK_OK)
+        return;
+    if (res->problem_action != -1)
+        fprintf(stderr, "%s: %s at action %d (turn %d): %s\n", games[idx],
+                status_names[res->status], res->problem_action,
+                res->problem_moves, res->message);
+    else
+        fprintf(stderr, "%s: %s%s%s\n", games[idx], status_names[res->status],
+                res->message[0] ? ": " : "", res->message);
+}
+
+
+/* A worker exited; turn its exit status and output into a result. */
+static void
+finish_worker(struct worker *w, int status, struct check_result *res)
+{
+    if (!WIFEXITED(status) || !read_all(w->fd, res, sizeof (*res))) {
+        memset(res, 0, sizeof (*res));
+        res->problem_action = res->problem_moves = -1;
+        res->usec = now_us() - w->start;
+        if (WIFSIGNALED(status) && WTERMSIG(status) == SIGALRM)
+            res->status = CHECK_TIMEOUT;
+        else {
+            res->status = CHECK_CRASHED;
+            if (WIFSIGNALED(status))
+                snprintf(res->message, sizeof (res->message), "%s",
+                         strsignal(WTERMSIG(status)));
+        }
+    }
+    res->message[sizeof (res->message) - 1] = '\0';
+    close(w->fd);
+    w->pid = 0;
+}
+
+
+static void
+usage(const char *argv0)
+{
+    fprintf(stderr,
+            "Usage: %s [options] directory|file...\n"
+            "  -j count     number of games to replay at once (default: one "
+            "per CPU)\n"
+            "  -t seconds   give up on a game after this long (default: no "
+            "limit)\n", argv0);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    struct worker *workers;
+    struct check_result res;
+    int counts[CHECK_STATUS_COUNT];
+    int opt, i, next, running, pid, status, fds[2];
+    long long total_actions = 0;
+    unsigned long long start;
+    double seconds;
+
+    jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    while ((opt = getopt(argc, argv, "j:t:h")) != -1) {
+        switch (opt) {
+        case 'j':
+            jobs = atoi(optarg);
+            break;
+        case 't':
+            timeout_sec = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return opt != 'h';
+        }
+    }
+    if (optind >= argc || jobs < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    for (i = optind; i < argc; i++)
+        if (!add_games(argv[i]))
+            return 1;
+    if (!game_count) {
+        fprintf(stderr, "No .nhgame files found.\n");
+        return 1;
+    }
+    if (jobs > game_count)
+        jobs = game_count;
+
+    workers = calloc(jobs, sizeof (struct worker));
+    memset(counts, 0, sizeof (counts));
+    start = now_us();
+    next = running = 0;
+
+    while (next < game_count || running) {
+        /* keep every worker slot busy */
+        for (i = 0; i < jobs && next < game_count; i++) {
+            if (workers[i].pid)
+                continue;
+            if (pipe(fds) == -1) {
+                perror("pipe");
+                return 1;
+            }
+            fflush(stdout);
+            pid = fork();
+            if (pid == 0) {
+                close(fds[0]);
+                check_game(next, fds[1]);
+            } else if (pid == -1) {
+                perror("fork");
+                return 1;
+            }
+            close(fds[1]);
+            workers[i].pid = pid;
+            workers[i].fd = fds[0];
+            workers[i].game = next++;
+            workers[i].start = now_us();
+            running++;
+        }
+
+        pid = wait(&status);
+        if (pid == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("wait");
+            return 1;
+        }
+        for (i = 0; i < jobs; i++)
+            if (workers[i].pid == pid)
+                break;
+        if (i == jobs)
+            continue;
+
+        finish_worker(&workers[i], status, &res);
+        running--;
+        counts[res.status]++;
+        total_actions += res.actions;
+        report_game(workers[i].game, &res);
+    }
+
+    seconds = (now_us() - start) / 1000000.0;
+    if (seconds <= 0)
+        seconds = 0.000001;
+    printf("summary\tgames=%d", game_count);
+    for (i = 0; i < CHECK_STATUS_COUNT; i++)
+        printf("\t%s=%d", status_names[i], counts[i]);
+    printf("\tseconds=%.2f\tgames/s=%.2f\tactions/s=%.0f\n", seconds,
+           game_count / seconds, total_actions / seconds);
+
+    fprintf(stderr, "%d of %d games replayed cleanly in %.2f s (%.2f games/s, "
+            "%.0f actions/s)\n", counts[CHECK_OK], game_count, seconds,
+            game_count / seconds, total_actions / seconds);
+
+    for (i = 0; i < game_count; i++)
+        free(games[i]);
+    free(games);
+    free(workers);
+    return counts[CHECK_OK] != game_count;
+}
+
+/* logcheck.c */
@@ -58,6 +58,22 @@
 #  define DEFAULT_WORK_DIR "/var/lib/NetHack4/"
 # endif
 
+# if !defined(DEFAULT_DB_BACKEND)
+#  define DEFAULT_DB_BACKEND "pgsql"
+# endif
+
+# if !defined(DEFAULT_AUTH_WORKERS)
+#  define DEFAULT_AUTH_WORKERS 2
+# endif
+
+# if !defined(DEFAULT_SHARDS)
+#  define DEFAULT_SHARDS 1
+# endif
+
+# if !defined(DEFAULT_CLIENT_BUFFER_KB)
+#  define DEFAULT_CLIENT_BUFFER_KB 1024
+# endif
+
 # if !defined(DEFAULT_CLIENT_TIMEOUT)
 #  define DEFAULT_CLIENT_TIMEOUT (15 * 60)      /* 15 minutes */
 # endif
@@ -67,20 +83,51 @@ struct settings {
     char *logfile;
     char *workdir;
     char *pidfile;
+    char *statsfile;
     struct sockaddr_in bind_addr_4;
     struct sockaddr_in6 bind_addr_6;
     struct sockaddr_un bind_addr_unix;
     int port;
     int client_timeout;
+    int client_buffer_kb;       /* unsent output per client before
+                                   back-pressure */
+    int auth_workers;
+    int shards;
     char nodaemon;
+    char pass_sockets;  /* hand client sockets to the game processes */
+    char coalesce_display;      /* only send the last of consecutive screen and
+                                   status updates */
+    char compression;   /* offer compressed output to clients */
     char disable_ipv4;
     char disable_ipv6;
+    char *dbbackend;
     char *dbhost, *dbname, *dbport, *dbuser, *dbpass;
 };
 
 # define SUN_PATH_MAX (sizeof(settings.bind_addr_unix.sun_path))
 
 
+/* a username + password with some fluff should always fit in 500 bytes */
+# define AUTH_MAXLEN 500
+/* make the buffer slightly bigger to detect when the client sends too much data */
+# define AUTHBUFSIZE 512
+
+/* Messages between the master and the auth worker processes. The fd is the
+ * client's socket in the master; the worker only hands it back. */
+struct auth_request {
+    int fd;
+    char peername[128];
+    char authbuf[AUTHBUFSIZE];
+};
+
+struct auth_response {
+    int fd;
+    int userid;
+    int is_reg;
+    int reconnect_id;
+};
+
+
 struct user_info {
     char *username;
     int uid;
@@ -95,6 +142,28 @@ struct client_command {
 };
 
 
+/* call count and latency of one kind of database statement */
+struct db_stmt_stats {
+    const char *name;
+    unsigned long calls;
+    unsigned long errors;
+    double total_ms;
+    double max_ms;
+};
+
+
+/* phases of a client command, for timing.c */
+enum timing_phase {
+    TP_TOTAL,   /* the whole command */
+    TP_EXEC,    /* the command handler, minus the phases below */
+    TP_LOG,     /* log_command_result in libnethack; part of TP_EXEC */
+    TP_ENCODE,  /* building and serializing JSON messages */
+    TP_WRITE,   /* writing messages to the pipe */
+    TP_WAIT,    /* waiting for user input requested by the command */
+    TIMING_PHASES
+};
+
+
 struct gamefile_info {
     int gid;
     const char *filename;
@@ -102,6 +171,40 @@ struct gamefile_info {
 };
 
 
+/* A storage backend implements the db_* functions in db.c for one kind of
+ * database. The backend is chosen with the "dbbackend" config option. */
+struct db_backend {
+    const char *name;
+    int (*init_database) (void);
+    int (*check_database) (void);
+    void (*close_database) (void);
+    int (*auth_user) (const char *name, const char *pass);
+    int (*register_user) (const char *name, const char *pass,
+                          const char *email);
+    int (*get_user_info) (int uid, struct user_info * info);
+    void (*update_user_ts) (int uid);
+    int (*set_user_email) (int uid, const char *email);
+    int (*set_user_password) (int uid, const char *password);
+    long (*add_new_game) (int uid, const char *filename, const char *role,
+                          const char *race, const char *gend,
+                          const char *align, int mode, const char *plname,
+                          const char *levdesc);
+    void (*update_game) (int gameid, int moves, int depth,
+                         const char *levdesc);
+    int (*get_game_filename) (int uid, int gid, char *namebuf, int buflen);
+    void (*delete_game) (int uid, int gid);
+    struct gamefile_info *(*list_games) (int completed, int uid, int limit,
+                                         int *count);
+    void (*set_option) (int uid, const char *optname, int type,
+                        const char *optval);
+    void (*restore_options) (int uid);
+    void (*add_topten_entry) (int gid, int points, int hp, int maxhp,
+                              int deaths, int end_how, const char *death,
+                              const char *entrytxt);
+    const struct db_stmt_stats *(*get_stmt_stats) (int *count);
+};
+
+
 /*---------------------------------------------------------------------------*/
 
 extern struct settings settings;
@@ -109,6 +212,7 @@ extern struct user_info user_info;
 extern struct nh_window_procs server_windowprocs, server_alt_windowprocs;
 extern int termination_flag, sigsegv_flag;
 extern int gamefd;
+extern int shard_id;
 extern long gameid;
 extern const struct client_command clientcmd[];
 extern struct nh_player_info player_info;
@@ -120,11 +224,21 @@ extern int auth_user(char *authbuf, const char *peername, int *is_reg,
                      int *reconnect_id);
 extern void auth_send_result(int sockfd, enum authresult, int is_reg,
                              int connid);
+extern void auth_worker_main(int fd);
+
+/* clientcmd.c */
+extern json_t *drawing_info_json(void);
+extern json_t *roles_json(void);
+extern json_t *commands_json(int *count);
 
 /* clientmain.c */
-extern void client_main(int userid, int infd, int outfd);
+extern char **init_game_paths(void);
+extern void client_main(int userid, int infd, int outfd, int ctlfd);
 extern void exit_client(const char *err);
 extern void client_msg(const char *key, json_t * value);
+extern void client_msg_raw(const char *key, const char *value);
+extern int start_compression(void);
+extern void stop_compression(void);
 extern json_t *read_input(void);
 
 /* config.c */
@@ -134,6 +248,7 @@ extern void free_config(void);
 extern int parse_ip_addr(const char *str, struct sockaddr *out, int want_v4);
 
 /* db.c */
+extern const struct db_backend *find_db_backend(const char *name);
 extern int init_database(void);
 extern int check_database(void);
 extern void close_database(void);
@@ -160,6 +275,13 @@ extern void db_restore_options(int uid);
 extern void db_add_topten_entry(int gid, int points, int hp, int maxhp,
                                 int deaths, int end_how, const char *death,
                                 const char *entrytxt);
+extern const struct db_stmt_stats *db_get_stmt_stats(int *count);
+
+/* db_pgsql.c */
+extern const struct db_backend pgsql_backend;
+
+/* db_sqlite.c */
+extern const struct db_backend sqlite_backend;
 
 /* kill.c */
 extern int create_pidfile(void);
@@ -169,9 +291,12 @@ extern void signal_message(void);
 
 /* log.c */
 extern void log_msg(const char *fmt, ...);
+extern void flush_log(void);
+extern int log_flush_timer(void);
 extern int begin_logging(void);
 extern void end_logging(void);
 extern void report_startup(void);
+extern void log_db_stats(void);
 extern const char *addr2str(const void *sockaddr);
 
 /* miscsetup.c */
@@ -179,12 +304,41 @@ extern void setup_signals(void);
 extern int init_workdir(void);
 extern int remove_unix_socket(void);
 
+/* respcache.c */
+extern void init_response_cache(void);
+extern void free_response_cache(void);
+extern int send_cached_response(const char *cmd, const char *version,
+                                int count);
+
 /* server.c */
 extern int runserver(void);
 
+/* shard.c */
+extern int init_shards(void);
+extern void free_shards(void);
+extern int enter_shard(int id);
+extern void clear_shard_games(int id);
+extern int next_connection_id(void);
+extern void registry_add_game(int pid, int userid, int connid, int connected);
+extern void registry_set_connected(int connid, int connected);
+extern void registry_remove_game(int connid);
+extern int registry_find_shard(int userid, int reconnect_id);
+extern int forward_connection(int shard, int fd, int userid, int is_reg,
+                              int reconnect_id);
+extern int receive_forwarded_connection(int *userid, int *is_reg,
+                                        int *reconnect_id);
+
+/* timing.c */
+extern unsigned long long timing_now(void);
+extern void timing_add(enum timing_phase phase, unsigned long long usec);
+extern void timing_begin_command(void);
+extern void timing_end_command(int cmd);
+extern void timing_write_stats(int force);
+
 /* winprocs.c */
 extern json_t *get_display_data(void);
 extern void reset_cached_diplaydata(void);
+extern void reset_sent_item_lists(void);
 extern void srv_display_buffer(const char *buf, nh_bool trymove);
 extern char srv_yn_function(const char *query, const char *rset,
                             char defchoice);
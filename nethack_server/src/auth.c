@@ -133,6 +133,15 @@ auth_send_result(int sockfd, enum authresult result, int is_reg, int connid)
     jval =
         json_pack("{s:{si,si,s:[i,i,i]}}", key, "return", result, "connection",
                   connid, "version", VERSION_MAJOR, VERSION_MINOR, PATCHLEVEL);
+    /* the client may switch on compression with set_compression */
+    if (settings.compression &&
+        (result == AUTH_SUCCESS_NEW || result == AUTH_SUCCESS_RECONNECT))
+        json_object_set_new(json_object_get(jval, key), "compression",
+                            json_pack("[s]", "deflate"));
+    /* tell the client it may send "version" with get_drawing_info etc. */
+    if (result == AUTH_SUCCESS_NEW || result == AUTH_SUCCESS_RECONNECT)
+        json_object_set_new(json_object_get(jval, key), "cache",
+                            json_true());
     jstr = json_dumps(jval, JSON_COMPACT);
     len = strlen(jstr);
     written = 0;
@@ -148,4 +157,47 @@ auth_send_result(int sockfd, enum authresult result, int is_reg, int connid)
     json_decref(jval);
 }
 
+/*
+ * The main loop of an auth worker process. The master forwards the auth data
+ * of new connections through fd, so that waiting for the database and password
+ * hashing doesn't hold up the epoll loop. The worker exits when the master
+ * closes its end.
+ */
+void
+auth_worker_main(int fd)
+{
+    struct auth_request req;
+    struct auth_response resp;
+    int ret;
+
+    /* the master has no database connection; each worker has its own */
+    if (!init_database()) {
+        log_msg("An auth worker could not connect to the database.");
+        exit(1);
+    }
+
+    while (!termination_flag) {
+        flush_log();
+        ret = recv(fd, &req, sizeof (req), 0);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret != sizeof (req))
+            break;
+
+        req.peername[sizeof (req.peername) - 1] = '\0';
+        req.authbuf[AUTHBUFSIZE - 1] = '\0';
+        memset(&resp, 0, sizeof (resp));
+        resp.fd = req.fd;
+        resp.userid = auth_user(req.authbuf, req.peername, &resp.is_reg,
+                                &resp.reconnect_id);
+        if (send(fd, &resp, sizeof (resp), MSG_NOSIGNAL) != sizeof (resp))
+            break;
+    }
+
+    close(fd);
+    log_db_stats();
+    close_database();
+    exit(0);
+}
+
 /* auth.c */
@@ -29,6 +29,7 @@ static void ccmd_get_pl_prompt(json_t * params);
 static void ccmd_get_root_pl_prompt(json_t * params);
 static void ccmd_set_email(json_t * params);
 static void ccmd_set_password(json_t * params);
+static void ccmd_set_compression(json_t * params);
 
 const struct client_command clientcmd[] = {
     {"shutdown", ccmd_shutdown, 0},
@@ -58,6 +59,8 @@ const struct client_command clientcmd[] = {
     {"set_email", ccmd_set_email, 1},
     {"set_password", ccmd_set_password, 1},
 
+    {"set_compression", ccmd_set_compression, 0},
+
     {NULL, NULL}
 };
 
@@ -450,16 +453,36 @@ json_symarray(struct nh_symdef *array, int len)
 }
 
 
-static void
-ccmd_get_drawing_info(json_t * params)
+/*
+ * get_drawing_info, get_roles and get_commands may carry a "version": the
+ * version of the client's cached copy of the response (see respcache.c).
+ * Returns NULL if there is none.
+ */
+static const char *
+static_response_version(json_t * params, const char *cmd)
+{
+    json_t *jver;
+    void *iter = json_object_iter(params);
+
+    if (!iter)
+        return NULL;
+
+    jver = json_object_get(params, "version");
+    if (!jver || !json_is_string(jver) || json_object_size(params) != 1) {
+        char buf[BUFSZ];
+
+        snprintf(buf, sizeof (buf), "Bad parameters for %s", cmd);
+        exit_client(buf);
+    }
+    return json_string_value(jver);
+}
+
+
+json_t *
+drawing_info_json(void)
 {
     json_t *jobj;
     struct nh_drawing_info *di;
-    void *iter;
-
-    iter = json_object_iter(params);
-    if (iter)
-        exit_client("non-empty parameter list for get_drawing_info");
 
     di = nh_get_drawing_info();
     jobj =
@@ -493,21 +516,26 @@ ccmd_get_drawing_info(json_t * params)
                         json_symarray(di->swallowsyms, NUMSWALLOWCHARS));
     json_object_set_new(jobj, "invis", json_symarray(di->invis, 1));
 
-    client_msg("get_drawing_info", jobj);
+    return jobj;
 }
 
 
 static void
-ccmd_get_roles(json_t * params)
+ccmd_get_drawing_info(json_t * params)
+{
+    const char *version = static_response_version(params, "get_drawing_info");
+
+    if (!send_cached_response("get_drawing_info", version, -1))
+        client_msg("get_drawing_info", drawing_info_json());
+}
+
+
+json_t *
+roles_json(void)
 {
     int i, len;
     struct nh_roles_info *ri;
     json_t *jmsg, *jarr, *j_tmp;
-    void *iter;
-
-    iter = json_object_iter(params);
-    if (iter)
-        exit_client("non-empty parameter list for get_roles");
 
     ri = nh_get_roles();
     jmsg =
@@ -568,7 +596,17 @@ ccmd_get_roles(json_t * params)
     }
     json_object_set_new(jmsg, "matrix", jarr);
 
-    client_msg("get_roles", jmsg);
+    return jmsg;
+}
+
+
+static void
+ccmd_get_roles(json_t * params)
+{
+    const char *version = static_response_version(params, "get_roles");
+
+    if (!send_cached_response("get_roles", version, -1))
+        client_msg("get_roles", roles_json());
 }
 
 
@@ -614,19 +652,18 @@ ccmd_get_topten(json_t * params)
 }
 
 
-static void
-ccmd_get_commands(json_t * params)
+/* The command list only differs between normal and debug mode games, which
+ * have more commands. */
+json_t *
+commands_json(int *count)
 {
-    void *iter;
     int cmdcount, i;
     json_t *jarr, *jobj;
     struct nh_cmd_desc *cmdlist;
 
-    iter = json_object_iter(params);
-    if (iter)
-        exit_client("non-empty parameter list for get_commands");
-
     cmdlist = nh_get_commands(&cmdcount);
+    if (count)
+        *count = cmdcount;
 
     jarr = json_array();
     for (i = 0; i < cmdcount; i++) {
@@ -636,7 +673,19 @@ ccmd_get_commands(json_t * params)
                       cmdlist[i].altkey, "flags", cmdlist[i].flags);
         json_array_append_new(jarr, jobj);
     }
-    client_msg("get_commands", json_pack("{so}", "cmdlist", jarr));
+    return json_pack("{so}", "cmdlist", jarr);
+}
+
+
+static void
+ccmd_get_commands(json_t * params)
+{
+    const char *version = static_response_version(params, "get_commands");
+    int cmdcount;
+
+    nh_get_commands(&cmdcount);
+    if (!send_cached_response("get_commands", version, cmdcount))
+        client_msg("get_commands", commands_json(NULL));
 }
 
 
@@ -933,4 +982,23 @@ ccmd_set_password(json_t * params)
     client_msg("set_password", json_pack("{si}", "return", ret));
 }
 
+
+/* set_compression: compress everything sent after the response
+ * parameters: method
+ */
+static void
+ccmd_set_compression(json_t * params)
+{
+    const char *method;
+    int ret;
+
+    if (json_unpack(params, "{ss*}", "method", &method) == -1)
+        exit_client("Bad parameter for set_compression");
+
+    ret = settings.compression && !strcmp(method, "deflate");
+    client_msg("set_compression", json_pack("{si}", "return", ret));
+    if (ret && !start_compression())
+        exit_client("Failed to start compression");
+}
+
 /* clientcmd.c */
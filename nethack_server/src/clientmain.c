@@ -8,6 +8,8 @@
 #include "nhserver.h"
 #include <poll.h>
 #include <ctype.h>
+#include <sys/time.h>
+#include <zlib.h>
 
 #define COMMBUF_SIZE (1024 * 1024)
 
@@ -28,13 +30,23 @@
 #endif
 
 static int infd, outfd;
+static int ctlfd = -1;  /* master -> game socket in pass_sockets mode */
 int gamefd;
 long gameid;    /* id in the database */
 struct user_info user_info;
 int can_send_msg;
 
+/* With compression switched on (see set_compression), everything sent to the
+ * client goes through one deflate stream that lasts until the client
+ * disconnects. Each message ends with a sync flush, so the client can decode
+ * it completely as soon as it arrives. */
+static z_stream deflate_stream;
+static int compressing;
+static unsigned char *zbuf;
+static int zbufsize;
 
-static char **
+
+char **
 init_game_paths(void)
 {
     char **pathlist = malloc(sizeof (char *) * PREFIX_COUNT);
@@ -83,35 +95,174 @@ init_game_paths(void)
 }
 
 
+/*
+ * In pass_sockets mode the game process talks to the client directly: infd and
+ * outfd are both the client socket, or -1 while the client is disconnected.
+ */
+static void
+drop_client_socket(void)
+{
+    if (infd != -1)
+        close(infd);
+    infd = outfd = -1;
+    stop_compression();
+}
+
+
+/*
+ * The master has passed a client socket through the control socket, either for
+ * a new connection or a reconnect. It replaces the current socket, if any.
+ * Returns FALSE if the master is gone.
+ */
+static int
+receive_client_socket(void)
+{
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    struct timeval tv;
+    char dummy, cbuf[CMSG_SPACE(sizeof (int))];
+    int ret, fd = -1;
+
+    memset(&msg, 0, sizeof (msg));
+    iov.iov_base = &dummy;
+    iov.iov_len = 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof (cbuf);
+
+    do {
+        ret = recvmsg(ctlfd, &msg, MSG_CMSG_CLOEXEC);
+    } while (ret == -1 && errno == EINTR);
+    if (ret <= 0)
+        return FALSE;
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+            memcpy(&fd, CMSG_DATA(cmsg), sizeof (int));
+    if (fd == -1)
+        return TRUE;
+
+    drop_client_socket();
+    infd = outfd = fd;
+
+    /* Writes may block from now on; a client that stops reading is dropped
+       after client_timeout, like an idle one. */
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    tv.tv_sec = settings.client_timeout;
+    tv.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof (tv));
+
+    return TRUE;
+}
+
+
+/*
+ * Switch on compression for everything sent after the current message. Returns
+ * FALSE if the stream couldn't be set up; nothing changes in that case.
+ */
+int
+start_compression(void)
+{
+    if (compressing)
+        return TRUE;
+
+    memset(&deflate_stream, 0, sizeof (deflate_stream));
+    if (deflateInit(&deflate_stream, Z_DEFAULT_COMPRESSION) != Z_OK) {
+        log_msg("Failed to set up output compression: %s",
+                deflate_stream.msg ? deflate_stream.msg : "unknown error");
+        return FALSE;
+    }
+    compressing = TRUE;
+    return TRUE;
+}
+
+
+/* The client that negotiated compression is gone; a new one starts out
+ * uncompressed again. */
 void
-client_msg(const char *key, json_t * value)
+stop_compression(void)
 {
-    int len, ret, pos;
-    char *jsonstr;
-    json_t *jval, *display_data;
+    if (!compressing)
+        return;
+
+    deflateEnd(&deflate_stream);
+    compressing = FALSE;
+    free(zbuf);
+    zbuf = NULL;
+    zbufsize = 0;
+}
 
-    jval = json_object();
 
-    /* send out display data whenever anything else goes out */
-    display_data = get_display_data();
-    if (display_data) {
-        json_object_set_new(jval, "display", display_data);
-        display_data = NULL;
+/* Compress one message and flush it. Returns the length of the result in
+ * zbuf, or -1 if the stream is broken. */
+static int
+compress_msg(const char *str, int len)
+{
+    int ret;
+
+    if (!zbuf) {
+        zbufsize = 16 * 1024;
+        zbuf = malloc(zbufsize);
     }
 
-    /* actual message content */
-    json_object_set_new(jval, key, value);
-    jsonstr = json_dumps(jval, JSON_COMPACT);
-    json_decref(jval);
+    deflate_stream.next_in = (unsigned char *)str;
+    deflate_stream.avail_in = len;
+    deflate_stream.next_out = zbuf;
+    deflate_stream.avail_out = zbufsize;
+    while (1) {
+        ret = deflate(&deflate_stream, Z_SYNC_FLUSH);
+        if (ret != Z_OK && ret != Z_BUF_ERROR)
+            return -1;
+        /* the flush is complete when deflate leaves some output space */
+        if (deflate_stream.avail_in == 0 && deflate_stream.avail_out != 0)
+            break;
+
+        zbuf = realloc(zbuf, zbufsize * 2);
+        deflate_stream.next_out = zbuf + zbufsize;
+        deflate_stream.avail_out = zbufsize;
+        zbufsize *= 2;
+    }
+
+    return zbufsize - deflate_stream.avail_out;
+}
+
+
+static void
+send_msg_string(const char *jsonstr)
+{
+    int len, ret, pos;
+    const char *data = jsonstr;
+    unsigned long long start;
 
-    if (can_send_msg) {
+    if (can_send_msg && outfd != -1) {
         len = strlen(jsonstr);
+        if (compressing) {
+            start = timing_now();
+            len = compress_msg(jsonstr, len);
+            if (len == -1) {
+                stop_compression();
+                exit_client("Output compression failed");
+            }
+            data = (const char *)zbuf;
+            timing_add(TP_ENCODE, timing_now() - start);
+        }
+
+        start = timing_now();
         pos = 0;
         do {
-            ret = write(outfd, &jsonstr[pos], len - pos);
-            if (ret == -1 && (errno == EINTR || errno == EAGAIN))
+            ret = write(outfd, &data[pos], len - pos);
+            if (ret == -1 && (errno == EINTR || (errno == EAGAIN &&
+                                                 ctlfd == -1)))
                 continue;
-            else if (ret == -1 || ret == 0) {   /* bad news */
+            else if ((ret == -1 || ret == 0) && ctlfd != -1) {
+                /* The client is gone. The master would have discarded the
+                   message as well; the client re-sends its command after
+                   reconnecting. */
+                drop_client_socket();
+                break;
+            } else if (ret == -1 || ret == 0) { /* bad news */
                 /* since we just found we can't write output to the pipe,
                    prevent any more tries */
                 close(infd);
@@ -121,10 +272,64 @@ client_msg(const char *key, json_t * value)
             }
             pos += ret;
         } while (pos < len);
+        timing_add(TP_WRITE, timing_now() - start);
     }
     /* this message is sent; don't send another */
     can_send_msg = FALSE;
+}
+
+
+void
+client_msg(const char *key, json_t * value)
+{
+    char *jsonstr;
+    json_t *jval, *display_data;
+    unsigned long long start = timing_now();
+
+    jval = json_object();
+
+    /* send out display data whenever anything else goes out */
+    display_data = get_display_data();
+    if (display_data) {
+        json_object_set_new(jval, "display", display_data);
+        display_data = NULL;
+    }
+
+    /* actual message content */
+    json_object_set_new(jval, key, value);
+    jsonstr = json_dumps(jval, JSON_COMPACT);
+    json_decref(jval);
+    timing_add(TP_ENCODE, timing_now() - start);
 
+    send_msg_string(jsonstr);
+    free(jsonstr);
+}
+
+
+/* Like client_msg, but the value is already serialized. */
+void
+client_msg_raw(const char *key, const char *value)
+{
+    char *jsonstr, *dstr = NULL;
+    json_t *display_data;
+    unsigned long long start = timing_now();
+
+    display_data = get_display_data();
+    if (display_data) {
+        dstr = json_dumps(display_data, JSON_COMPACT);
+        json_decref(display_data);
+    }
+
+    jsonstr = malloc(strlen(key) + strlen(value) + (dstr ? strlen(dstr) : 0) +
+                     32);
+    if (dstr)
+        sprintf(jsonstr, "{\"display\":%s,\"%s\":%s}", dstr, key, value);
+    else
+        sprintf(jsonstr, "{\"%s\":%s}", key, value);
+    free(dstr);
+    timing_add(TP_ENCODE, timing_now() - start);
+
+    send_msg_string(jsonstr);
     free(jsonstr);
 }
 
@@ -151,7 +356,8 @@ exit_client(const char *err)
         usleep(100);    /* try to make sure the server process handles write()
                            before close(). */
         close(infd);
-        close(outfd);
+        if (outfd != infd)
+            close(outfd);
         infd = outfd = -1;
     }
 
@@ -160,6 +366,8 @@ exit_client(const char *err)
     if (!sigsegv_flag)
         nh_exit_game(EXIT_FORCE_SAVE);  /* might not return here */
     nh_lib_exit();
+    timing_write_stats(TRUE);
+    log_db_stats();
     close_database();
     if (user_info.username)
         free(user_info.username);
@@ -178,22 +386,51 @@ read_input(void)
     char *bp;
     json_t *jval = NULL;
     json_error_t err;
-    struct pollfd pfd[1] =
-        { {infd, POLLIN | POLLRDHUP | POLLERR | POLLHUP, 0} };
+    struct pollfd pfd[2] = {
+        {infd, POLLIN | POLLRDHUP | POLLERR | POLLHUP, 0},
+        {ctlfd, POLLIN, 0}      /* ignored by poll if ctlfd is -1 */
+    };
+    unsigned long long start = timing_now();
 
     done = FALSE;
     datalen = 0;
+    flush_log();        /* nothing is logged while the game waits */
     while (!done && !termination_flag) {
-        ret = poll(pfd, 1, settings.client_timeout * 1000);
+        ret = poll(pfd, 2, settings.client_timeout * 1000);
         if (ret == 0)
             exit_client("Inactivity timeout");
+        else if (ret == -1)
+            continue;
+
+        if (pfd[1].revents) {
+            /* a new connection replaces the old one, so whatever arrived on
+               the old one is meaningless now; see the '\033' case below */
+            if (!receive_client_socket())
+                exit_client("Control socket lost");
+            pfd[0].fd = infd;
+            datalen = 0;
+            reset_sent_item_lists();
+            continue;
+        }
+        if (!pfd[0].revents)
+            continue;
 
         ret = read(infd, &commbuf[datalen], COMMBUF_SIZE - datalen - 1);
+        if (ret == -1 && ctlfd != -1 && errno != EINTR && errno != EAGAIN)
+            ret = 0;    /* connection reset: treat it as a disconnect */
         if (ret == -1)
             continue;   /* sone signals will set termination_flag, others won't 
                          */
-        else if (ret == 0)
+        else if (ret == 0 && ctlfd == -1)
             exit_client("Input pipe lost");
+        else if (ret == 0) {
+            /* the client disconnected; the game keeps running until the
+               master passes on a reconnect or the inactivity timeout hits */
+            drop_client_socket();
+            pfd[0].fd = -1;
+            datalen = 0;
+            continue;
+        }
         datalen += ret;
 
         if (commbuf[datalen - ret] == '\033') {
@@ -206,6 +443,9 @@ read_input(void)
             datalen = ret - 1;
             /* also reset the cached display data to make sure all display
                state is re-sent */
+            reset_sent_item_lists();
+            /* the new connection starts out uncompressed */
+            stop_compression();
             continue;
         }
 
@@ -229,6 +469,7 @@ read_input(void)
     }
     /* message received; mow it's our turn to send */
     can_send_msg = TRUE;
+    timing_add(TP_WAIT, timing_now() - start);
     return jval;
 }
 
@@ -259,7 +500,9 @@ client_main_loop(void)
         value = json_object_iter_value(iter);
         for (i = 0; clientcmd[i].name; i++)
             if (!strcmp(clientcmd[i].name, key)) {
+                timing_begin_command();
                 clientcmd[i].func(value);
+                timing_end_command(i);
                 break;
             }
 
@@ -271,6 +514,7 @@ client_main_loop(void)
             exit_client("More than one command received. This is unsupported.");
 
         json_decref(obj);
+        timing_write_stats(FALSE);
     }
 }
 
@@ -280,17 +524,20 @@ client_main_loop(void)
  * The server process has accepted a connection and authenticated it. Data from
  * the client will arrive here via infd and data that should be sent back goes
  * through outfd.
+ * In pass_sockets mode infd and outfd are -1 and the client socket itself
+ * arrives through ctlfd instead, as does the new socket after a reconnect.
  * An instance of NetHack will run in this process under the control of the
  * remote player. 
  */
 void
-client_main(int userid, int _infd, int _outfd)
+client_main(int userid, int _infd, int _outfd, int _ctlfd)
 {
     char **gamepaths;
     int i;
 
     infd = _infd;
     outfd = _outfd;
+    ctlfd = _ctlfd;
     gamefd = -1;
 
     init_database();
@@ -298,6 +545,7 @@ client_main(int userid, int _infd, int _outfd)
         log_msg("get_user_info error for uid %d!", userid);
         exit_client("database error");
     }
+    setenv("NH4SERVERUSER", user_info.username, 1);
 
     gamepaths = init_game_paths();
     nh_lib_init(&server_windowprocs, gamepaths);
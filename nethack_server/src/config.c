@@ -179,6 +179,68 @@ parse_config_line(char *line)
            default value */
     }
 
+    else if (!strcmp(line, "pass_sockets")) {
+        if (*val == '1' || !strcmp(val, "true"))
+            settings.pass_sockets = TRUE;
+        else if (*val != '0' && strcmp(val, "false")) {
+            fprintf(stderr,
+                    "Error: pass_sockets may only be set to \"0\", \"1\", "
+                    "\"true\" or \"false\".\n");
+            return FALSE;
+        }
+    }
+
+    else if (!strcmp(line, "coalesce_display")) {
+        if (*val == '1' || !strcmp(val, "true"))
+            settings.coalesce_display = TRUE;
+        else if (*val != '0' && strcmp(val, "false")) {
+            fprintf(stderr,
+                    "Error: coalesce_display may only be set to \"0\", "
+                    "\"1\", \"true\" or \"false\".\n");
+            return FALSE;
+        }
+    }
+
+    else if (!strcmp(line, "compression")) {
+        if (*val == '1' || !strcmp(val, "true"))
+            settings.compression = TRUE;
+        else if (*val != '0' && strcmp(val, "false")) {
+            fprintf(stderr,
+                    "Error: compression may only be set to \"0\", \"1\", "
+                    "\"true\" or \"false\".\n");
+            return FALSE;
+        }
+    }
+
+    else if (!strcmp(line, "auth_workers")) {
+        if (!settings.auth_workers)
+            settings.auth_workers = atoi(val);
+
+        if (settings.auth_workers < 1 || settings.auth_workers > 64) {
+            fprintf(stderr,
+                    "Error: the value for auth_workers must be in the"
+                    " range [1, 64].\n");
+            return FALSE;
+        }
+    }
+
+    else if (!strcmp(line, "shards")) {
+        if (!settings.shards)
+            settings.shards = atoi(val);
+
+        if (settings.shards < 1 || settings.shards > 64) {
+            fprintf(stderr,
+                    "Error: the value for shards must be in the"
+                    " range [1, 64].\n");
+            return FALSE;
+        }
+    }
+
+    else if (!strcmp(line, "statsfile")) {
+        if (!settings.statsfile)
+            settings.statsfile = strdup(val);
+    }
+
     else if (!strcmp(line, "workdir")) {
         if (!settings.workdir)
             settings.workdir = strdup(val);
@@ -197,6 +259,30 @@ parse_config_line(char *line)
         }
     }
 
+    else if (!strcmp(line, "client_buffer_kb")) {
+        if (!settings.client_buffer_kb)
+            settings.client_buffer_kb = atoi(val);
+
+        if (settings.client_buffer_kb < 16 ||
+            settings.client_buffer_kb > 1024 * 1024) {
+            fprintf(stderr,
+                    "Error: the value for client_buffer_kb must be in the"
+                    " range [16, 1048576].\n");
+            return FALSE;
+        }
+    }
+
+    else if (!strcmp(line, "dbbackend")) {
+        if (!find_db_backend(val)) {
+            fprintf(stderr,
+                    "Error: the value for dbbackend must be \"pgsql\" or "
+                    "\"sqlite\", not %s.\n", val);
+            return FALSE;
+        }
+        if (!settings.dbbackend)
+            settings.dbbackend = strdup(val);
+    }
+
     else if (!strcmp(line, "dbhost")) {
         if (!settings.dbhost)
             settings.dbhost = strdup(val);
@@ -317,6 +403,18 @@ setup_defaults(void)
 
     if (!settings.client_timeout)
         settings.client_timeout = DEFAULT_CLIENT_TIMEOUT;
+
+    if (!settings.client_buffer_kb)
+        settings.client_buffer_kb = DEFAULT_CLIENT_BUFFER_KB;
+
+    if (!settings.auth_workers)
+        settings.auth_workers = DEFAULT_AUTH_WORKERS;
+
+    if (!settings.shards)
+        settings.shards = DEFAULT_SHARDS;
+
+    if (!settings.dbbackend)
+        settings.dbbackend = strdup(DEFAULT_DB_BACKEND);
 }
 
 
@@ -329,6 +427,10 @@ free_config(void)
         free(settings.pidfile);
     if (settings.workdir)
         free(settings.workdir);
+    if (settings.statsfile)
+        free(settings.statsfile);
+    if (settings.dbbackend)
+        free(settings.dbbackend);
     if (settings.dbhost)
         free(settings.dbhost);
     if (settings.dbport)
@@ -0,0 +1,179 @@
+/* vim:set cin ft=c sw=4 sts=4 ts=8 et ai cino=Ls\:0t0(0 : -*- mode:c;fill-column:80;tab-width:8;c-basic-offset:4;indent-tabs-mode:nil;c-file-style:"k&r" -*-*/
+/* The NetHack server may be freely redistributed under the terms of either:
+ *  - the NetHack license
+ *  - the GNU General Public license v2 or later
+ */
+
+/*
+ * The storage interface: the rest of the server only calls the db_*
+ * functions below, which forward to the backend selected in the config.
+ */
+
+#include "nhserver.h"
+
+static const struct db_backend *const backends[] = {
+    &pgsql_backend,
+    &sqlite_backend,
+    NULL
+};
+
+static const struct db_backend *backend;
+
+
+const struct db_backend *
+find_db_backend(const char *name)
+{
+    int i;
+
+    for (i = 0; backends[i]; i++)
+        if (!strcmp(backends[i]->name, name))
+            return backends[i];
+
+    return NULL;
+}
+
+
+int
+init_database(void)
+{
+    if (!backend)
+        backend = find_db_backend(settings.dbbackend);
+    if (!backend) {
+        fprintf(stderr, "Unknown database backend \"%s\".\n",
+                settings.dbbackend);
+        return FALSE;
+    }
+
+    return backend->init_database();
+}
+
+
+int
+check_database(void)
+{
+    return backend->check_database();
+}
+
+
+void
+close_database(void)
+{
+    if (backend)
+        backend->close_database();
+}
+
+
+int
+db_auth_user(const char *name, const char *pass)
+{
+    return backend->auth_user(name, pass);
+}
+
+
+int
+db_register_user(const char *name, const char *pass, const char *email)
+{
+    return backend->register_user(name, pass, email);
+}
+
+
+int
+db_get_user_info(int uid, struct user_info *info)
+{
+    return backend->get_user_info(uid, info);
+}
+
+
+void
+db_update_user_ts(int uid)
+{
+    backend->update_user_ts(uid);
+}
+
+
+int
+db_set_user_email(int uid, const char *email)
+{
+    return backend->set_user_email(uid, email);
+}
+
+
+int
+db_set_user_password(int uid, const char *password)
+{
+    return backend->set_user_password(uid, password);
+}
+
+
+long
+db_add_new_game(int uid, const char *filename, const char *role,
+                const char *race, const char *gend, const char *align, int mode,
+                const char *plname, const char *levdesc)
+{
+    return backend->add_new_game(uid, filename, role, race, gend, align, mode,
+                                 plname, levdesc);
+}
+
+
+void
+db_update_game(int game, int moves, int depth, const char *levdesc)
+{
+    backend->update_game(game, moves, depth, levdesc);
+}
+
+
+int
+db_get_game_filename(int uid, int gid, char *namebuf, int buflen)
+{
+    return backend->get_game_filename(uid, gid, namebuf, buflen);
+}
+
+
+void
+db_delete_game(int uid, int gid)
+{
+    backend->delete_game(uid, gid);
+}
+
+
+struct gamefile_info *
+db_list_games(int completed, int uid, int limit, int *count)
+{
+    return backend->list_games(completed, uid, limit, count);
+}
+
+
+void
+db_set_option(int uid, const char *optname, int type, const char *optval)
+{
+    backend->set_option(uid, optname, type, optval);
+}
+
+
+void
+db_restore_options(int uid)
+{
+    backend->restore_options(uid);
+}
+
+
+void
+db_add_topten_entry(int gid, int points, int hp, int maxhp, int deaths,
+                    int end_how, const char *death, const char *entrytxt)
+{
+    backend->add_topten_entry(gid, points, hp, maxhp, deaths, end_how, death,
+                              entrytxt);
+}
+
+
+const struct db_stmt_stats *
+db_get_stmt_stats(int *count)
+{
+    if (!backend) {
+        *count = 0;
+        return NULL;
+    }
+    return backend->get_stmt_stats(count);
+}
+
+/* db.c */
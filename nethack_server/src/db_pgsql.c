@@ -13,9 +13,7 @@
 # include <libpq-fe.h>
 #endif
 
-/* prepared statement names */
-#define PREP_AUTH       "auth_user"
-#define PREP_REGISTER   "register_user"
+#include <time.h>
 
 /* SQL statements used */
 static const char SQL_init_user_table[] =
@@ -111,9 +109,13 @@ static const char SQL_update_option[] =
     "UPDATE options " "SET optvalue = $1::text "
     "WHERE uid = $2::integer AND optname = $3::text;";
 
+/* Only inserts if SQL_update_option didn't find the option, so that both can
+ * be sent together. */
 static const char SQL_insert_option[] =
     "INSERT INTO options (optvalue, uid, optname, opttype) "
-    "VALUES ($1::text, $2::integer, $3::text, $4::integer);";
+    "SELECT $1::text, $2::integer, $3::text, $4::integer "
+    "WHERE NOT EXISTS (SELECT 1 FROM options "
+    "                  WHERE uid = $2::integer AND optname = $3::text);";
 
 static const char SQL_get_options[] =
     "SELECT optname, optvalue " "FROM options " "WHERE uid = $1::integer;";
@@ -124,17 +126,259 @@ static const char SQL_add_topten_entry[] =
     "$5::integer, $6::integer, $7::text, $8::text);";
 
 
+/*
+ * All statements used at runtime are prepared when the connection is opened.
+ * The order of entries in statements[] must match enum db_stmt_id.
+ */
+enum db_stmt_id {
+    STMT_AUTH_USER,
+    STMT_REGISTER_USER,
+    STMT_LAST_REG_ID,
+    STMT_GET_USER_INFO,
+    STMT_UPDATE_USER_TS,
+    STMT_SET_USER_EMAIL,
+    STMT_SET_USER_PASSWORD,
+    STMT_ADD_GAME,
+    STMT_LAST_GAME_ID,
+    STMT_DELETE_GAME,
+    STMT_UPDATE_GAME,
+    STMT_GET_GAME_FILENAME,
+    STMT_SET_GAME_DONE,
+    STMT_LIST_GAMES,
+    STMT_UPDATE_OPTION,
+    STMT_INSERT_OPTION,
+    STMT_GET_OPTIONS,
+    STMT_ADD_TOPTEN_ENTRY,
+    STMT_COUNT
+};
+
+struct db_statement {
+    const char *name;
+    const char *sql;
+    int nparams;
+    int prepared;
+};
+
+static struct db_statement statements[STMT_COUNT] = {
+    {"auth_user", SQL_auth_user, 2},
+    {"register_user", SQL_register_user, 3},
+    {"last_reg_id", SQL_last_reg_id, 0},
+    {"get_user_info", SQL_get_user_info, 1},
+    {"update_user_ts", SQL_update_user_ts, 1},
+    {"set_user_email", SQL_set_user_email, 2},
+    {"set_user_password", SQL_set_user_password, 2},
+    {"add_game", SQL_add_game, 9},
+    {"last_game_id", SQL_last_game_id, 0},
+    {"delete_game", SQL_delete_game, 2},
+    {"update_game", SQL_update_game, 4},
+    {"get_game_filename", SQL_get_game_filename, 2},
+    {"set_game_done", SQL_set_game_done, 1},
+    {"list_games", SQL_list_games, 3},
+    {"update_option", SQL_update_option, 3},
+    {"insert_option", SQL_insert_option, 4},
+    {"get_options", SQL_get_options, 1},
+    {"add_topten_entry", SQL_add_topten_entry, 8},
+};
+
+static struct db_stmt_stats stmt_stats[STMT_COUNT];
+
+/* One statement of a batch: the statements of a batch are sent to the server
+ * together and only then are the results collected. */
+struct db_query {
+    enum db_stmt_id stmt;
+    const char *const *params;
+    PGresult *res;
+};
+
+
 static PGconn *conn;
+static pid_t conn_pid;  /* the process that opened conn */
+
+static void pgsql_close_database(void);
+static void reset_connection(void);
+
+
+static double
+elapsed_ms(const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000.0 +
+        (now.tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+
+static void
+record_stmt_stats(enum db_stmt_id stmt, const struct timespec *start,
+                  const PGresult *res)
+{
+    struct db_stmt_stats *st = &stmt_stats[stmt];
+    double ms = elapsed_ms(start);
+
+    st->calls++;
+    if (PQresultStatus(res) != PGRES_COMMAND_OK &&
+        PQresultStatus(res) != PGRES_TUPLES_OK)
+        st->errors++;
+    st->total_ms += ms;
+    if (ms > st->max_ms)
+        st->max_ms = ms;
+}
+
+
+static PGresult *
+exec_stmt(enum db_stmt_id stmt, const char *const *params)
+{
+    PGresult *res;
+    struct timespec start;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    res = PQexecPrepared(conn, statements[stmt].name, statements[stmt].nparams,
+                         params, NULL, NULL, 0);
+    record_stmt_stats(stmt, &start, res);
+    return res;
+}
+
+
+/*
+ * Execute several statements with a single round trip to the database server.
+ * The statements run in one implicit transaction: if one of them fails, the
+ * following ones are aborted. Each query's res must be freed by the caller.
+ * If libpq can't pipeline, the statements are simply executed one by one.
+ */
+static void
+exec_batch(struct db_query *queries, int count)
+{
+    int i, sent;
+
+#ifdef LIBPQ_HAS_PIPELINING
+    PGresult *res;
+    ExecStatusType status;
+    struct timespec start;
+    int synced, got_null;
+
+    if (PQenterPipelineMode(conn)) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (sent = 0; sent < count; sent++) {
+            const struct db_statement *st = &statements[queries[sent].stmt];
+
+            if (!PQsendQueryPrepared(conn, st->name, st->nparams,
+                                     queries[sent].params, NULL, NULL, 0))
+                break;
+        }
+        synced = PQpipelineSync(conn);
+
+        for (i = 0; i < count; i++)
+            queries[i].res = NULL;
+
+        for (i = 0; i < sent; i++) {
+            queries[i].res = PQgetResult(conn);
+            record_stmt_stats(queries[i].stmt, &start, queries[i].res);
+            if (!queries[i].res)
+                break;
+            /* each query's results are terminated by NULL */
+            while ((res = PQgetResult(conn)))
+                PQclear(res);
+        }
+
+        /* Consume the results up to and including the sync point. After an
+           error, the remaining queries each return PGRES_PIPELINE_ABORTED
+           followed by NULL, so a NULL doesn't mean we're done. Two NULLs in a
+           row do: libpq has nothing left to return. */
+        got_null = FALSE;
+        while (synced) {
+            res = PQgetResult(conn);
+            if (!res) {
+                if (got_null || PQstatus(conn) == CONNECTION_BAD)
+                    break;
+                got_null = TRUE;
+                continue;
+            }
+            got_null = FALSE;
+            status = PQresultStatus(res);
+            PQclear(res);
+            if (status == PGRES_PIPELINE_SYNC)
+                break;
+        }
+
+        /* fails if the pipeline still has results pending; the connection
+           is then useless for ordinary queries */
+        if (!PQexitPipelineMode(conn)) {
+            log_msg("exec_batch: leaving pipeline mode failed: %s",
+                    PQerrorMessage(conn));
+            reset_connection();
+        }
+        return;
+    }
+#endif
+
+    for (i = 0; i < count; i++)
+        queries[i].res = exec_stmt(queries[i].stmt, queries[i].params);
+}
+
+
+/*
+ * Prepare all the statements that haven't been prepared on this connection
+ * yet. This fails if the tables don't exist yet, so errors are only reported
+ * on request.
+ */
+static int
+prepare_statements(int report_errors)
+{
+    PGresult *res;
+    int i, ok = TRUE;
+
+    for (i = 0; i < STMT_COUNT; i++) {
+        if (statements[i].prepared)
+            continue;
+
+        res = PQprepare(conn, statements[i].name, statements[i].sql, 0, NULL);
+        if (PQresultStatus(res) == PGRES_COMMAND_OK)
+            statements[i].prepared = TRUE;
+        else {
+            if (report_errors)
+                fprintf(stderr, "prepare statement %s failed: %s",
+                        statements[i].name, PQerrorMessage(conn));
+            ok = FALSE;
+        }
+        PQclear(res);
+    }
+
+    return ok;
+}
+
+
+/*
+ * Re-establish a connection that is in an unusable state. Prepared statements
+ * belong to the old session, so they must be prepared again.
+ */
+static void
+reset_connection(void)
+{
+    int i;
+
+    PQreset(conn);
+    if (PQstatus(conn) == CONNECTION_BAD) {
+        log_msg("database connection reset failed: %s", PQerrorMessage(conn));
+        return;
+    }
+
+    for (i = 0; i < STMT_COUNT; i++)
+        statements[i].prepared = FALSE;
+    prepare_statements(TRUE);
+}
 
 
 /*
  * init the database connection.
  */
-int
-init_database(void)
+static int
+pgsql_init_database(void)
 {
+    int i;
+
     if (conn)
-        close_database();
+        pgsql_close_database();
 
     conn =
         PQsetdbLogin(settings.dbhost, settings.dbport, NULL, NULL,
@@ -143,6 +387,16 @@ init_database(void)
         fprintf(stderr, "Database connection failed. Check your settings.\n");
         goto err;
     }
+    conn_pid = getpid();
+
+    for (i = 0; i < STMT_COUNT; i++) {
+        statements[i].prepared = FALSE;
+        memset(&stmt_stats[i], 0, sizeof (struct db_stmt_stats));
+        stmt_stats[i].name = statements[i].name;
+    }
+    /* On a new database the tables don't exist yet; check_database will
+       create them and prepare the statements again. */
+    prepare_statements(FALSE);
 
     return TRUE;
 
@@ -187,8 +441,8 @@ check_create_table(const char *tablename, const char *create_stmt)
  * check the database tables and create them if necessary. Also check for the
  * existence of the crypt function
  */
-int
-check_database(void)
+static int
+pgsql_check_database(void)
 {
     PGresult *res;
 
@@ -215,23 +469,10 @@ check_database(void)
         goto err;
 
     /* 
-     * Create prepared statements
+     * Create any prepared statements that init_database couldn't
      */
-    res = PQprepare(conn, PREP_REGISTER, SQL_register_user, 0, NULL);
-    if (PQresultStatus(res) != PGRES_COMMAND_OK) {
-        fprintf(stderr, "prepare statement failed: %s", PQerrorMessage(conn));
-        PQclear(res);
+    if (!prepare_statements(TRUE))
         goto err;
-    }
-    PQclear(res);
-
-    res = PQprepare(conn, PREP_AUTH, SQL_auth_user, 0, NULL);
-    if (PQresultStatus(res) != PGRES_COMMAND_OK) {
-        fprintf(stderr, "prepare statement failed: %s", PQerrorMessage(conn));
-        PQclear(res);
-        goto err;
-    }
-    PQclear(res);
 
     return TRUE;
 
@@ -241,23 +482,39 @@ err:
 }
 
 
-void
-close_database(void)
+static void
+pgsql_close_database(void)
 {
-    PQfinish(conn);
+    /* PQfinish would end the session for the process that opened the
+       connection as well, so a connection inherited via fork is just
+       abandoned. */
+    if (conn_pid == getpid())
+        PQfinish(conn);
     conn = NULL;
 }
 
 
-int
-db_auth_user(const char *name, const char *pass)
+/*
+ * Per-statement call counts and latencies since the connection was opened,
+ * for log_db_stats.
+ */
+static const struct db_stmt_stats *
+pgsql_get_stmt_stats(int *count)
+{
+    *count = STMT_COUNT;
+    return stmt_stats;
+}
+
+
+static int
+pgsql_auth_user(const char *name, const char *pass)
 {
     PGresult *res;
     const char *const params[] = { name, pass };
     int uid, auth_ok, col;
     const char *uidstr;
 
-    res = PQexecPrepared(conn, PREP_AUTH, 2, params, NULL, NULL, 0);
+    res = exec_stmt(STMT_AUTH_USER, params);
     if (PQresultStatus(res) != PGRES_TUPLES_OK || PQntuples(res) == 0) {
         log_msg("db_auth_user failed: %s\n", PQerrorMessage(conn));
         PQclear(res);
@@ -276,51 +533,43 @@ db_auth_user(const char *name, const char *pass)
 }
 
 
-int
-db_register_user(const char *name, const char *pass, const char *email)
+static int
+pgsql_register_user(const char *name, const char *pass, const char *email)
 {
-    PGresult *res;
     const char *const params[] = { name, pass, email };
-    int uid;
-    const char *uidstr;
+    struct db_query q[] = {
+        {STMT_REGISTER_USER, params},
+        {STMT_LAST_REG_ID, NULL}
+    };
+    int uid = 0;
 
-    res = PQexecPrepared(conn, PREP_REGISTER, 3, params, NULL, NULL, 0);
-    if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+    exec_batch(q, 2);
+    if (PQresultStatus(q[0].res) != PGRES_COMMAND_OK)
         log_msg("db_register_user failed: %s", PQerrorMessage(conn));
-        PQclear(res);
-        return 0;
-    }
-    PQclear(res);
-
-    res = PQexec(conn, SQL_last_reg_id);
-    if (PQresultStatus(res) != PGRES_TUPLES_OK || PQntuples(res) == 0) {
+    else if (PQresultStatus(q[1].res) != PGRES_TUPLES_OK ||
+             PQntuples(q[1].res) == 0)
         log_msg("db_register_user get last id failed: %s",
                 PQerrorMessage(conn));
-        PQclear(res);
-        return 0;
-    }
-    uidstr = PQgetvalue(res, 0, 0);
-    uid = atoi(uidstr);
-    PQclear(res);
+    else
+        uid = atoi(PQgetvalue(q[1].res, 0, 0));
+    PQclear(q[0].res);
+    PQclear(q[1].res);
 
     return uid;
 }
 
 
-int
-db_get_user_info(int uid, struct user_info *info)
+static int
+pgsql_get_user_info(int uid, struct user_info *info)
 {
     PGresult *res;
     char uidstr[16];
     const char *const params[] = { uidstr };
-    const int paramFormats[] = { 0 };   /* text format */
     int col;
 
     sprintf(uidstr, "%d", uid);
 
-    res =
-        PQexecParams(conn, SQL_get_user_info, 1, NULL, params, NULL,
-                     paramFormats, 0);
+    res = exec_stmt(STMT_GET_USER_INFO, params);
     if (PQresultStatus(res) != PGRES_TUPLES_OK || PQntuples(res) == 0) {
         log_msg("db_get_user_info error: %s", PQerrorMessage(conn));
         PQclear(res);
@@ -340,38 +589,32 @@ db_get_user_info(int uid, struct user_info *info)
 }
 
 
-void
-db_update_user_ts(int uid)
+static void
+pgsql_update_user_ts(int uid)
 {
     PGresult *res;
     char uidstr[16];
     const char *const params[] = { uidstr };
-    const int paramFormats[] = { 0 };   /* text format */
 
     sprintf(uidstr, "%d", uid);
-    res =
-        PQexecParams(conn, SQL_update_user_ts, 1, NULL, params, NULL,
-                     paramFormats, 0);
+    res = exec_stmt(STMT_UPDATE_USER_TS, params);
     if (PQresultStatus(res) != PGRES_COMMAND_OK)
         log_msg("update_user_ts error: %s", PQerrorMessage(conn));
     PQclear(res);
 }
 
 
-int
-db_set_user_email(int uid, const char *email)
+static int
+pgsql_set_user_email(int uid, const char *email)
 {
     PGresult *res;
     char uidstr[16];
     const char *const params[] = { uidstr, email };
-    const int paramFormats[] = { 0, 0 };
     const char *numrows;
 
     sprintf(uidstr, "%d", uid);
 
-    res =
-        PQexecParams(conn, SQL_set_user_email, 2, NULL, params, NULL,
-                     paramFormats, 0);
+    res = exec_stmt(STMT_SET_USER_EMAIL, params);
     numrows = PQcmdTuples(res);
     if (PQresultStatus(res) == PGRES_COMMAND_OK && atoi(numrows) == 1) {
         PQclear(res);
@@ -382,20 +625,17 @@ db_set_user_email(int uid, const char *email)
 }
 
 
-int
-db_set_user_password(int uid, const char *password)
+static int
+pgsql_set_user_password(int uid, const char *password)
 {
     PGresult *res;
     char uidstr[16];
     const char *const params[] = { uidstr, password };
-    const int paramFormats[] = { 0, 0 };
     const char *numrows;
 
     sprintf(uidstr, "%d", uid);
 
-    res =
-        PQexecParams(conn, SQL_set_user_password, 2, NULL, params, NULL,
-                     paramFormats, 0);
+    res = exec_stmt(STMT_SET_USER_PASSWORD, params);
     numrows = PQcmdTuples(res);
     if (PQresultStatus(res) == PGRES_COMMAND_OK && atoi(numrows) == 1) {
         PQclear(res);
@@ -406,83 +646,68 @@ db_set_user_password(int uid, const char *password)
 }
 
 
-long
-db_add_new_game(int uid, const char *filename, const char *role,
+static long
+pgsql_add_new_game(int uid, const char *filename, const char *role,
                 const char *race, const char *gend, const char *align, int mode,
                 const char *plname, const char *levdesc)
 {
-    PGresult *res;
     char uidstr[16], modestr[16];
 
     const char *const params[] = { filename, role, race, gend,
         align, modestr, uidstr, plname, levdesc
     };
-    const int paramFormats[] = { 0, 0, 0, 0, 0, 0, 0, 0, 0 };
-    const char *gameid_str;
-    int gid;
+    struct db_query q[] = {
+        {STMT_ADD_GAME, params},
+        {STMT_LAST_GAME_ID, NULL}
+    };
+    int gid = 0;
 
     sprintf(uidstr, "%d", uid);
     sprintf(modestr, "%d", mode);
 
-    res =
-        PQexecParams(conn, SQL_add_game, 9, NULL, params, NULL, paramFormats,
-                     0);
-    if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+    exec_batch(q, 2);
+    if (PQresultStatus(q[0].res) != PGRES_COMMAND_OK)
         log_msg("db_add_new_game error while adding (%s - %s): %s", plname,
                 filename, PQerrorMessage(conn));
-        PQclear(res);
-        return 0;
-    }
-
-    res = PQexec(conn, SQL_last_game_id);
-    if (PQresultStatus(res) != PGRES_TUPLES_OK || PQntuples(res) == 0) {
-        PQclear(res);
-        return 0;
-    }
-
-    gameid_str = PQgetvalue(res, 0, 0);
-    gid = atoi(gameid_str);
-    PQclear(res);
+    else if (PQresultStatus(q[1].res) == PGRES_TUPLES_OK &&
+             PQntuples(q[1].res) > 0)
+        gid = atoi(PQgetvalue(q[1].res, 0, 0));
+    PQclear(q[0].res);
+    PQclear(q[1].res);
 
     return gid;
 }
 
 
-void
-db_update_game(int game, int moves, int depth, const char *levdesc)
+static void
+pgsql_update_game(int game, int moves, int depth, const char *levdesc)
 {
     PGresult *res;
     char gidstr[16], movesstr[16], depthstr[16];
     const char *const params[] = { gidstr, movesstr, depthstr, levdesc };
-    const int paramFormats[] = { 0, 0, 0, 0 };
 
     sprintf(gidstr, "%d", game);
     sprintf(movesstr, "%d", moves);
     sprintf(depthstr, "%d", depth);
 
-    res =
-        PQexecParams(conn, SQL_update_game, 4, NULL, params, NULL, paramFormats,
-                     0);
+    res = exec_stmt(STMT_UPDATE_GAME, params);
     if (PQresultStatus(res) != PGRES_COMMAND_OK)
         log_msg("update_game_ts error: %s", PQerrorMessage(conn));
     PQclear(res);
 }
 
 
-int
-db_get_game_filename(int uid, int gid, char *namebuf, int buflen)
+static int
+pgsql_get_game_filename(int uid, int gid, char *namebuf, int buflen)
 {
     PGresult *res;
     char uidstr[16], gidstr[16];
     const char *const params[] = { uidstr, gidstr };
-    const int paramFormats[] = { 0, 0 };
 
     sprintf(uidstr, "%d", uid);
     sprintf(gidstr, "%d", gid);
 
-    res =
-        PQexecParams(conn, SQL_get_game_filename, 2, NULL, params, NULL,
-                     paramFormats, 0);
+    res = exec_stmt(STMT_GET_GAME_FILENAME, params);
     if (PQresultStatus(res) != PGRES_TUPLES_OK || PQntuples(res) == 0) {
         log_msg("get_game_filename error: %s", PQerrorMessage(conn));
         PQclear(res);
@@ -495,20 +720,17 @@ db_get_game_filename(int uid, int gid, char *namebuf, int buflen)
 }
 
 
-void
-db_delete_game(int uid, int gid)
+static void
+pgsql_delete_game(int uid, int gid)
 {
     PGresult *res;
     char uidstr[16], gidstr[16];
     const char *const params[] = { uidstr, gidstr };
-    const int paramFormats[] = { 0, 0 };
 
     sprintf(uidstr, "%d", uid);
     sprintf(gidstr, "%d", gid);
 
-    res =
-        PQexecParams(conn, SQL_delete_game, 2, NULL, params, NULL, paramFormats,
-                     0);
+    res = exec_stmt(STMT_DELETE_GAME, params);
     if (PQresultStatus(res) != PGRES_COMMAND_OK)
         log_msg("db_delete_game error: %s", PQerrorMessage(conn));
 
@@ -516,15 +738,14 @@ db_delete_game(int uid, int gid)
 }
 
 
-struct gamefile_info *
-db_list_games(int completed, int uid, int limit, int *count)
+static struct gamefile_info *
+pgsql_list_games(int completed, int uid, int limit, int *count)
 {
     PGresult *res;
     int i, gidcol, fncol, ucol;
     struct gamefile_info *files;
     char uidstr[16], complstr[16], limitstr[16];
     const char *const params[] = { uidstr, complstr, limitstr };
-    const int paramFormats[] = { 0, 0, 0 };
 
     if (limit <= 0 || limit > 100)
         limit = 100;
@@ -533,9 +754,7 @@ db_list_games(int completed, int uid, int limit, int *count)
     sprintf(complstr, "%d", ! !completed);
     sprintf(limitstr, "%d", limit);
 
-    res =
-        PQexecParams(conn, SQL_list_games, 3, NULL, params, NULL, paramFormats,
-                     0);
+    res = exec_stmt(STMT_LIST_GAMES, params);
     if (PQresultStatus(res) != PGRES_TUPLES_OK) {
         log_msg("list_games error: %s", PQerrorMessage(conn));
         PQclear(res);
@@ -560,62 +779,46 @@ db_list_games(int completed, int uid, int limit, int *count)
 }
 
 
-void
-db_set_option(int uid, const char *optname, int type, const char *optval)
+static void
+pgsql_set_option(int uid, const char *optname, int type, const char *optval)
 {
-    PGresult *res;
     char uidstr[16], typestr[16];
     const char *const params[] = { optval, uidstr, optname, typestr };
-    const int paramFormats[] = { 0, 0, 0, 0 };
-    const char *numrows;
+    struct db_query q[] = {
+        {STMT_UPDATE_OPTION, params},   /* try to update first */
+        {STMT_INSERT_OPTION, params}    /* insert if the update did nothing */
+    };
+    int stored;
 
     sprintf(uidstr, "%d", uid);
     sprintf(typestr, "%d", type);
 
-    /* try to update first */
-    res =
-        PQexecParams(conn, SQL_update_option, 3, NULL, params, NULL,
-                     paramFormats, 0);
-    numrows = PQcmdTuples(res);
-    if (PQresultStatus(res) == PGRES_COMMAND_OK && atoi(numrows) == 1) {
-        PQclear(res);
-        return;
-    }
-    PQclear(res);
-
-    /* update failed, try to insert */
-    res =
-        PQexecParams(conn, SQL_insert_option, 4, NULL, params, NULL,
-                     paramFormats, 0);
-    numrows = PQcmdTuples(res);
-    if (PQresultStatus(res) == PGRES_COMMAND_OK && atoi(numrows) == 1) {
-        PQclear(res);
-        return;
-    }
-    PQclear(res);
+    exec_batch(q, 2);
+    stored = PQresultStatus(q[0].res) == PGRES_COMMAND_OK &&
+        PQresultStatus(q[1].res) == PGRES_COMMAND_OK &&
+        atoi(PQcmdTuples(q[0].res)) + atoi(PQcmdTuples(q[1].res)) == 1;
+    PQclear(q[0].res);
+    PQclear(q[1].res);
 
-    /* insert failed too */
-    log_msg("Failed to store an option. '%s = %s': %s", optname, optval,
-            PQerrorMessage(conn));
+    if (!stored)
+        log_msg("Failed to store an option. '%s = %s': %s", optname, optval,
+                PQerrorMessage(conn));
 }
 
 
-void
-db_restore_options(int uid)
+static void
+pgsql_restore_options(int uid)
 {
     PGresult *res;
     char uidstr[16];
     const char *const params[] = { uidstr };
     const char *optname;
-    const int paramFormats[] = { 0 };
     int i, count, ncol, vcol;
     union nh_optvalue value;
 
     sprintf(uidstr, "%d", uid);
 
-    res =
-        PQexecParams(conn, SQL_get_options, 1, NULL, params, NULL, paramFormats,
-                     0);
+    res = exec_stmt(STMT_GET_OPTIONS, params);
     if (PQresultStatus(res) != PGRES_TUPLES_OK) {
         log_msg("get_options error: %s", PQerrorMessage(conn));
         PQclear(res);
@@ -634,17 +837,21 @@ db_restore_options(int uid)
 }
 
 
-void
-db_add_topten_entry(int gid, int points, int hp, int maxhp, int deaths,
+static void
+pgsql_add_topten_entry(int gid, int points, int hp, int maxhp, int deaths,
                     int end_how, const char *death, const char *entrytxt)
 {
-    PGresult *res;
     char gidstr[16], pointstr[16], hpstr[16], maxhpstr[16], dcountstr[16],
         endstr[16];
     const char *const params[] = { gidstr, pointstr, hpstr, maxhpstr,
         dcountstr, endstr, death, entrytxt
     };
-    const int paramFormats[] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+    /* note: the params array is re-used, but set_game_done only uses the 1.
+       entry */
+    struct db_query q[] = {
+        {STMT_ADD_TOPTEN_ENTRY, params},
+        {STMT_SET_GAME_DONE, params}
+    };
 
     sprintf(gidstr, "%d", gid);
     sprintf(pointstr, "%d", points);
@@ -653,22 +860,36 @@ db_add_topten_entry(int gid, int points, int hp, int maxhp, int deaths,
     sprintf(dcountstr, "%d", deaths);
     sprintf(endstr, "%d", end_how);
 
-    res =
-        PQexecParams(conn, SQL_add_topten_entry, 8, NULL, params, NULL,
-                     paramFormats, 0);
-    if (PQresultStatus(res) != PGRES_COMMAND_OK)
+    exec_batch(q, 2);
+    if (PQresultStatus(q[0].res) != PGRES_COMMAND_OK)
         log_msg("add_topten_entry error: %s", PQerrorMessage(conn));
-    PQclear(res);
-
-    /* note: the params and paramFormats arrays are re-used, but only the 1.
-       entry matters */
-    res =
-        PQexecParams(conn, SQL_set_game_done, 1, NULL, params, NULL,
-                     paramFormats, 0);
-    if (PQresultStatus(res) != PGRES_COMMAND_OK)
+    else if (PQresultStatus(q[1].res) != PGRES_COMMAND_OK)
         log_msg("set_game_done error: %s", PQerrorMessage(conn));
-    PQclear(res);
-    return;
+    PQclear(q[0].res);
+    PQclear(q[1].res);
 }
 
+
+const struct db_backend pgsql_backend = {
+    "pgsql",
+    pgsql_init_database,
+    pgsql_check_database,
+    pgsql_close_database,
+    pgsql_auth_user,
+    pgsql_register_user,
+    pgsql_get_user_info,
+    pgsql_update_user_ts,
+    pgsql_set_user_email,
+    pgsql_set_user_password,
+    pgsql_add_new_game,
+    pgsql_update_game,
+    pgsql_get_game_filename,
+    pgsql_delete_game,
+    pgsql_list_games,
+    pgsql_set_option,
+    pgsql_restore_options,
+    pgsql_add_topten_entry,
+    pgsql_get_stmt_stats
+};
+
 /* db_pgsql.c */
@@ -0,0 +1,668 @@
+/* vim:set cin ft=c sw=4 sts=4 ts=8 et ai cino=Ls\:0t0(0 : -*- mode:c;fill-column:80;tab-width:8;c-basic-offset:4;indent-tabs-mode:nil;c-file-style:"k&r" -*-*/
+/* The NetHack server may be freely redistributed under the terms of either:
+ *  - the NetHack license
+ *  - the GNU General Public license v2 or later
+ */
+
+/*
+ * Embedded storage backend: the database is a SQLite file in the server's
+ * work directory, accessed in-process by the master and the game processes.
+ * WAL mode lets the game processes read while another one writes.
+ */
+
+#include "nhserver.h"
+
+#include <stdarg.h>
+#include <time.h>
+#include <crypt.h>
+#include <sqlite3.h>
+
+#define DEFAULT_DB_FILE "nethack4.db"
+
+/* how long to wait for another process to finish writing, in ms */
+#define BUSY_TIMEOUT 5000
+
+/* SQL statements used */
+static const char SQL_init_tables[] =
+    "CREATE TABLE IF NOT EXISTS users(" "uid INTEGER PRIMARY KEY, "
+    "name TEXT UNIQUE NOT NULL, " "pwhash TEXT NOT NULL, "
+    "email TEXT NOT NULL DEFAULT '', "
+    "can_debug INTEGER NOT NULL DEFAULT 0, " "ts TEXT NOT NULL, "
+    "reg_ts TEXT NOT NULL" ");"
+    "CREATE TABLE IF NOT EXISTS games(" "gid INTEGER PRIMARY KEY, "
+    "filename TEXT NOT NULL, " "plname TEXT NOT NULL, " "role TEXT NOT NULL, "
+    "race TEXT NOT NULL, " "gender TEXT NOT NULL, "
+    "alignment TEXT NOT NULL, " "mode INTEGER NOT NULL, "
+    "moves INTEGER NOT NULL, " "depth INTEGER NOT NULL, "
+    "level_desc TEXT NOT NULL, " "done INTEGER NOT NULL DEFAULT 0, "
+    "owner INTEGER NOT NULL REFERENCES users (uid), " "ts TEXT NOT NULL, "
+    "start_ts TEXT NOT NULL" ");"
+    "CREATE TABLE IF NOT EXISTS topten("
+    "gid INTEGER PRIMARY KEY REFERENCES games (gid), "
+    "points INTEGER NOT NULL, " "hp INTEGER NOT NULL, "
+    "maxhp INTEGER NOT NULL, " "deaths INTEGER NOT NULL, "
+    "end_how INTEGER NOT NULL, " "death TEXT NOT NULL, "
+    "entrytxt TEXT NOT NULL" ");"
+    "CREATE TABLE IF NOT EXISTS options("
+    "uid INTEGER NOT NULL REFERENCES users (uid), " "optname TEXT NOT NULL, "
+    "opttype INTEGER NOT NULL, " "optvalue TEXT NOT NULL, "
+    "PRIMARY KEY(uid, optname)" ");";
+
+static const char SQL_begin[] = "BEGIN IMMEDIATE;";
+
+static const char SQL_commit[] = "COMMIT;";
+
+static const char SQL_rollback[] = "ROLLBACK;";
+
+static const char SQL_register_user[] =
+    "INSERT INTO users (name, pwhash, email, ts, reg_ts) "
+    "VALUES (?1, ?2, ?3, datetime('now'), datetime('now'));";
+
+static const char SQL_auth_user[] =
+    "SELECT uid, pwhash " "FROM   users " "WHERE  name = ?1;";
+
+static const char SQL_get_user_info[] =
+    "SELECT name, can_debug " "FROM   users " "WHERE  uid = ?1;";
+
+static const char SQL_update_user_ts[] =
+    "UPDATE users " "SET ts = datetime('now') " "WHERE uid = ?1;";
+
+static const char SQL_set_user_email[] =
+    "UPDATE users " "SET email = ?2 " "WHERE uid = ?1;";
+
+static const char SQL_set_user_password[] =
+    "UPDATE users " "SET pwhash = ?2 " "WHERE uid = ?1;";
+
+static const char SQL_add_game[] =
+    "INSERT INTO games (filename, role, race, gender, alignment, mode, moves, "
+    "depth, owner, plname, level_desc, ts, start_ts) "
+    "VALUES (?1, ?2, ?3, ?4, ?5, ?6, 1, 1, ?7, ?8, ?9, "
+    "datetime('now'), datetime('now'));";
+
+static const char SQL_delete_game[] =
+    "DELETE FROM games WHERE owner = ?1 AND gid = ?2;";
+
+static const char SQL_update_game[] =
+    "UPDATE games "
+    "SET ts = datetime('now'), moves = ?2, depth = ?3, level_desc = ?4 "
+    "WHERE gid = ?1;";
+
+static const char SQL_get_game_filename[] =
+    "SELECT filename " "FROM games " "WHERE (owner = ?1 OR ?1 = 0) AND gid = ?2;";
+
+static const char SQL_set_game_done[] =
+    "UPDATE games " "SET done = 1 " "WHERE gid = ?1;";
+
+static const char SQL_list_games[] =
+    "SELECT g.gid, g.filename, u.name "
+    "FROM games AS g JOIN users AS u ON g.owner = u.uid "
+    "WHERE (u.uid = ?1 OR ?1 = 0) AND g.done = ?2 "
+    "ORDER BY g.ts DESC " "LIMIT ?3;";
+
+static const char SQL_set_option[] =
+    "INSERT OR REPLACE INTO options (optvalue, uid, optname, opttype) "
+    "VALUES (?1, ?2, ?3, ?4);";
+
+static const char SQL_get_options[] =
+    "SELECT optname, optvalue " "FROM options " "WHERE uid = ?1;";
+
+static const char SQL_add_topten_entry[] =
+    "INSERT INTO topten (gid, points, hp, maxhp, deaths, end_how, death, entrytxt) "
+    "VALUES (?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8);";
+
+
+/* The order of entries in statements[] must match enum db_stmt_id. */
+enum db_stmt_id {
+    STMT_BEGIN,
+    STMT_COMMIT,
+    STMT_ROLLBACK,
+    STMT_AUTH_USER,
+    STMT_REGISTER_USER,
+    STMT_GET_USER_INFO,
+    STMT_UPDATE_USER_TS,
+    STMT_SET_USER_EMAIL,
+    STMT_SET_USER_PASSWORD,
+    STMT_ADD_GAME,
+    STMT_DELETE_GAME,
+    STMT_UPDATE_GAME,
+    STMT_GET_GAME_FILENAME,
+    STMT_SET_GAME_DONE,
+    STMT_LIST_GAMES,
+    STMT_SET_OPTION,
+    STMT_GET_OPTIONS,
+    STMT_ADD_TOPTEN_ENTRY,
+    STMT_COUNT
+};
+
+struct db_statement {
+    const char *name;
+    const char *sql;
+    sqlite3_stmt *stmt;
+};
+
+static struct db_statement statements[STMT_COUNT] = {
+    {"begin", SQL_begin},
+    {"commit", SQL_commit},
+    {"rollback", SQL_rollback},
+    {"auth_user", SQL_auth_user},
+    {"register_user", SQL_register_user},
+    {"get_user_info", SQL_get_user_info},
+    {"update_user_ts", SQL_update_user_ts},
+    {"set_user_email", SQL_set_user_email},
+    {"set_user_password", SQL_set_user_password},
+    {"add_game", SQL_add_game},
+    {"delete_game", SQL_delete_game},
+    {"update_game", SQL_update_game},
+    {"get_game_filename", SQL_get_game_filename},
+    {"set_game_done", SQL_set_game_done},
+    {"list_games", SQL_list_games},
+    {"set_option", SQL_set_option},
+    {"get_options", SQL_get_options},
+    {"add_topten_entry", SQL_add_topten_entry},
+};
+
+static struct db_stmt_stats stmt_stats[STMT_COUNT];
+
+static sqlite3 *db;
+static pid_t db_pid;    /* the process that opened db */
+
+static void sqlite_close_database(void);
+
+
+/*
+ * Hash a password with crypt() using SHA-512 and a random salt.
+ * Returns a pointer to crypt's static buffer or NULL.
+ */
+static const char *
+hash_password(const char *pass)
+{
+    static const char saltchars[] =
+        "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789./";
+    unsigned char rnd[16];
+    char salt[3 + sizeof (rnd) + 2];
+    int fd, i;
+
+    fd = open("/dev/urandom", O_RDONLY);
+    if (fd == -1 || read(fd, rnd, sizeof (rnd)) != sizeof (rnd)) {
+        log_msg("Failed to read /dev/urandom: %s", strerror(errno));
+        if (fd != -1)
+            close(fd);
+        return NULL;
+    }
+    close(fd);
+
+    strcpy(salt, "$6$");
+    for (i = 0; i < sizeof (rnd); i++)
+        salt[3 + i] = saltchars[rnd[i] % 64];
+    strcpy(&salt[3 + sizeof (rnd)], "$");
+
+    return crypt(pass, salt);
+}
+
+
+static void
+record_stmt_stats(enum db_stmt_id stmt, const struct timespec *start, int rc)
+{
+    struct db_stmt_stats *st = &stmt_stats[stmt];
+    struct timespec now;
+    double ms;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ms = (now.tv_sec - start->tv_sec) * 1000.0 +
+        (now.tv_nsec - start->tv_nsec) / 1000000.0;
+
+    st->calls++;
+    if (rc != SQLITE_ROW && rc != SQLITE_DONE)
+        st->errors++;
+    st->total_ms += ms;
+    if (ms > st->max_ms)
+        st->max_ms = ms;
+}
+
+
+/*
+ * Bind the parameters to a prepared statement and execute it up to the first
+ * result row. The characters of types describe the parameters: 'i' for int,
+ * 't' for a string.
+ */
+static int
+step_stmt(enum db_stmt_id id, const char *types, va_list args)
+{
+    sqlite3_stmt *stmt = statements[id].stmt;
+    struct timespec start;
+    int i, rc;
+
+    if (!stmt)
+        return SQLITE_MISUSE;
+
+    for (i = 0; types[i]; i++) {
+        if (types[i] == 'i')
+            sqlite3_bind_int(stmt, i + 1, va_arg(args, int));
+        else
+            sqlite3_bind_text(stmt, i + 1, va_arg(args, const char *), -1,
+                              SQLITE_TRANSIENT);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    rc = sqlite3_step(stmt);
+    record_stmt_stats(id, &start, rc);
+
+    return rc;
+}
+
+
+static void
+finish_stmt(enum db_stmt_id id)
+{
+    if (!statements[id].stmt)
+        return;
+    sqlite3_reset(statements[id].stmt);
+    sqlite3_clear_bindings(statements[id].stmt);
+}
+
+
+/*
+ * Execute a query. Returns SQLITE_ROW, SQLITE_DONE or an error code. Further
+ * rows are fetched with sqlite3_step and the statement must be released with
+ * finish_stmt.
+ */
+static int
+exec_stmt(enum db_stmt_id id, const char *types, ...)
+{
+    va_list args;
+    int rc;
+
+    va_start(args, types);
+    rc = step_stmt(id, types, args);
+    va_end(args);
+
+    return rc;
+}
+
+
+/* Execute a statement that doesn't return rows. */
+static int
+exec_cmd(enum db_stmt_id id, const char *types, ...)
+{
+    va_list args;
+    int rc;
+
+    va_start(args, types);
+    rc = step_stmt(id, types, args);
+    va_end(args);
+    finish_stmt(id);
+
+    return rc == SQLITE_DONE;
+}
+
+
+static int
+prepare_statements(int report_errors)
+{
+    int i, ok = TRUE;
+
+    for (i = 0; i < STMT_COUNT; i++) {
+        if (statements[i].stmt)
+            continue;
+
+        if (sqlite3_prepare_v2(db, statements[i].sql, -1, &statements[i].stmt,
+                               NULL) != SQLITE_OK) {
+            if (report_errors)
+                fprintf(stderr, "prepare statement %s failed: %s\n",
+                        statements[i].name, sqlite3_errmsg(db));
+            statements[i].stmt = NULL;
+            ok = FALSE;
+        }
+    }
+
+    return ok;
+}
+
+
+/*
+ * init the database connection.
+ */
+static int
+sqlite_init_database(void)
+{
+    char *filename;
+    int i;
+
+    if (db)
+        sqlite_close_database();
+
+    if (settings.dbname && settings.dbname[0] == '/')
+        filename = strdup(settings.dbname);
+    else {
+        const char *name = settings.dbname ? settings.dbname : DEFAULT_DB_FILE;
+
+        filename = malloc(strlen(settings.workdir) + strlen(name) + 2);
+        sprintf(filename, "%s/%s", settings.workdir, name);
+    }
+
+    if (sqlite3_open_v2(filename, &db,
+                        SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE,
+                        NULL) != SQLITE_OK) {
+        fprintf(stderr, "Failed to open the database %s: %s\n", filename,
+                db ? sqlite3_errmsg(db) : "out of memory");
+        free(filename);
+        goto err;
+    }
+    free(filename);
+    db_pid = getpid();
+
+    sqlite3_busy_timeout(db, BUSY_TIMEOUT);
+    if (sqlite3_exec(db, "PRAGMA journal_mode = WAL;"
+                     "PRAGMA synchronous = NORMAL;"
+                     "PRAGMA foreign_keys = ON;", NULL, NULL,
+                     NULL) != SQLITE_OK) {
+        fprintf(stderr, "Failed to set up the database: %s\n",
+                sqlite3_errmsg(db));
+        goto err;
+    }
+
+    for (i = 0; i < STMT_COUNT; i++) {
+        statements[i].stmt = NULL;
+        memset(&stmt_stats[i], 0, sizeof (struct db_stmt_stats));
+        stmt_stats[i].name = statements[i].name;
+    }
+    /* On a new database the tables don't exist yet; check_database will
+       create them and prepare the statements again. */
+    prepare_statements(FALSE);
+
+    return TRUE;
+
+err:
+    sqlite3_close(db);
+    db = NULL;
+    return FALSE;
+}
+
+
+/*
+ * create the database tables if necessary.
+ */
+static int
+sqlite_check_database(void)
+{
+    char *errmsg = NULL;
+
+    if (sqlite3_exec(db, SQL_init_tables, NULL, NULL, &errmsg) != SQLITE_OK) {
+        fprintf(stderr, "Failed to create the database tables: %s\n", errmsg);
+        sqlite3_free(errmsg);
+        goto err;
+    }
+
+    if (!prepare_statements(TRUE))
+        goto err;
+
+    return TRUE;
+
+err:
+    sqlite_close_database();
+    return FALSE;
+}
+
+
+static void
+sqlite_close_database(void)
+{
+    int i;
+
+    /* The master closes its connection before it forks (see srvmain.c), so
+       no process should inherit one. Should it happen anyway, closing the
+       connection would disturb the process that opened it. */
+    if (db && db_pid == getpid()) {
+        for (i = 0; i < STMT_COUNT; i++)
+            sqlite3_finalize(statements[i].stmt);
+        sqlite3_close(db);
+    }
+
+    for (i = 0; i < STMT_COUNT; i++)
+        statements[i].stmt = NULL;
+    db = NULL;
+}
+
+
+static int
+sqlite_auth_user(const char *name, const char *pass)
+{
+    sqlite3_stmt *stmt = statements[STMT_AUTH_USER].stmt;
+    const char *pwhash, *hash;
+    int uid, auth_ok;
+
+    if (exec_stmt(STMT_AUTH_USER, "t", name) != SQLITE_ROW) {
+        finish_stmt(STMT_AUTH_USER);
+        return 0;
+    }
+
+    uid = sqlite3_column_int(stmt, 0);
+    pwhash = (const char *)sqlite3_column_text(stmt, 1);
+    hash = crypt(pass, pwhash);
+    auth_ok = hash && !strcmp(hash, pwhash);
+    finish_stmt(STMT_AUTH_USER);
+
+    return auth_ok ? uid : -uid;
+}
+
+
+static int
+sqlite_register_user(const char *name, const char *pass, const char *email)
+{
+    const char *pwhash = hash_password(pass);
+
+    if (!pwhash ||
+        !exec_cmd(STMT_REGISTER_USER, "ttt", name, pwhash, email)) {
+        log_msg("db_register_user failed: %s", sqlite3_errmsg(db));
+        return 0;
+    }
+
+    return sqlite3_last_insert_rowid(db);
+}
+
+
+static int
+sqlite_get_user_info(int uid, struct user_info *info)
+{
+    sqlite3_stmt *stmt = statements[STMT_GET_USER_INFO].stmt;
+
+    if (exec_stmt(STMT_GET_USER_INFO, "i", uid) != SQLITE_ROW) {
+        log_msg("db_get_user_info error: %s", sqlite3_errmsg(db));
+        finish_stmt(STMT_GET_USER_INFO);
+        return FALSE;
+    }
+
+    info->username = strdup((const char *)sqlite3_column_text(stmt, 0));
+    info->can_debug = sqlite3_column_int(stmt, 1);
+    info->uid = uid;
+
+    finish_stmt(STMT_GET_USER_INFO);
+    return TRUE;
+}
+
+
+static void
+sqlite_update_user_ts(int uid)
+{
+    if (!exec_cmd(STMT_UPDATE_USER_TS, "i", uid))
+        log_msg("update_user_ts error: %s", sqlite3_errmsg(db));
+}
+
+
+static int
+sqlite_set_user_email(int uid, const char *email)
+{
+    return exec_cmd(STMT_SET_USER_EMAIL, "it", uid, email) &&
+        sqlite3_changes(db) == 1;
+}
+
+
+static int
+sqlite_set_user_password(int uid, const char *password)
+{
+    const char *pwhash = hash_password(password);
+
+    return pwhash && exec_cmd(STMT_SET_USER_PASSWORD, "it", uid, pwhash) &&
+        sqlite3_changes(db) == 1;
+}
+
+
+static long
+sqlite_add_new_game(int uid, const char *filename, const char *role,
+                    const char *race, const char *gend, const char *align,
+                    int mode, const char *plname, const char *levdesc)
+{
+    if (!exec_cmd(STMT_ADD_GAME, "tttttiitt", filename, role, race, gend,
+                  align, mode, uid, plname, levdesc)) {
+        log_msg("db_add_new_game error while adding (%s - %s): %s", plname,
+                filename, sqlite3_errmsg(db));
+        return 0;
+    }
+
+    return sqlite3_last_insert_rowid(db);
+}
+
+
+static void
+sqlite_update_game(int game, int moves, int depth, const char *levdesc)
+{
+    if (!exec_cmd(STMT_UPDATE_GAME, "iiit", game, moves, depth, levdesc))
+        log_msg("update_game_ts error: %s", sqlite3_errmsg(db));
+}
+
+
+static int
+sqlite_get_game_filename(int uid, int gid, char *namebuf, int buflen)
+{
+    sqlite3_stmt *stmt = statements[STMT_GET_GAME_FILENAME].stmt;
+
+    if (exec_stmt(STMT_GET_GAME_FILENAME, "ii", uid, gid) != SQLITE_ROW) {
+        log_msg("get_game_filename error: %s", sqlite3_errmsg(db));
+        finish_stmt(STMT_GET_GAME_FILENAME);
+        return FALSE;
+    }
+
+    strncpy(namebuf, (const char *)sqlite3_column_text(stmt, 0), buflen);
+    finish_stmt(STMT_GET_GAME_FILENAME);
+    return TRUE;
+}
+
+
+static void
+sqlite_delete_game(int uid, int gid)
+{
+    if (!exec_cmd(STMT_DELETE_GAME, "ii", uid, gid))
+        log_msg("db_delete_game error: %s", sqlite3_errmsg(db));
+}
+
+
+static struct gamefile_info *
+sqlite_list_games(int completed, int uid, int limit, int *count)
+{
+    sqlite3_stmt *stmt = statements[STMT_LIST_GAMES].stmt;
+    struct gamefile_info *files;
+    int rc;
+
+    if (limit <= 0 || limit > 100)
+        limit = 100;
+
+    *count = 0;
+    files = malloc(sizeof (struct gamefile_info) * limit);
+    for (rc = exec_stmt(STMT_LIST_GAMES, "iii", uid, ! !completed, limit);
+         rc == SQLITE_ROW; rc = sqlite3_step(stmt)) {
+        files[*count].gid = sqlite3_column_int(stmt, 0);
+        files[*count].filename =
+            strdup((const char *)sqlite3_column_text(stmt, 1));
+        files[*count].username =
+            strdup((const char *)sqlite3_column_text(stmt, 2));
+        (*count)++;
+    }
+    if (rc != SQLITE_DONE)
+        log_msg("list_games error: %s", sqlite3_errmsg(db));
+    finish_stmt(STMT_LIST_GAMES);
+
+    return files;
+}
+
+
+static void
+sqlite_set_option(int uid, const char *optname, int type, const char *optval)
+{
+    if (!exec_cmd(STMT_SET_OPTION, "titi", optval, uid, optname, type))
+        log_msg("Failed to store an option. '%s = %s': %s", optname, optval,
+                sqlite3_errmsg(db));
+}
+
+
+static void
+sqlite_restore_options(int uid)
+{
+    sqlite3_stmt *stmt = statements[STMT_GET_OPTIONS].stmt;
+    union nh_optvalue value;
+    int rc;
+
+    for (rc = exec_stmt(STMT_GET_OPTIONS, "i", uid); rc == SQLITE_ROW;
+         rc = sqlite3_step(stmt)) {
+        value.s = (char *)sqlite3_column_text(stmt, 1);
+        nh_set_option((const char *)sqlite3_column_text(stmt, 0), value, 1);
+    }
+    if (rc != SQLITE_DONE)
+        log_msg("get_options error: %s", sqlite3_errmsg(db));
+    finish_stmt(STMT_GET_OPTIONS);
+}
+
+
+/* Both statements are run in one transaction, so that they only need one
+ * write to the disk. */
+static void
+sqlite_add_topten_entry(int gid, int points, int hp, int maxhp, int deaths,
+                        int end_how, const char *death, const char *entrytxt)
+{
+    if (!exec_cmd(STMT_BEGIN, "")) {
+        log_msg("add_topten_entry error: %s", sqlite3_errmsg(db));
+        return;
+    }
+
+    if (!exec_cmd(STMT_ADD_TOPTEN_ENTRY, "iiiiiitt", gid, points, hp, maxhp,
+                  deaths, end_how, death, entrytxt))
+        log_msg("add_topten_entry error: %s", sqlite3_errmsg(db));
+    else if (!exec_cmd(STMT_SET_GAME_DONE, "i", gid))
+        log_msg("set_game_done error: %s", sqlite3_errmsg(db));
+    else if (exec_cmd(STMT_COMMIT, ""))
+        return;
+
+    exec_cmd(STMT_ROLLBACK, "");
+}
+
+
+static const struct db_stmt_stats *
+sqlite_get_stmt_stats(int *count)
+{
+    *count = STMT_COUNT;
+    return stmt_stats;
+}
+
+
+const struct db_backend sqlite_backend = {
+    "sqlite",
+    sqlite_init_database,
+    sqlite_check_database,
+    sqlite_close_database,
+    sqlite_auth_user,
+    sqlite_register_user,
+    sqlite_get_user_info,
+    sqlite_update_user_ts,
+    sqlite_set_user_email,
+    sqlite_set_user_password,
+    sqlite_add_new_game,
+    sqlite_update_game,
+    sqlite_get_game_filename,
+    sqlite_delete_game,
+    sqlite_list_games,
+    sqlite_set_option,
+    sqlite_restore_options,
+    sqlite_add_topten_entry,
+    sqlite_get_stmt_stats
+};
+
+/* db_sqlite.c */
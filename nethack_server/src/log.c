@@ -12,14 +12,108 @@
 #include <arpa/inet.h>
 #include <sys/time.h>
 
-static FILE *logfile;
+/*
+ * Log messages are collected in a per-process buffer and written with a single
+ * write() once the buffer fills up or its oldest message is LOG_FLUSH_DELAY ms
+ * old. Every process of the server appends to the same file (opened with
+ * O_APPEND), so each write lands in one piece. Processes that block for input
+ * call flush_log first, and the master's event loop uses log_flush_timer to
+ * wake up when a flush is due.
+ */
+#define LOG_BUFFER_SIZE (64 * 1024)
+#define LOG_LINE_MAX 640        /* a formatted message always fits into this */
+#define LOG_FLUSH_DELAY 1000    /* ms */
+
+static int logfd = -1;
 static int startup_pid;
 
+static char logbuf[LOG_BUFFER_SIZE];
+static int loglen;
+static int logbuf_pid;  /* the process that owns the buffer contents */
+static unsigned long long logbuf_since; /* time of the oldest message, ms */
+
+/* timestamps are only formatted once per second */
+static time_t cached_sec = -1;
+static char cached_timestamp[32];
+
+
+static unsigned long long
+monotonic_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+/* The buffer is inherited by forked child processes. Its contents belong to
+ * the parent, which will write them itself. */
+static void
+claim_logbuf(void)
+{
+    int pid = getpid();
+
+    if (logbuf_pid != pid) {
+        loglen = 0;
+        logbuf_pid = pid;
+    }
+}
+
+
+/* Write out the buffer now. This only uses write(), so it can be called from
+ * a signal handler as well. */
+void
+flush_log(void)
+{
+    int ret, pos = 0;
+
+    if (logfd == -1 || !loglen || logbuf_pid != getpid())
+        return;
+
+    while (pos < loglen) {
+        ret = write(logfd, &logbuf[pos], loglen - pos);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            break;      /* there is nowhere to report this */
+        pos += ret;
+    }
+    loglen = 0;
+}
+
+
+/* Flush the buffer if it is due. Returns the time in ms until the next flush
+ * is due, or -1 if there is nothing to flush. */
+int
+log_flush_timer(void)
+{
+    unsigned long long age;
+
+    claim_logbuf();
+    if (!loglen)
+        return -1;
+
+    age = monotonic_ms() - logbuf_since;
+    if (age < LOG_FLUSH_DELAY)
+        return LOG_FLUSH_DELAY - age;
+
+    flush_log();
+    return -1;
+}
+
+
+static void
+exit_flush_log(void)
+{
+    flush_log();
+}
+
 
 void
 log_msg(const char *fmt, ...)
 {
-    char msgbuf[512], timestamp[32], *last;
+    char msgbuf[512], *last;
     struct tm *tm_local;
     struct timeval tv;
     va_list args;
@@ -36,31 +130,45 @@ log_msg(const char *fmt, ...)
 
     /* make a timestamp like "2011-11-30 18:45:59" */
     gettimeofday(&tv, NULL);
-    tm_local = localtime(&tv.tv_sec);
-    if (!tm_local ||
-        !strftime(timestamp, sizeof (timestamp), "%Y-%m-%d %H:%M:%S", tm_local))
-        strcpy(timestamp, "???");
-    fprintf(logfile, "%s.%06ld [%d] %s\n", timestamp, tv.tv_usec, getpid(),
-            msgbuf);
-    fflush(logfile);
+    if (tv.tv_sec != cached_sec) {
+        tm_local = localtime(&tv.tv_sec);
+        if (!tm_local ||
+            !strftime(cached_timestamp, sizeof (cached_timestamp),
+                      "%Y-%m-%d %H:%M:%S", tm_local))
+            strcpy(cached_timestamp, "???");
+        cached_sec = tv.tv_sec;
+    }
+
+    claim_logbuf();
+    if (loglen + LOG_LINE_MAX > LOG_BUFFER_SIZE)
+        flush_log();
+    if (!loglen)
+        logbuf_since = monotonic_ms();
+    loglen += snprintf(&logbuf[loglen], LOG_LINE_MAX, "%s.%06ld [%d] %s\n",
+                       cached_timestamp, tv.tv_usec, logbuf_pid, msgbuf);
+
+    if (monotonic_ms() - logbuf_since >= LOG_FLUSH_DELAY)
+        flush_log();
 
     if (settings.nodaemon)
         /* stdout is still open, lets print some stuff */
-        fprintf(stdout, "%s.%06ld [%d] %s\n", timestamp, tv.tv_usec, getpid(),
-                msgbuf);
+        fprintf(stdout, "%s.%06ld [%d] %s\n", cached_timestamp, tv.tv_usec,
+                logbuf_pid, msgbuf);
 }
 
 
 int
 begin_logging(void)
 {
-    logfile = fopen(settings.logfile, "a");
-    if (!logfile) {
+    logfd = open(settings.logfile, O_WRONLY | O_APPEND | O_CREAT, 0666);
+    if (logfd == -1) {
         fprintf(stderr, "Error opening/creating %s: %s.\n", settings.logfile,
                 strerror(errno));
         return FALSE;
     }
 
+    /* also covers the exit() calls all over the place */
+    atexit(exit_flush_log);
     return TRUE;
 }
 
@@ -118,8 +226,18 @@ report_startup(void)
     log_msg("  unixsocket = %s", addr2str(&settings.bind_addr_unix));
     log_msg("  port = %d", settings.port);
     log_msg("  client_timeout = %d", settings.client_timeout);
+    log_msg("  client_buffer_kb = %d", settings.client_buffer_kb);
+    log_msg("  auth_workers = %d", settings.auth_workers);
+    log_msg("  shards = %d", settings.shards);
+    log_msg("  pass_sockets = %s", settings.pass_sockets ? "true" : "false");
+    log_msg("  coalesce_display = %s",
+            settings.coalesce_display ? "true" : "false");
+    log_msg("  compression = %s", settings.compression ? "true" : "false");
+    log_msg("  statsfile = %s",
+            settings.statsfile ? settings.statsfile : "(not set)");
 
     /* database settings */
+    log_msg("  dbbackend = %s", settings.dbbackend);
     log_msg("  dbhost = %s", settings.dbhost ? settings.dbhost : "(not set)");
     log_msg("  dbport = %s", settings.dbport ? settings.dbport : "(not set)");
     log_msg("  dbuser = %s", settings.dbuser ? settings.dbuser : "(not set)");
@@ -130,13 +248,34 @@ report_startup(void)
 }
 
 
+/* Log the latency counters of every database statement that was used by this
+ * process. */
+void
+log_db_stats(void)
+{
+    const struct db_stmt_stats *stats;
+    int i, count;
+
+    stats = db_get_stmt_stats(&count);
+    for (i = 0; i < count; i++) {
+        if (!stats[i].calls)
+            continue;
+        log_msg("db %s: %lu calls, %lu errors, avg %.3f ms, max %.3f ms",
+                stats[i].name, stats[i].calls, stats[i].errors,
+                stats[i].total_ms / stats[i].calls, stats[i].max_ms);
+    }
+}
+
+
 void
 end_logging(void)
 {
     if (startup_pid == getpid())
         log_msg("----- Server shutdown. -----");
-    fclose(logfile);
-    logfile = NULL;
+    flush_log();
+    if (logfd != -1)
+        close(logfd);
+    logfd = -1;
 }
 
 /* log.c */
@@ -61,6 +61,7 @@ signal_segv(int ignored)
 {
     sigsegv_flag++;
     log_msg("BUG: caught SIGSEGV! Exit.");
+    flush_log();        /* in case exit_client crashes as well */
     if (user_info.uid)
         exit_client
             ("Fatal: Programming error on the server. Sorry about that.");
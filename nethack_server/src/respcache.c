@@ -0,0 +1,236 @@
+/* vim:set cin ft=c sw=4 sts=4 ts=8 et ai cino=Ls\:0t0(0 : -*- mode:c;fill-column:80;tab-width:8;c-basic-offset:4;indent-tabs-mode:nil;c-file-style:"k&r" -*-*/
+/* The NetHack server may be freely redistributed under the terms of either:
+ *  - the NetHack license
+ *  - the GNU General Public license v2 or later
+ */
+
+/*
+ * Cache for the responses to get_drawing_info, get_roles and get_commands.
+ * These are large, identical for every game on a given build and requested by
+ * every new session. The master serializes them once at startup; the game
+ * processes inherit the strings through fork and send them as they are.
+ *
+ * Each response also gets a version (a hash of its text). A client that sends
+ * the version of its cached copy with the request only gets the version back
+ * if nothing has changed.
+ */
+
+#include "nhserver.h"
+
+#include <sys/wait.h>
+
+struct cached_response {
+    const char *cmd;
+    json_t *(*build) (int *count);
+    char *json; /* the serialized response; NULL if it isn't cached */
+    char version[17];
+    int count;  /* get_commands: the number of commands in the list */
+};
+
+static json_t *build_drawing_info(int *count);
+static json_t *build_roles(int *count);
+
+static struct cached_response responses[] = {
+    {"get_drawing_info", build_drawing_info},
+    {"get_roles", build_roles},
+    {"get_commands", commands_json},
+    {NULL}
+};
+
+
+static json_t *
+build_drawing_info(int *count)
+{
+    *count = 0;
+    return drawing_info_json();
+}
+
+
+static json_t *
+build_roles(int *count)
+{
+    *count = 0;
+    return roles_json();
+}
+
+
+/* 64-bit FNV-1a */
+static void
+hash_response(const char *str, char *version)
+{
+    unsigned long long hash = 0xcbf29ce484222325ULL;
+
+    for (; *str; str++) {
+        hash ^= (unsigned char)*str;
+        hash *= 0x100000001b3ULL;
+    }
+    snprintf(version, 17, "%016llx", hash);
+}
+
+
+static int
+read_all(int fd, void *buf, int len)
+{
+    int ret, pos = 0;
+
+    while (pos < len) {
+        ret = read(fd, (char *)buf + pos, len - pos);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return FALSE;
+        pos += ret;
+    }
+    return TRUE;
+}
+
+
+static int
+write_all(int fd, const void *buf, int len)
+{
+    int ret, pos = 0;
+
+    while (pos < len) {
+        ret = write(fd, (const char *)buf + pos, len - pos);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return FALSE;
+        pos += ret;
+    }
+    return TRUE;
+}
+
+
+/* Runs in a child process, so that the master doesn't need to initialize
+ * libnethack itself. */
+static void
+generate_responses(int fd)
+{
+    char **gamepaths;
+    char *str;
+    json_t *jobj;
+    int i, hdr[2];
+
+    gamepaths = init_game_paths();
+    nh_lib_init(&server_windowprocs, gamepaths);
+    for (i = 0; i < PREFIX_COUNT; i++)
+        free(gamepaths[i]);
+    free(gamepaths);
+
+    for (i = 0; responses[i].cmd; i++) {
+        jobj = responses[i].build(&hdr[1]);
+        str = json_dumps(jobj, JSON_COMPACT);
+        json_decref(jobj);
+
+        hdr[0] = strlen(str);
+        if (!write_all(fd, hdr, sizeof (hdr)) || !write_all(fd, str, hdr[0]))
+            break;
+        free(str);
+    }
+
+    nh_lib_exit();
+}
+
+
+/*
+ * Build the cached responses. This must happen before any game process is
+ * forked. If it fails, the responses are simply built on every request.
+ */
+void
+init_response_cache(void)
+{
+    int fds[2], hdr[2], i, status;
+    pid_t pid;
+
+    if (pipe2(fds, O_CLOEXEC) == -1) {
+        log_msg("Failed to create a pipe for the response cache: %s",
+                strerror(errno));
+        return;
+    }
+
+    pid = fork();
+    if (pid == 0) {     /* child */
+        close(fds[0]);
+        generate_responses(fds[1]);
+        close(fds[1]);
+        exit(0);
+    }
+
+    close(fds[1]);
+    if (pid == -1) {
+        log_msg("Failed to fork for the response cache: %s", strerror(errno));
+        close(fds[0]);
+        return;
+    }
+
+    for (i = 0; responses[i].cmd; i++) {
+        if (!read_all(fds[0], hdr, sizeof (hdr)) || hdr[0] <= 2)
+            break;
+        responses[i].json = malloc(hdr[0] + 1);
+        if (!read_all(fds[0], responses[i].json, hdr[0])) {
+            free(responses[i].json);
+            responses[i].json = NULL;
+            break;
+        }
+        responses[i].json[hdr[0]] = '\0';
+        responses[i].count = hdr[1];
+        hash_response(responses[i].json, responses[i].version);
+        log_msg("Cached the %s response: %d bytes, version %s",
+                responses[i].cmd, hdr[0], responses[i].version);
+    }
+    close(fds[0]);
+
+    while (waitpid(pid, &status, 0) == -1 && errno == EINTR)
+        ;
+}
+
+
+void
+free_response_cache(void)
+{
+    int i;
+
+    for (i = 0; responses[i].cmd; i++) {
+        free(responses[i].json);
+        responses[i].json = NULL;
+    }
+}
+
+
+/*
+ * Send the cached response for cmd, if there is one. version is the version
+ * the client has, or NULL if it didn't send one; in that case the response is
+ * sent in its original form. For get_commands, count must match the number of
+ * commands of the current game, otherwise it is -1.
+ * Returns FALSE if the caller needs to build the response itself.
+ */
+int
+send_cached_response(const char *cmd, const char *version, int count)
+{
+    struct cached_response *cr;
+    char *msg;
+
+    for (cr = responses; cr->cmd; cr++)
+        if (!strcmp(cr->cmd, cmd))
+            break;
+    if (!cr->cmd || !cr->json || (count != -1 && count != cr->count))
+        return FALSE;
+
+    if (!version) {
+        client_msg_raw(cmd, cr->json);
+        return TRUE;
+    }
+
+    msg = malloc(strlen(cr->json) + 32);
+    if (!strcmp(version, cr->version))
+        sprintf(msg, "{\"version\":\"%s\"}", cr->version);
+    else        /* insert the version into the cached object */
+        sprintf(msg, "{\"version\":\"%s\",%s", cr->version, cr->json + 1);
+    client_msg_raw(cmd, msg);
+    free(msg);
+
+    return TRUE;
+}
+
+/* respcache.c */
@@ -45,6 +45,18 @@
  * inactivity, though).
  * When the connection is re-established, the client's requests get forwarded
  * again.
+ *
+ * With the pass_sockets option, the master steps out of the data path: once a
+ * client is authenticated, its socket is passed to the game process over a
+ * unix socket (SCM_RIGHTS) and the game talks to the client directly. The
+ * master keeps only that control socket and brokers reconnects by passing the
+ * new socket on to the running game.
+ *
+ * A single master process relays for every game on one core. With the shards
+ * option, the master instead supervises several shard processes. Each of them
+ * runs the event loop below on its own SO_REUSEPORT listeners, so the kernel
+ * spreads new connections across them. Reconnects that arrive at the wrong
+ * shard are routed to the right one through the registry in shard.c.
  */
 
 #include "nhserver.h"
@@ -55,6 +67,7 @@
 #include <netinet/tcp.h>
 #include <sys/epoll.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 
 #if defined(OPEN_MAX)
 static int
@@ -74,10 +87,8 @@ get_open_max(void)
  * 16 seems like a reasonable value for now... */
 #define MAX_EVENTS 16
 
-/* a username + password with some fluff should always fit in 500 bytes */
-#define AUTH_MAXLEN 500
-/* make the buffer slightly bigger to detect when the client sends too much data */
-#define AUTHBUFSIZE 512
+/* Output for a client is read from the game's pipe in chunks of this size. */
+#define OUT_BUFFER_CHUNK 16384
 
 enum comm_status {
     NEW_CONNECTION,
@@ -85,6 +96,16 @@ enum comm_status {
     CLIENT_CONNECTED
 };
 
+/* Output from a game that the client hasn't accepted yet. This is a ring
+ * buffer: it is reused for the whole connection and only grows (by doubling)
+ * when more data is waiting than fits. */
+struct out_buffer {
+    char *data;
+    int size;
+    int start;  /* offset of the first unsent byte */
+    int len;    /* number of unsent bytes */
+};
+
 /* Client communication data.
  * This structure tracks connected clients, ie remote users with open sockets
  * and also "disconnected clients", which refer to local games that continue to
@@ -101,8 +122,8 @@ struct client_data {
     int pipe_out;       /* master -> game pipe */
     int pipe_in;        /* game -> master pipe */
     int sock;   /* master <-> client socket */
-    int unsent_data_size;
-    char *unsent_data;
+    int control;        /* master -> game socket in pass_sockets mode */
+    struct out_buffer out;
 };
 
 
@@ -123,6 +144,27 @@ static struct client_data connected_list_head;
 static struct client_data **fd_to_client;
 static int client_count, fd_to_client_max;
 
+/* pid of the process that runs the event scripts for all games */
+static int event_dispatcher_pid;
+
+/* Auth worker processes. pending holds the sockets of the connections that
+ * were handed to the worker and are waiting for its answer. */
+struct auth_worker {
+    int pid;
+    int fd;     /* master <-> worker socket; -1 if the worker is gone */
+    int *pending;
+    int pending_count, pending_max;
+};
+
+static struct auth_worker *auth_workers;
+
+/* Logins that arrived while no auth worker could take them. They are passed
+ * on once a worker has answered or has been restarted; the master never
+ * authenticates anybody itself. */
+#define MAX_QUEUED_LOGINS 256
+static struct auth_request *queued_logins;
+static int queued_login_count;
+
 /*---------------------------------------------------------------------------*/
 
 
@@ -130,6 +172,9 @@ static void cleanup_game_process(struct client_data *client, int epfd);
 static int init_server_socket(struct sockaddr *sa);
 static int fork_client(struct client_data *client, int epfd);
 static void handle_new_connection(int newfd, int epfd);
+static void finish_new_connection(int newfd, int epfd, int userid, int is_reg,
+                                  int reconnect_id, int forwarded);
+static void rearm_game_output(struct client_data *client, int epfd);
 
 
 static void
@@ -162,7 +207,7 @@ alloc_client_data(struct client_data *list_start)
 
     memset(client, 0, sizeof (struct client_data));
     link_client_data(client, list_start);
-    client->sock = client->pipe_in = client->pipe_out = -1;
+    client->sock = client->pipe_in = client->pipe_out = client->control = -1;
 
     return client;
 }
@@ -200,6 +245,13 @@ init_server_socket(struct sockaddr *sa)
        irrelevant otherwise. */
     setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt_enable, sizeof (int));
 
+    /* every shard binds its own listening socket to the same address */
+    if (settings.shards > 1 && sa->sa_family != AF_UNIX &&
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt_enable,
+                   sizeof (int)) == -1)
+        log_msg("Failed to set the SO_REUSEPORT socket option: %s.",
+                strerror(errno));
+
     switch (sa->sa_family) {
     case AF_INET:
         len = sizeof (struct sockaddr_in);
@@ -278,10 +330,115 @@ post_fork_cleanup(void)
         free(ccur);
     }
 
+    if (auth_workers) {
+        for (i = 0; i < settings.auth_workers; i++)
+            free(auth_workers[i].pending);
+        free(auth_workers);
+    }
+    free(queued_logins);        /* the sockets were closed as CLOEXEC */
+
     free(fd_to_client);
 }
 
 
+/*
+ * pass_sockets mode: the game process will talk to its client directly.
+ * Instead of the pipes there is only a control socket over which the client
+ * sockets are passed. The master doesn't see the client's traffic, so as far as
+ * it is concerned the game is always waiting for a (re)connection.
+ */
+static int
+fork_client_direct(struct client_data *client, int epfd)
+{
+    int userid, sv[2];
+    struct epoll_event ev;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == -1) {
+        log_msg("Failed to create a control socket for new connection: %s",
+                strerror(errno));
+        cleanup_game_process(client, epfd);
+        return FALSE;
+    }
+
+    client->pid = fork();
+    if (client->pid == 0) {     /* child */
+        userid = client->userid;
+        fcntl(sv[1], F_SETFD, 0);       /* survive post_fork_cleanup */
+        post_fork_cleanup();
+        client_main(userid, -1, -1, sv[1]);
+        exit(0);        /* shouldn't get here... client is done. */
+    }
+
+    close(sv[1]);
+    if (client->pid == -1) {
+        close(sv[0]);
+        cleanup_game_process(client, epfd);
+        log_msg("Failed to fork a client process: %s", strerror(errno));
+        return FALSE;
+    }
+
+    client->control = sv[0];
+    fcntl(client->control, F_SETFL, O_NONBLOCK);
+    map_fd_to_client(client->control, client);
+
+    client->state = CLIENT_DISCONNECTED;
+    unlink_client_data(client);
+    link_client_data(client, &disconnected_list_head);
+    registry_add_game(client->pid, client->userid, client->connid, FALSE);
+
+    /* the game process never writes to the control socket; this only reports
+       its exit */
+    ev.data.ptr = NULL;
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+    ev.data.fd = client->control;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, client->control, &ev);
+
+    return TRUE;
+}
+
+
+/*
+ * Pass a client socket to the game process, which replaces its old socket with
+ * it. The master forgets about the socket once it has been sent.
+ */
+static int
+pass_client_socket(struct client_data *client, int sockfd, int epfd)
+{
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    char dummy = 0, cbuf[CMSG_SPACE(sizeof (int))];
+    int ret;
+
+    memset(&msg, 0, sizeof (msg));
+    memset(cbuf, 0, sizeof (cbuf));
+    iov.iov_base = &dummy;
+    iov.iov_len = 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof (cbuf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof (int));
+    memcpy(CMSG_DATA(cmsg), &sockfd, sizeof (int));
+
+    do {
+        ret = sendmsg(client->control, &msg, MSG_NOSIGNAL);
+    } while (ret == -1 && errno == EINTR);
+    if (ret != 1)
+        log_msg("Failed to pass the client socket to game process %d: %s",
+                client->pid, strerror(errno));
+
+    epoll_ctl(epfd, EPOLL_CTL_DEL, sockfd, NULL);
+    fd_to_client[sockfd] = NULL;
+    close(sockfd);
+
+    return ret == 1;
+}
+
+
 /*
  * A new game process is needed.
  * Create the communication pipes, register them with epoll and fork the new
@@ -295,6 +452,9 @@ fork_client(struct client_data *client, int epfd)
     int pipe_in_fd[2];
     struct epoll_event ev;
 
+    if (settings.pass_sockets)
+        return fork_client_direct(client, epfd);
+
     ret1 = pipe2(pipe_out_fd, O_NONBLOCK);
     ret2 = pipe2(pipe_in_fd, O_NONBLOCK);
     if (ret1 == -1 || ret2 == -1) {
@@ -324,13 +484,12 @@ fork_client(struct client_data *client, int epfd)
     client->pid = fork();
     if (client->pid > 0) {      /* parent */
     } else if (client->pid == 0) {      /* child */
-        struct user_info info;
-
         userid = client->userid;
-        db_get_user_info(userid, &info);
-        setenv("NH4SERVERUSER", info.username, 1);
         post_fork_cleanup();
-        client_main(userid, pipe_out_fd[0], pipe_in_fd[1]);
+        /* writes block while the master applies back-pressure for a slow
+           client, instead of spinning on EAGAIN */
+        fcntl(pipe_in_fd[1], F_SETFL, 0);
+        client_main(userid, pipe_out_fd[0], pipe_in_fd[1], -1);
         exit(0);        /* shouldn't get here... client is done. */
     } else if (client->pid == -1) {     /* error */
         /* can't proceed, so clean up. The client side of the pipes needs to be
@@ -345,6 +504,7 @@ fork_client(struct client_data *client, int epfd)
     client->state = CLIENT_CONNECTED;
     unlink_client_data(client);
     link_client_data(client, &connected_list_head);
+    registry_add_game(client->pid, client->userid, client->connid, TRUE);
 
     /* register the pipe fds for monitoring by epoll */
     ev.data.ptr = NULL;
@@ -362,6 +522,220 @@ fork_client(struct client_data *client, int epfd)
 }
 
 
+/*
+ * Game processes only append their events to a spool file; the scripts that
+ * handle them are run by one long-lived dispatcher process, so that neither
+ * the games nor the master ever need to fork for an event.
+ */
+static void
+start_event_dispatcher(void)
+{
+    char **gamepaths;
+    int i;
+
+    event_dispatcher_pid = fork();
+    if (event_dispatcher_pid == 0) {    /* child */
+        post_fork_cleanup();
+        gamepaths = init_game_paths();
+        nh_lib_init(&server_windowprocs, gamepaths);
+        for (i = 0; i < PREFIX_COUNT; i++)
+            free(gamepaths[i]);
+        free(gamepaths);
+
+        nh_run_event_dispatcher(&termination_flag);
+        nh_lib_exit();
+        exit(0);
+    } else if (event_dispatcher_pid == -1)
+        log_msg("Failed to fork the event dispatcher: %s", strerror(errno));
+}
+
+
+/*
+ * Logins are handled by a pool of auth worker processes, so that a slow
+ * database or password hashing can't delay the relaying of game data.
+ */
+static void
+start_auth_worker(struct auth_worker *w, int epfd)
+{
+    struct epoll_event ev;
+    int sv[2];
+
+    w->fd = -1;
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1) {
+        log_msg("Failed to create a socket for an auth worker: %s",
+                strerror(errno));
+        w->pid = 0;
+        return;
+    }
+
+    w->pid = fork();
+    if (w->pid == 0) {  /* child */
+        fcntl(sv[1], F_SETFD, 0);       /* survive post_fork_cleanup */
+        post_fork_cleanup();
+        auth_worker_main(sv[1]);
+        exit(0);
+    }
+
+    close(sv[1]);
+    if (w->pid == -1) {
+        log_msg("Failed to fork an auth worker: %s", strerror(errno));
+        close(sv[0]);
+        w->pid = 0;
+        return;
+    }
+
+    w->fd = sv[0];
+    fcntl(w->fd, F_SETFL, O_NONBLOCK);
+    ev.data.ptr = NULL;
+    ev.events = EPOLLIN;
+    ev.data.fd = w->fd;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, w->fd, &ev);
+}
+
+
+/*
+ * Cut the connection to a worker. Connections that were still waiting for it
+ * are closed, as there is no way to know how far their auth got.
+ */
+static void
+stop_auth_worker(struct auth_worker *w, int epfd)
+{
+    int i;
+
+    if (w->fd == -1)
+        return;
+
+    epoll_ctl(epfd, EPOLL_CTL_DEL, w->fd, NULL);
+    close(w->fd);
+    w->fd = -1;
+
+    for (i = 0; i < w->pending_count; i++)
+        close(w->pending[i]);
+    if (w->pending_count)
+        log_msg("Auth worker %d is gone; %d pending logins were dropped.",
+                w->pid, w->pending_count);
+    w->pending_count = 0;
+}
+
+
+static struct auth_worker *
+find_auth_worker(int fd)
+{
+    int i;
+
+    for (i = 0; i < settings.auth_workers; i++)
+        if (auth_workers[i].fd == fd)
+            return &auth_workers[i];
+    return NULL;
+}
+
+
+/*
+ * Pass an auth request to the least busy worker.
+ * Returns FALSE if no worker can take it.
+ */
+static int
+send_auth_request(const struct auth_request *req)
+{
+    struct auth_worker *w = NULL;
+    int i;
+
+    for (i = 0; i < settings.auth_workers; i++)
+        if (auth_workers[i].fd != -1 &&
+            (!w || auth_workers[i].pending_count < w->pending_count))
+            w = &auth_workers[i];
+    if (!w)
+        return FALSE;
+
+    if (send(w->fd, req, sizeof (*req), MSG_DONTWAIT | MSG_NOSIGNAL) !=
+        sizeof (*req))
+        return FALSE;
+
+    if (w->pending_count == w->pending_max) {
+        w->pending_max = w->pending_max ? 2 * w->pending_max : 16;
+        w->pending = realloc(w->pending, w->pending_max * sizeof (int));
+    }
+    w->pending[w->pending_count++] = req->fd;
+    return TRUE;
+}
+
+
+/* Hand the queued logins to the workers, oldest first, for as long as they
+   take them. */
+static void
+send_queued_logins(void)
+{
+    int sent = 0;
+
+    while (sent < queued_login_count &&
+           send_auth_request(&queued_logins[sent]))
+        sent++;
+
+    queued_login_count -= sent;
+    memmove(queued_logins, &queued_logins[sent],
+            queued_login_count * sizeof (struct auth_request));
+}
+
+
+/*
+ * Authenticate a new connection in an auth worker. If no worker can take the
+ * request right now, it waits in queued_logins; if too many are waiting
+ * already, the connection is dropped.
+ */
+static void
+queue_auth_request(int newfd, const char *peername, const char *authbuf)
+{
+    struct auth_request req;
+
+    memset(&req, 0, sizeof (req));
+    req.fd = newfd;
+    strncpy(req.peername, peername, sizeof (req.peername) - 1);
+    strncpy(req.authbuf, authbuf, AUTHBUFSIZE - 1);
+
+    /* don't overtake the logins that are already waiting */
+    if (!queued_login_count && send_auth_request(&req))
+        return;
+
+    if (queued_login_count == MAX_QUEUED_LOGINS) {
+        log_msg("No auth worker is available; dropping the login from %s.",
+                peername);
+        close(newfd);
+        return;
+    }
+
+    if (!queued_logins)
+        queued_logins =
+            malloc(MAX_QUEUED_LOGINS * sizeof (struct auth_request));
+    queued_logins[queued_login_count++] = req;
+}
+
+
+/* A worker has answered (or died). */
+static void
+auth_worker_event(struct auth_worker *w, int epfd)
+{
+    struct auth_response resp;
+    int i, ret;
+
+    while ((ret = recv(w->fd, &resp, sizeof (resp), 0)) == sizeof (resp)) {
+        for (i = 0; i < w->pending_count; i++)
+            if (w->pending[i] == resp.fd)
+                break;
+        if (i == w->pending_count)
+            continue;   /* not ours; this should never happen */
+        w->pending[i] = w->pending[--w->pending_count];
+
+        finish_new_connection(resp.fd, epfd, resp.userid, resp.is_reg,
+                              resp.reconnect_id, FALSE);
+    }
+
+    if (ret == 0 || (ret == -1 && errno != EAGAIN && errno != EINTR))
+        stop_auth_worker(w, epfd);
+    else
+        send_queued_logins();   /* the worker has room again */
+}
+
+
 /*
  * Accept and authenticate a new client connection on one of the listening sockets.
  */
@@ -408,12 +782,10 @@ static void
 handle_new_connection(int newfd, int epfd)
 {
     struct epoll_event ev;
-    struct client_data *client;
     struct sockaddr_storage addr;
     socklen_t addrlen = sizeof (addr);
     char authbuf[AUTHBUFSIZE];
-    int pos, is_reg, reconnect_id, authlen, userid;
-    static int connection_id = 1;
+    int pos, authlen;
 
     if (fd_to_client_max > newfd &&
         fd_to_client[newfd] == &new_connection_dummy) {
@@ -453,10 +825,29 @@ handle_new_connection(int newfd, int epfd)
         return;
     }
 
-    /* 
-     * ready to authenticate the user here
-     */
-    userid = auth_user(authbuf, addr2str(&addr), &is_reg, &reconnect_id);
+    /* ready to authenticate the user */
+    queue_auth_request(newfd, addr2str(&addr), authbuf);
+}
+
+
+/*
+ * Authentication for a new connection is complete: either connect it to a
+ * game process or reject it. Connections that were forwarded by another shard
+ * are always handled here.
+ */
+static void
+finish_new_connection(int newfd, int epfd, int userid, int is_reg,
+                      int reconnect_id, int forwarded)
+{
+    struct epoll_event ev;
+    struct client_data *client;
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof (addr);
+    int shard;
+
+    memset(&addr, 0, addrlen);
+    getpeername(newfd, (struct sockaddr *)&addr, &addrlen);
+
     if (userid <= 0) {
         if (!userid)
             auth_send_result(newfd, AUTH_FAILED_UNKNOWN_USER, is_reg, 0);
@@ -467,6 +858,17 @@ handle_new_connection(int newfd, int epfd)
         return;
     }
 
+    /* the user's game may be running in another shard */
+    shard = forwarded ? -1 : registry_find_shard(userid, reconnect_id);
+    if (shard != -1 && shard != shard_id) {
+        if (forward_connection(shard, newfd, userid, is_reg, reconnect_id)) {
+            close(newfd);
+            return;
+        }
+        log_msg("Failed to forward a connection to shard %d: %s", shard,
+                strerror(errno));
+    }
+
     /* user ok, we'll keep this socket */
     ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
     ev.data.ptr = NULL;
@@ -493,7 +895,17 @@ handle_new_connection(int newfd, int epfd)
                 break;
     }
 
-    if (client) {
+    if (client && client->control != -1) {
+        /* the game process takes over the connection; in this mode the master
+           can't tell whether the game still has a client */
+        auth_send_result(newfd, AUTH_SUCCESS_RECONNECT, is_reg, client->connid);
+        map_fd_to_client(newfd, client);
+        pass_client_socket(client, newfd, epfd);
+
+        log_msg("Connection to game at pid %d passed on for user %d",
+                client->pid, client->userid);
+        return;
+    } else if (client) {
         /* there is a running, disconnected game process for this user */
         auth_send_result(newfd, AUTH_SUCCESS_RECONNECT, is_reg, client->connid);
         client->sock = newfd;
@@ -501,8 +913,11 @@ handle_new_connection(int newfd, int epfd)
         client->state = CLIENT_CONNECTED;
         unlink_client_data(client);
         link_client_data(client, &connected_list_head);
+        registry_set_connected(client->connid, TRUE);
         write(client->pipe_out, "\033", 1);     /* signal to reset the read
                                                    buffer */
+        /* pick up any output that arrived while nobody was reading it */
+        rearm_game_output(client, epfd);
 
         log_msg("Connection to game at pid %d reestablished for user %d",
                 client->pid, client->userid);
@@ -512,11 +927,16 @@ handle_new_connection(int newfd, int epfd)
         client->state = CLIENT_CONNECTED;
         client->sock = newfd;
         map_fd_to_client(newfd, client);
-        client->connid = connection_id++;
+        client->connid = next_connection_id();
         client->userid = userid;
         /* there is no process yet */
-        if (fork_client(client, epfd))
+        if (fork_client(client, epfd)) {
             auth_send_result(newfd, AUTH_SUCCESS_NEW, is_reg, client->connid);
+            if (client->control != -1) {
+                client->sock = -1;
+                pass_client_socket(client, newfd, epfd);
+            }
+        }
         /* else: client communication is shutdown if fork_client errors out */
     }
 
@@ -554,10 +974,16 @@ cleanup_game_process(struct client_data *client, int epfd)
         fd_to_client[client->pipe_in] = NULL;
     }
 
-    if (client->unsent_data)
-        free(client->unsent_data);
+    if (client->control != -1) {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, client->control, NULL);
+        close(client->control);
+        fd_to_client[client->control] = NULL;
+    }
 
-    client->pipe_in = client->pipe_out = client->sock = -1;
+    free(client->out.data);
+
+    registry_remove_game(client->connid);
+    client->pipe_in = client->pipe_out = client->sock = client->control = -1;
     unlink_client_data(client);
     free(client);
 
@@ -602,45 +1028,161 @@ close_client_pipe(struct client_data *client, int epfd)
 }
 
 
+/* Make room for at least n more bytes, keeping the unsent data in order. */
+static void
+out_buffer_reserve(struct out_buffer *ob, int n)
+{
+    int newsize, first;
+    char *newdata;
+
+    if (ob->size - ob->len >= n)
+        return;
+
+    newsize = ob->size ? ob->size : OUT_BUFFER_CHUNK;
+    while (newsize - ob->len < n)
+        newsize *= 2;
+
+    newdata = malloc(newsize);
+    if (ob->len) {
+        first = ob->size - ob->start;
+        if (first > ob->len)
+            first = ob->len;
+        memcpy(newdata, &ob->data[ob->start], first);
+        memcpy(&newdata[first], ob->data, ob->len - first);
+    }
+    free(ob->data);
+    ob->data = newdata;
+    ob->size = newsize;
+    ob->start = 0;
+}
+
+
+/* Describe the unsent data (if used is set) or the free space of the buffer
+ * with at most 2 iovecs. Returns the number of iovecs. */
 static int
-send_to_client(struct client_data *client, char *buffer, int sendlen)
+out_buffer_iov(const struct out_buffer *ob, struct iovec *iov, int used)
 {
-    int sent, ret;
-    char *newbuf;
+    int start, len, first;
 
-    if (!buffer) {
-        buffer = client->unsent_data;
-        sendlen = client->unsent_data_size;
-        if (!buffer)
-            return 0;
+    if (!ob->size)
+        return 0;
+
+    if (used) {
+        start = ob->start;
+        len = ob->len;
+    } else {
+        start = (ob->start + ob->len) % ob->size;
+        len = ob->size - ob->len;
     }
+    if (!len)
+        return 0;
+
+    first = ob->size - start;
+    if (first > len)
+        first = len;
+    iov[0].iov_base = &ob->data[start];
+    iov[0].iov_len = first;
+    if (first == len)
+        return 1;
+
+    iov[1].iov_base = ob->data;
+    iov[1].iov_len = len - first;
+    return 2;
+}
 
-    sent = 0;
-    do {
-        ret = write(client->sock, &buffer[sent], sendlen - sent);
-        if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
-            /* be careful, buffer == client->unsent_data is possible */
-            newbuf = malloc(sendlen - sent);
-            memcpy(newbuf, &buffer[sent], sendlen - sent);
-            if (client->unsent_data)
-                free(client->unsent_data);
-            client->unsent_data = newbuf;
-            client->unsent_data_size = sendlen - sent;
-            return sent;
-        } else if (ret == -1 && errno == EPIPE) {
+
+/*
+ * Send as much of the buffered output as the socket will take. The rest is
+ * sent when epoll reports EPOLLOUT.
+ * Returns the number of bytes still waiting, or -1 on error.
+ */
+static int
+flush_to_client(struct client_data *client)
+{
+    struct out_buffer *ob = &client->out;
+    struct iovec iov[2];
+    int ret;
+
+    while (ob->len) {
+        ret = writev(client->sock, iov, out_buffer_iov(ob, iov, TRUE));
+        if (ret == -1 && errno == EINTR)
+            continue;
+        else if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        else if (ret == -1 && errno == EPIPE) {
             shutdown(client->sock, SHUT_RDWR);
             return -1;
-        } else if (ret == -1 && errno != EINTR)
+        } else if (ret == -1)
             return -1;
-        sent += ret;
-    } while (sent < sendlen);
 
-    if (client->unsent_data)
-        free(client->unsent_data);
-    client->unsent_data = NULL;
-    client->unsent_data_size = 0;
+        ob->len -= ret;
+        ob->start = ob->len ? (ob->start + ret) % ob->size : 0;
+    }
+
+    return ob->len;
+}
+
+
+/*
+ * Pass output from the game process on to the client.
+ * The data is read straight into the client's out_buffer. Once more than
+ * client_buffer_kb is waiting for a slow client, reading stops until
+ * flush_to_client catches up. Meanwhile the game blocks on the full pipe, so
+ * the backlog of a client can't grow without bound.
+ */
+static void
+relay_game_output(struct client_data *client)
+{
+    struct out_buffer *ob = &client->out;
+    struct iovec iov[2];
+    char buf[16384];
+    int ret, high_water = settings.client_buffer_kb * 1024;
+
+    if (client->sock == -1) {
+        /* the client is gone; drain the pipe so that the game doesn't block.
+           A client that reconnects gets a fresh state anyway. */
+        do {
+            ret = read(client->pipe_in, buf, sizeof (buf));
+        } while (ret > 0 || (ret == -1 && errno == EINTR));
+        return;
+    }
+
+    /* oddity alert: this code originally used splice for sending. That would
+       match the receive case and no buffer would be required. Unfortunately
+       sending that way is significantly slower. splice: 200ms - read+write:
+       0.2ms! Ouch! */
+    while (ob->len < high_water) {
+        out_buffer_reserve(ob, OUT_BUFFER_CHUNK);
+        ret = readv(client->pipe_in, iov, out_buffer_iov(ob, iov, FALSE));
+        if (ret == -1 && errno == EINTR)
+            continue;
+        else if (ret == -1 && errno != EAGAIN)
+            log_msg("error while reading from pipe: %s", strerror(errno));
+        if (ret <= 0)
+            break;
+        ob->len += ret;
+
+        if (flush_to_client(client) == -1) {
+            log_msg("error while sending: %s", strerror(errno));
+            break;
+        }
+    }
+}
+
+
+/* pipe_in is edge-triggered: data that arrived while relay_game_output wasn't
+   reading won't be reported again unless the notification is re-armed. */
+static void
+rearm_game_output(struct client_data *client, int epfd)
+{
+    struct epoll_event ev;
 
-    return sent;
+    if (client->pipe_in == -1)
+        return;
+    ev.data.ptr = NULL;
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+    ev.data.fd = client->pipe_in;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, client->pipe_in, &ev);
 }
 
 
@@ -654,9 +1196,8 @@ send_to_client(struct client_data *client, char *buffer, int sendlen)
 static void
 handle_communication(int fd, int epfd, unsigned int event_mask)
 {
-    int ret, closed, write_count, errno_orig, read_ret, write_ret;
+    int closed, write_count, read_ret, write_ret;
     struct client_data *client = fd_to_client[fd];
-    struct epoll_event ev;
     char buf[16384];
 
     if (event_mask & EPOLLERR ||        /* fd error */
@@ -677,14 +1218,18 @@ handle_communication(int fd, int epfd, unsigned int event_mask)
                 client->state = CLIENT_DISCONNECTED;
                 unlink_client_data(client);
                 link_client_data(client, &disconnected_list_head);
+                registry_set_connected(client->connid, FALSE);
 
                 /* Maybe the destination vanished before sending completed...
-                   unsent_data is likely to be an incomplete JSON object;
+                   the unsent data is likely to be an incomplete JSON object;
                    deleting it is the only sane option. */
-                if (client->unsent_data)
-                    free(client->unsent_data);
-                client->unsent_data = NULL;
-                client->unsent_data_size = 0;
+                free(client->out.data);
+                memset(&client->out, 0, sizeof (client->out));
+
+                /* relay_game_output may have stopped reading at the high-water
+                   mark; without a drain, the game would block on the full
+                   pipe forever */
+                relay_game_output(client);
             } else {
                 log_msg("Shutdown completed for game at pid %d", client->pid);
                 client->pid = 0;
@@ -718,18 +1263,17 @@ handle_communication(int fd, int epfd, unsigned int event_mask)
                     cleanup_game_process(client, epfd);
                 }
             }
-            if ((event_mask & EPOLLOUT) && client->unsent_data) {
-                write_count = send_to_client(client, NULL, 0);
-                if (write_count == -1)
+            if ((event_mask & EPOLLOUT) && client->out.len) {
+                if (flush_to_client(client) == -1)
                     log_msg("error while sending: %s", strerror(errno));
 
-                /* re-arm pipe_in notification: there may be more data to send
-                   in the pipe for which an event was already received but not
-                   acted upon */
-                ev.data.ptr = NULL;
-                ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
-                ev.data.fd = client->pipe_in;
-                epoll_ctl(epfd, EPOLL_CTL_MOD, client->pipe_in, &ev);
+                /* re-arm pipe_in notification once the backlog is below the
+                   high-water mark: there may be more data to send in the pipe
+                   for which an event was already received but not acted
+                   upon */
+                if (client->out.len >= settings.client_buffer_kb * 1024)
+                    return;
+                rearm_game_output(client, epfd);
             }
         }
 
@@ -737,36 +1281,8 @@ handle_communication(int fd, int epfd, unsigned int event_mask)
         if (closed)
             close_client_pipe(client, epfd);
 
-        else {  /* there is data to send */
-            if (client->unsent_data)
-                return; /* socket isn't ready for sending */
-
-            /* oddity alert: this code originally used splice for sending. That 
-               would match the receive case above and no buffer would be
-               required. Unfortunately sending that way is significantly
-               slower. splice: 200ms - read+write: 0.2ms! Ouch! */
-            do {
-                /* read from the pipe */
-            redo:
-                ret = read(client->pipe_in, buf, sizeof (buf));
-                errno_orig = errno;
-                if (ret == -1 && errno == EINTR)
-                    goto redo; /* not "continue", we don't want to check the
-                                  loop condition */
-                else if (ret > 0) {
-                    /* write to the socket; be careful to write all of it... */
-                    write_count = send_to_client(client, buf, ret);
-                    /* write_count != ret if no more data could be sent and the
-                       remainder buf was copied to client->unsent_data for later
-                       sending */
-                } else write_count = ret;
-            } while (ret == write_count && ret == sizeof (buf));
-            if (ret == -1)
-                log_msg("error while reading from pipe: %s",
-                        strerror(errno_orig));
-            if (write_count == -1)
-                log_msg("error while sending: %s", strerror(errno));
-        }
+        else    /* there is data to send */
+            relay_game_output(client);
 
     } else if (fd == client->pipe_out) {
         if (closed)
@@ -780,6 +1296,22 @@ handle_communication(int fd, int epfd, unsigned int event_mask)
 }
 
 
+static int
+init_unix_socket(void)
+{
+    int fd = -1, prevmask;
+
+    if (settings.bind_addr_unix.sun_family && remove_unix_socket()) {
+        prevmask = umask(0);
+        fd = init_server_socket((struct sockaddr *)&settings.bind_addr_unix);
+        umask(prevmask);
+    }
+
+    return fd;
+}
+
+
+/* *unixfd may already hold a unix socket shared by all shards. */
 static int
 setup_server_sockets(int *ipv4fd, int *ipv6fd, int *unixfd, int epfd)
 {
@@ -807,16 +1339,11 @@ setup_server_sockets(int *ipv4fd, int *ipv6fd, int *unixfd, int epfd)
     } else
         *ipv4fd = -1;
 
-    if (settings.bind_addr_unix.sun_family && remove_unix_socket()) {
-        int prevmask = umask(0);
-
-        *unixfd =
-            init_server_socket((struct sockaddr *)&settings.bind_addr_unix);
-        ev.data.fd = *unixfd;
-        if (*unixfd != -1)
-            epoll_ctl(epfd, EPOLL_CTL_ADD, *unixfd, &ev);
-        umask(prevmask);
-    }
+    if (*unixfd == -1)
+        *unixfd = init_unix_socket();
+    ev.data.fd = *unixfd;
+    if (*unixfd != -1)
+        epoll_ctl(epfd, EPOLL_CTL_ADD, *unixfd, &ev);
 
     if (*ipv4fd == -1 && *ipv6fd == -1) {
         log_msg
@@ -865,16 +1392,32 @@ trigger_server_shutdown(struct timeval *tv, int *ipv4fd, int *ipv6fd,
 }
 
 
+/* Connections passed on by other shards. */
+static void
+shard_inbox_event(int epfd)
+{
+    int fd, userid, is_reg, reconnect_id;
+
+    while ((fd = receive_forwarded_connection(&userid, &is_reg,
+                                              &reconnect_id)) != -1)
+        finish_new_connection(fd, epfd, userid, is_reg, reconnect_id, TRUE);
+}
+
+
 /*
  * The server's core. Creates the configured listening sockets and then
  * enters the server event loop from which all clients are served.
+ * In a shard, unixfd is the shared unix socket and inboxfd receives the
+ * connections forwarded by other shards; otherwise both are -1.
  */
-int
-runserver(void)
+static int
+serve(int unixfd, int inboxfd)
 {
-    int i, ipv4fd, ipv6fd, unixfd, epfd, nfds, timeout, fd, childstatus;
-    struct epoll_event events[MAX_EVENTS];
+    int i, ipv4fd, ipv6fd, epfd, nfds, timeout, fd, childstatus, pid;
+    int log_timeout;
+    struct epoll_event ev, events[MAX_EVENTS];
     struct client_data *client;
+    struct auth_worker *worker;
     struct timeval sigtime, curtime, tmp;
 
     fd_to_client_max = 64;      /* will be doubled every time it becomes too
@@ -890,6 +1433,18 @@ runserver(void)
     if (!setup_server_sockets(&ipv4fd, &ipv6fd, &unixfd, epfd))
         return FALSE;
 
+    if (inboxfd != -1) {
+        ev.data.ptr = NULL;
+        ev.events = EPOLLIN;
+        ev.data.fd = inboxfd;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, inboxfd, &ev);
+    } else  /* with shards, the supervisor runs the dispatcher */
+        start_event_dispatcher();
+
+    auth_workers = calloc(settings.auth_workers, sizeof (struct auth_worker));
+    for (i = 0; i < settings.auth_workers; i++)
+        start_auth_worker(&auth_workers[i], epfd);
+
     /* 
      * server event loop
      */
@@ -907,7 +1462,30 @@ runserver(void)
         }
 
         /* make sure child processes are cleaned up */
-        waitpid(-1, &childstatus, WNOHANG);
+        while ((pid = waitpid(-1, &childstatus, WNOHANG)) > 0) {
+            if (pid == event_dispatcher_pid && !termination_flag) {
+                log_msg("The event dispatcher exited; restarting it.");
+                start_event_dispatcher();
+            }
+            for (i = 0; i < settings.auth_workers; i++) {
+                if (pid != auth_workers[i].pid)
+                    continue;
+                stop_auth_worker(&auth_workers[i], epfd);
+                auth_workers[i].pid = 0;
+                if (!termination_flag) {
+                    log_msg("Auth worker %d exited; restarting it.", pid);
+                    start_auth_worker(&auth_workers[i], epfd);
+                    send_queued_logins();
+                }
+            }
+        }
+
+        /* wake up in time to write out buffered log messages */
+        log_timeout = log_flush_timer();
+        if (log_timeout != -1 && log_timeout < timeout)
+            timeout = log_timeout;
+        else
+            log_timeout = -1;
 
         nfds = epoll_wait(epfd, events, MAX_EVENTS, timeout);
         if (nfds == -1) {
@@ -927,6 +1505,8 @@ runserver(void)
             else
                 goto finally;
         } else if (nfds == 0) { /* timeout */
+            if (log_timeout != -1)
+                continue;       /* only the log flush was due */
             if (!termination_flag)
                 log_msg(" -- mark (no activity for 10 minutes) --");
             else        /* shutdown timer has run out */
@@ -943,6 +1523,16 @@ runserver(void)
                 continue;
             }
 
+            if (fd == inboxfd) {
+                shard_inbox_event(epfd);
+                continue;
+            }
+
+            if ((worker = find_auth_worker(fd))) {
+                auth_worker_event(worker, epfd);
+                continue;
+            }
+
             /* activity on a client socket or pipe */
             client = fd_to_client[fd];
             /* was this fd closed while handling a prior event? */
@@ -963,7 +1553,8 @@ runserver(void)
                 /* When the client is disconnected, activity usually only
                    happens on the pipes: either the game process is closing
                    them because the idle timeout expired or shutdown was
-                   requested via a signal. */
+                   requested via a signal. Games in pass_sockets mode are
+                   always here and their control socket behaves the same. */
                 if (events[i].events & EPOLLERR ||      /* error */
                     events[i].events & EPOLLHUP ||      /* connection closed */
                     events[i].events & EPOLLRDHUP)      /* connection closed */
@@ -997,6 +1588,24 @@ finally:
     while (connected_list_head.next)
         cleanup_game_process(connected_list_head.next, epfd);
 
+    /* the dispatcher finishes the event it is running, if any, and exits */
+    if (event_dispatcher_pid > 0)
+        kill(event_dispatcher_pid, SIGTERM);
+
+    /* the workers exit when their socket is closed */
+    for (i = 0; i < settings.auth_workers; i++) {
+        stop_auth_worker(&auth_workers[i], epfd);
+        free(auth_workers[i].pending);
+    }
+    free(auth_workers);
+    auth_workers = NULL;
+
+    for (i = 0; i < queued_login_count; i++)
+        close(queued_logins[i].fd);
+    free(queued_logins);
+    queued_logins = NULL;
+    queued_login_count = 0;
+
     close(epfd);
     if (ipv4fd != -1)
         close(ipv4fd);
@@ -1009,4 +1618,102 @@ finally:
     return TRUE;
 }
 
+
+static int *shard_pids;
+
+static void
+start_shard(int id, int unixfd)
+{
+    int ret, inboxfd;
+
+    shard_pids[id] = fork();
+    if (shard_pids[id] == 0) {  /* child */
+        free(shard_pids);
+        shard_pids = NULL;
+        event_dispatcher_pid = 0;
+        inboxfd = enter_shard(id);
+        ret = serve(unixfd, inboxfd);
+        exit(ret ? 0 : 1);
+    } else if (shard_pids[id] == -1) {
+        log_msg("Failed to fork shard %d: %s", id, strerror(errno));
+        shard_pids[id] = 0;
+    }
+}
+
+
+/*
+ * Run settings.shards copies of the event loop and restart any that exit until
+ * shutdown is requested. The games of a shard are its children, so they go
+ * away with it.
+ */
+static int
+supervise_shards(void)
+{
+    int i, pid, status, unixfd;
+
+    if (!init_shards())
+        return FALSE;
+
+    /* SO_REUSEPORT doesn't work for unix sockets; the shards share one */
+    unixfd = init_unix_socket();
+    start_event_dispatcher();
+
+    shard_pids = calloc(settings.shards, sizeof (int));
+    for (i = 0; i < settings.shards; i++)
+        start_shard(i, unixfd);
+
+    while (!termination_flag) {
+        flush_log();
+        pid = waitpid(-1, &status, 0);
+        if (pid == -1) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        if (pid == event_dispatcher_pid) {
+            log_msg("The event dispatcher exited; restarting it.");
+            start_event_dispatcher();
+        }
+        for (i = 0; i < settings.shards; i++) {
+            if (pid != shard_pids[i])
+                continue;
+            log_msg("Shard %d (pid %d) exited; restarting it.", i, pid);
+            clear_shard_games(i);
+            sleep(1);   /* don't spin if the shard can't start at all */
+            start_shard(i, unixfd);
+        }
+    }
+
+    log_msg("Shutdown request received; stopping %d shards.", settings.shards);
+    for (i = 0; i < settings.shards; i++)
+        if (shard_pids[i] > 0)
+            kill(shard_pids[i], SIGTERM);
+    if (event_dispatcher_pid > 0)
+        kill(event_dispatcher_pid, SIGTERM);
+
+    for (i = 0; i < settings.shards; i++)
+        while (shard_pids[i] > 0 && waitpid(shard_pids[i], &status, 0) == -1 &&
+               errno == EINTR)
+            ;
+
+    free(shard_pids);
+    shard_pids = NULL;
+    if (unixfd != -1)
+        close(unixfd);
+    free_shards();
+
+    return TRUE;
+}
+
+
+int
+runserver(void)
+{
+    if (settings.shards > 1)
+        return supervise_shards();
+
+    return serve(-1, -1);
+}
+
 /* server.c */
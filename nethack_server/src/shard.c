@@ -0,0 +1,325 @@
+/* vim:set cin ft=c sw=4 sts=4 ts=8 et ai cino=Ls\:0t0(0 : -*- mode:c;fill-column:80;tab-width:8;c-basic-offset:4;indent-tabs-mode:nil;c-file-style:"k&r" -*-*/
+/* The NetHack server may be freely redistributed under the terms of either:
+ *  - the NetHack license
+ *  - the GNU General Public license v2 or later
+ */
+
+/*
+ * State shared between the shards of the master (see runserver in server.c).
+ *
+ * Every shard accepts connections on its own SO_REUSEPORT listeners, so a
+ * client that reconnects may well arrive at a different shard than the one
+ * that runs its game. The registry is a table in shared memory that lists the
+ * games of all shards. A shard that finds a user's game in another shard
+ * passes the connection on to it through that shard's inbox socket, and the
+ * owning shard then does the usual reconnect.
+ *
+ * Each registry entry is only ever written by the shard that owns the game;
+ * other shards just read it. A stale entry merely causes a connection to be
+ * forwarded to a shard that then handles it as a new login.
+ */
+
+#include "nhserver.h"
+
+#include <sys/mman.h>
+
+/* maximum number of games on the whole server */
+#define REGISTRY_SIZE 8192
+
+struct registry_entry {
+    int pid;    /* 0 if the entry is free */
+    int userid;
+    int connid;
+    short shard;
+    char connected;
+};
+
+struct shard_registry {
+    int next_connid;
+    struct registry_entry games[REGISTRY_SIZE];
+};
+
+/* forwarded connections carry this, with the socket as SCM_RIGHTS data */
+struct shard_message {
+    int userid;
+    int is_reg;
+    int reconnect_id;
+};
+
+int shard_id = -1;      /* -1 in the supervisor or if sharding is off */
+
+static struct shard_registry *registry;
+static int (*inbox)[2]; /* [0] is read by the shard, [1] written by anyone */
+
+
+int
+init_shards(void)
+{
+    int i;
+
+    registry = mmap(NULL, sizeof (struct shard_registry),
+                    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (registry == MAP_FAILED) {
+        registry = NULL;
+        log_msg("Failed to create the shard registry: %s", strerror(errno));
+        return FALSE;
+    }
+    registry->next_connid = 1;
+
+    inbox = calloc(settings.shards, sizeof (*inbox));
+    for (i = 0; i < settings.shards; i++)
+        if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, inbox[i]) ==
+            -1) {
+            log_msg("Failed to create the inbox of shard %d: %s", i,
+                    strerror(errno));
+            while (i--) {
+                close(inbox[i][0]);
+                close(inbox[i][1]);
+            }
+            free(inbox);
+            inbox = NULL;
+            munmap(registry, sizeof (struct shard_registry));
+            registry = NULL;
+            return FALSE;
+        }
+
+    return TRUE;
+}
+
+
+void
+free_shards(void)
+{
+    int i;
+
+    if (inbox) {
+        for (i = 0; i < settings.shards; i++) {
+            close(inbox[i][0]);
+            close(inbox[i][1]);
+        }
+        free(inbox);
+        inbox = NULL;
+    }
+    if (registry) {
+        munmap(registry, sizeof (struct shard_registry));
+        registry = NULL;
+    }
+}
+
+
+/* Called in a new shard process. Returns the socket on which forwarded
+ * connections arrive. */
+int
+enter_shard(int id)
+{
+    int i;
+
+    shard_id = id;
+    for (i = 0; i < settings.shards; i++)
+        if (i != id) {
+            close(inbox[i][0]);
+            inbox[i][0] = -1;
+        }
+
+    fcntl(inbox[id][0], F_SETFL, O_NONBLOCK);
+    return inbox[id][0];
+}
+
+
+/* A shard died, and its games with it. */
+void
+clear_shard_games(int id)
+{
+    int i;
+
+    for (i = 0; i < REGISTRY_SIZE; i++)
+        if (registry->games[i].pid && registry->games[i].shard == id)
+            registry->games[i].pid = 0;
+}
+
+
+/* Connection ids must be unique across all shards. */
+int
+next_connection_id(void)
+{
+    static int connection_id = 1;
+
+    if (!registry)
+        return connection_id++;
+    return __sync_fetch_and_add(&registry->next_connid, 1);
+}
+
+
+static struct registry_entry *
+find_registry_entry(int connid)
+{
+    int i;
+
+    for (i = 0; i < REGISTRY_SIZE; i++)
+        if (registry->games[i].pid && registry->games[i].shard == shard_id &&
+            registry->games[i].connid == connid)
+            return &registry->games[i];
+    return NULL;
+}
+
+
+void
+registry_add_game(int pid, int userid, int connid, int connected)
+{
+    int i;
+
+    if (!registry)
+        return;
+
+    for (i = 0; i < REGISTRY_SIZE; i++) {
+        struct registry_entry *e = &registry->games[i];
+
+        if (e->pid || !__sync_bool_compare_and_swap(&e->pid, 0, -1))
+            continue;
+        e->userid = userid;
+        e->connid = connid;
+        e->shard = shard_id;
+        e->connected = connected;
+        __sync_synchronize();
+        e->pid = pid;   /* publish the entry */
+        return;
+    }
+
+    log_msg("The shard registry is full; reconnects to game %d will only "
+            "work through shard %d.", pid, shard_id);
+}
+
+
+void
+registry_set_connected(int connid, int connected)
+{
+    struct registry_entry *e;
+
+    if (registry && (e = find_registry_entry(connid)))
+        e->connected = connected;
+}
+
+
+void
+registry_remove_game(int connid)
+{
+    struct registry_entry *e;
+
+    if (registry && (e = find_registry_entry(connid)))
+        e->pid = 0;
+}
+
+
+/*
+ * Which shard runs the game a login should reconnect to? This is the lookup
+ * finish_new_connection does for the local games, done over all shards.
+ * Returns -1 if there is no such game.
+ */
+int
+registry_find_shard(int userid, int reconnect_id)
+{
+    int i, found = -1;
+    struct registry_entry *e;
+
+    if (!registry)
+        return -1;
+
+    for (i = 0; i < REGISTRY_SIZE && found == -1; i++) {
+        e = &registry->games[i];
+        if (e->pid > 0 && !e->connected && e->userid == userid &&
+            (!reconnect_id || reconnect_id == e->connid))
+            found = e->shard;
+    }
+
+    for (i = 0; reconnect_id && i < REGISTRY_SIZE && found == -1; i++) {
+        e = &registry->games[i];
+        if (e->pid > 0 && e->userid == userid && reconnect_id == e->connid)
+            found = e->shard;
+    }
+
+    return found;
+}
+
+
+/* Pass an authenticated connection on to the shard that runs its game. */
+int
+forward_connection(int shard, int fd, int userid, int is_reg,
+                   int reconnect_id)
+{
+    struct shard_message sm;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    char cbuf[CMSG_SPACE(sizeof (int))];
+    int ret;
+
+    sm.userid = userid;
+    sm.is_reg = is_reg;
+    sm.reconnect_id = reconnect_id;
+
+    memset(&msg, 0, sizeof (msg));
+    memset(cbuf, 0, sizeof (cbuf));
+    iov.iov_base = &sm;
+    iov.iov_len = sizeof (sm);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof (cbuf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof (int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof (int));
+
+    do {
+        ret = sendmsg(inbox[shard][1], &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+    } while (ret == -1 && errno == EINTR);
+
+    return ret == sizeof (sm);
+}
+
+
+/*
+ * Receive a connection forwarded by another shard.
+ * Returns the socket, or -1 if there is nothing (more) to receive.
+ */
+int
+receive_forwarded_connection(int *userid, int *is_reg, int *reconnect_id)
+{
+    struct shard_message sm;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    char cbuf[CMSG_SPACE(sizeof (int))];
+    int ret, fd = -1;
+
+    memset(&msg, 0, sizeof (msg));
+    iov.iov_base = &sm;
+    iov.iov_len = sizeof (sm);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof (cbuf);
+
+    do {
+        ret = recvmsg(inbox[shard_id][0], &msg, MSG_CMSG_CLOEXEC);
+    } while (ret == -1 && errno == EINTR);
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); ret > 0 && cmsg;
+         cmsg = CMSG_NXTHDR(&msg, cmsg))
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+            memcpy(&fd, CMSG_DATA(cmsg), sizeof (int));
+
+    if (ret != sizeof (sm)) {
+        if (fd != -1)
+            close(fd);
+        return -1;
+    }
+
+    *userid = sm.userid;
+    *is_reg = sm.is_reg;
+    *reconnect_id = sm.reconnect_id;
+    return fd;
+}
+
+/* shard.c */
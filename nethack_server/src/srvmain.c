@@ -52,7 +52,13 @@ main(int argc, char *argv[])
         !begin_logging())
         return 1;
 
+    /* A database connection must not be used across fork(), and the master
+       forks all the time, so it doesn't keep one: the game processes and auth
+       workers connect on their own. */
+    close_database();
+
     if (!settings.nodaemon) {
+        flush_log();    /* the buffer would be lost with the parent */
         if (daemon(0, 0) == -1) {
             settings.nodaemon = TRUE;
             log_msg("could not detach from terminal: %s", strerror(errno));
@@ -66,14 +72,17 @@ main(int argc, char *argv[])
      */
     setpgid(0, 0);
     report_startup();
+    init_response_cache();
 
     runserver();
 
     /* shutdown */
     remove_pidfile();
+    log_db_stats();
     end_logging();
     close_database();
     remove_unix_socket();
+    free_response_cache();
     free_config();
 
     return 0;
@@ -117,6 +126,11 @@ print_usage(const char *progname)
     printf("                     saved games, high score etc.\n");
     printf("\n");
     printf("  Database connection settings:\n");
+    printf
+        ("  -b <\"pgsql\"|\"sqlite\">  Database backend. Default: \""
+         DEFAULT_DB_BACKEND "\"\n");
+    printf
+        ("                     sqlite keeps the database in a local file.\n");
     printf
         ("  -H <string>      Hostname, ip address (v4 or v6) or unix socket name\n");
     printf("                     of the PostgreSQL database server.\n");
@@ -128,6 +142,9 @@ print_usage(const char *progname)
     printf("  -a <string>      Password for the given user name.\n");
     printf
         ("  -D <string>      Database name. Default: the same as the user name.\n");
+    printf
+        ("                     For sqlite: the database file, relative to the\n");
+    printf("                     working directory. Default: nethack4.db\n");
     printf("\n");
     printf("  -h               Show this message.\n");
 }
@@ -140,7 +157,7 @@ read_parameters(int argc, char *argv[], char **conffile, int *request_kill,
     int opt;
 
     while ((opt =
-            getopt(argc, argv, "4:6:a:c:D:d:H:hkl:mno:P:p:s:t:u:w:")) != -1) {
+            getopt(argc, argv, "4:6:a:b:c:D:d:H:hkl:mno:P:p:s:t:u:w:")) != -1) {
         switch (opt) {
         case '4':      /* bind address */
             if (!parse_ip_addr
@@ -166,6 +183,15 @@ read_parameters(int argc, char *argv[], char **conffile, int *request_kill,
             settings.dbpass = strdup(optarg);
             break;
 
+        case 'b':      /* database backend */
+            if (!find_db_backend(optarg)) {
+                fprintf(stderr, "Error: unknown database backend %s.\n",
+                        optarg);
+                return FALSE;
+            }
+            settings.dbbackend = strdup(optarg);
+            break;
+
         case 'c':      /* config file */
             *conffile = optarg;
             break;
@@ -0,0 +1,196 @@
+/* vim:set cin ft=c sw=4 sts=4 ts=8 et ai cino=Ls\:0t0(0 : -*- mode:c;fill-column:80;tab-width:8;c-basic-offset:4;indent-tabs-mode:nil;c-file-style:"k&r" -*-*/
+/* The NetHack server may be freely redistributed under the terms of either:
+ *  - the NetHack license
+ *  - the GNU General Public license v2 or later
+ */
+
+/*
+ * Command timing for the game processes.
+ * The time taken by each client command is split into phases and recorded in
+ * a histogram per command and phase. If a statsfile is configured, every game
+ * process periodically appends its histograms to it and starts over, so each
+ * block of the file covers one interval.
+ */
+
+#include "nhserver.h"
+
+#include <time.h>
+#include <sys/file.h>
+
+/* bucket i counts times below 2^i microseconds; the last one takes the rest */
+#define TIMING_BUCKETS 24
+
+/* seconds between writes to the stats file */
+#define STATS_INTERVAL 60
+
+struct timing_hist {
+    unsigned long count;
+    unsigned long long sum, max;
+    unsigned long buckets[TIMING_BUCKETS];
+};
+
+static const char *const phase_names[TIMING_PHASES] = {
+    "total", "exec", "log", "encode", "write", "wait"
+};
+
+static struct timing_hist *hists;       /* [command][phase] */
+static int command_count;
+
+/* the command that is currently running */
+static int in_command;
+static unsigned long long cmd_start, cmd_log_start;
+static unsigned long long cmd_phase[TIMING_PHASES];
+
+static time_t last_write;
+
+
+unsigned long long
+timing_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+static void
+record(int cmd, enum timing_phase phase, unsigned long long usec)
+{
+    struct timing_hist *h = &hists[cmd * TIMING_PHASES + phase];
+    int b = 0;
+
+    while (b < TIMING_BUCKETS - 1 && usec >= (1ULL << b))
+        b++;
+
+    h->count++;
+    h->sum += usec;
+    if (usec > h->max)
+        h->max = usec;
+    h->buckets[b]++;
+}
+
+
+/* Add time spent in one of the phases to the running command. */
+void
+timing_add(enum timing_phase phase, unsigned long long usec)
+{
+    if (in_command)
+        cmd_phase[phase] += usec;
+}
+
+
+void
+timing_begin_command(void)
+{
+    if (!hists) {
+        for (command_count = 0; clientcmd[command_count].name; command_count++)
+            ;
+        hists = calloc(command_count * TIMING_PHASES,
+                       sizeof (struct timing_hist));
+        last_write = time(NULL);
+    }
+
+    memset(cmd_phase, 0, sizeof (cmd_phase));
+    cmd_log_start = nh_get_log_result_time();
+    cmd_start = timing_now();
+    in_command = TRUE;
+}
+
+
+/*
+ * The command clientcmd[cmd] has finished; record its phases. "exec" is the
+ * time spent in the command handler itself (mostly libnethack), not counting
+ * message encoding and writing or waiting for the user's input.
+ */
+void
+timing_end_command(int cmd)
+{
+    unsigned long long total, other;
+
+    if (!in_command)
+        return;
+    in_command = FALSE;
+
+    total = timing_now() - cmd_start;
+    cmd_phase[TP_TOTAL] = total;
+    cmd_phase[TP_LOG] = nh_get_log_result_time() - cmd_log_start;
+    other = cmd_phase[TP_ENCODE] + cmd_phase[TP_WRITE] + cmd_phase[TP_WAIT];
+    cmd_phase[TP_EXEC] = total > other ? total - other : 0;
+
+    record(cmd, TP_TOTAL, cmd_phase[TP_TOTAL]);
+    record(cmd, TP_EXEC, cmd_phase[TP_EXEC]);
+    if (cmd_phase[TP_LOG])
+        record(cmd, TP_LOG, cmd_phase[TP_LOG]);
+    record(cmd, TP_ENCODE, cmd_phase[TP_ENCODE]);
+    record(cmd, TP_WRITE, cmd_phase[TP_WRITE]);
+    if (cmd_phase[TP_WAIT])
+        record(cmd, TP_WAIT, cmd_phase[TP_WAIT]);
+}
+
+
+/*
+ * Append the histograms collected since the last write to the stats file and
+ * reset them. Unless force is set, this only happens every STATS_INTERVAL
+ * seconds. Each line has the form
+ *   <time> [<pid>] <command> <phase> n=<count> avg=<us> max=<us> <bucket>...
+ * where each bucket is written as lt<limit in us>=<count> and empty buckets
+ * are left out.
+ */
+void
+timing_write_stats(int force)
+{
+    char timestamp[32];
+    struct tm *tm_local;
+    time_t now = time(NULL);
+    FILE *fp;
+    int i, b;
+
+    if (!settings.statsfile || !hists ||
+        (!force && now - last_write < STATS_INTERVAL))
+        return;
+    last_write = now;
+
+    fp = fopen(settings.statsfile, "a");
+    if (!fp) {
+        log_msg("Failed to open the stats file %s: %s", settings.statsfile,
+                strerror(errno));
+        return;
+    }
+
+    tm_local = localtime(&now);
+    if (!tm_local ||
+        !strftime(timestamp, sizeof (timestamp), "%Y-%m-%d %H:%M:%S", tm_local))
+        strcpy(timestamp, "???");
+
+    /* many game processes share the file; write the block in one piece */
+    flock(fileno(fp), LOCK_EX);
+    for (i = 0; i < command_count * TIMING_PHASES; i++) {
+        struct timing_hist *h = &hists[i];
+
+        if (!h->count)
+            continue;
+
+        fprintf(fp, "%s [%d] %s %s n=%lu avg=%llu max=%llu", timestamp,
+                getpid(), clientcmd[i / TIMING_PHASES].name,
+                phase_names[i % TIMING_PHASES], h->count, h->sum / h->count,
+                h->max);
+        for (b = 0; b < TIMING_BUCKETS; b++) {
+            if (!h->buckets[b])
+                continue;
+            if (b == TIMING_BUCKETS - 1)
+                fprintf(fp, " inf=%lu", h->buckets[b]);
+            else
+                fprintf(fp, " lt%llu=%lu", 1ULL << b, h->buckets[b]);
+        }
+        fputc('\n', fp);
+    }
+    fflush(fp);
+    flock(fileno(fp), LOCK_UN);
+    fclose(fp);
+
+    memset(hists, 0, command_count * TIMING_PHASES *
+           sizeof (struct timing_hist));
+}
+
+/* timing.c */
@@ -15,6 +15,9 @@ static void srv_print_message(int turn, const char *msg);
 static void srv_print_message_nonblocking(int turn, const char *msg);
 static void srv_update_screen(struct nh_dbuf_entry dbuf[ROWNO][COLNO], int ux,
                               int uy);
+static void srv_update_screen_changes(struct nh_dbuf_entry dbuf[ROWNO][COLNO],
+                                      const struct nh_dbuf_change *changes,
+                                      int nchanges, int ux, int uy);
 static void srv_delay_output(void);
 static void srv_level_changed(int displaymode);
 static void srv_outrip(struct nh_menuitem *items, int icount, nh_bool tombstone,
@@ -54,13 +57,30 @@ static nh_bool srv_alt_list_items(struct nh_objitem *items, int icount,
 /*---------------------------------------------------------------------------*/
 
 struct nh_player_info player_info;
+static struct nh_player_info sent_player_info;
 static struct nh_dbuf_entry prev_dbuf[ROWNO][COLNO];
-static int prev_invent_icount, prev_floor_icount;
-static struct nh_objitem *prev_invent;
+/* columns that may differ from prev_dbuf; send_screen skips all others */
+static char dirty_cols[COLNO];
+static int all_cols_dirty = TRUE;
 static const struct nh_dbuf_entry zero_dbuf;    /* an entry of all zeroes */
-static json_t *display_data, *jinvent_items, *jfloor_items;
+static json_t *display_data;
+
+/* Item lists, indexed by the invent flag. sent_lists is what the client has,
+ * so list_items can be sent as a delta against it; pending_lists is the latest
+ * list, which is only sent with the rest of the display data. */
+struct item_list {
+    struct nh_objitem *items;
+    int icount;
+    int valid;
+};
+static struct item_list sent_lists[2], pending_lists[2];
 static int altproc;
 
+/* With the coalesce_display option, screen and status updates are held here
+ * until anything else is sent, so a run of them only sends the final state. */
+static struct nh_dbuf_entry pending_dbuf[ROWNO][COLNO];
+static int pending_ux, pending_uy, screen_pending, status_pending;
+
 struct nh_window_procs server_windowprocs = {
     srv_pause,
     srv_display_buffer,
@@ -80,6 +100,7 @@ struct nh_window_procs server_windowprocs = {
     srv_level_changed,
     srv_outrip,
     srv_print_message_nonblocking,
+    srv_update_screen_changes,
 };
 
 
@@ -107,6 +128,12 @@ struct nh_window_procs server_alt_windowprocs = {
 
 /*---------------------------------------------------------------------------*/
 
+static void send_status(struct nh_player_info *pi);
+static void send_screen(struct nh_dbuf_entry dbuf[ROWNO][COLNO], int ux,
+                        int uy);
+static json_t *json_objitem(struct nh_objitem *oi);
+static void send_item_list(int invent);
+
 static json_t *
 client_request(const char *funcname, json_t * request_msg)
 {
@@ -157,12 +184,33 @@ client_request(const char *funcname, json_t * request_msg)
 }
 
 
+/* Send the held back screen and status updates, if any. */
+static void
+flush_pending_display(void)
+{
+    if (status_pending) {
+        status_pending = FALSE;
+        send_status(&player_info);
+    }
+    if (screen_pending) {
+        screen_pending = FALSE;
+        send_screen(pending_dbuf, pending_ux, pending_uy);
+    }
+}
+
+
 static void
 add_display_data(const char *key, json_t * data)
 {
     json_t *tmpobj;
     char keystr[BUFSZ];
 
+    /* anything but another state update (messages, delay frames, etc.) must
+       come after the state that was current when it happened */
+    if (strcmp(key, "update_screen") && strcmp(key, "update_status") &&
+        strcmp(key, "list_items"))
+        flush_pending_display();
+
     if (altproc) {
         snprintf(keystr, BUFSZ - 1, "alt_%s", key);
         keystr[BUFSZ - 1] = '\0';
@@ -183,14 +231,11 @@ get_display_data(void)
 {
     json_t *dd;
 
-    if (jfloor_items) {
-        add_display_data("list_items", jfloor_items);
-        jfloor_items = NULL;
-    }
-    if (jinvent_items) {
-        add_display_data("list_items", jinvent_items);
-        jinvent_items = NULL;
-    }
+    flush_pending_display();
+    if (pending_lists[FALSE].valid)
+        send_item_list(FALSE);
+    if (pending_lists[TRUE].valid)
+        send_item_list(TRUE);
     dd = display_data;
     display_data = NULL;
     return dd;
@@ -233,15 +278,28 @@ srv_display_buffer(const char *buf, nh_bool trymove)
 
 static void
 srv_update_status(struct nh_player_info *pi)
+{
+    player_info = *pi;
+    if (settings.coalesce_display && !altproc)
+        status_pending = TRUE;
+    else {
+        flush_pending_display();
+        send_status(pi);
+    }
+}
+
+
+static void
+send_status(struct nh_player_info *pi)
 {
     json_t *jobj, *jarr;
-    struct nh_player_info *oi = &player_info;
+    struct nh_player_info *oi = &sent_player_info;
     int i, all;
 
-    if (!memcmp(&player_info, pi, sizeof (struct nh_player_info)))
+    if (!memcmp(&sent_player_info, pi, sizeof (struct nh_player_info)))
         return;
 
-    all = !player_info.plname[0];
+    all = !sent_player_info.plname[0];
 
     /* only send fields that have changed since the last transmission */
     jobj = json_object();
@@ -309,7 +367,7 @@ srv_update_status(struct nh_player_info *pi)
             json_array_append_new(jarr, json_string(pi->statusitems[i]));
         json_object_set_new(jobj, "statusitems", jarr);
     }
-    player_info = *pi;
+    sent_player_info = *pi;
 
     add_display_data("update_status", jobj);
 }
@@ -333,6 +391,36 @@ srv_print_message_nonblocking(int turn, const char *msg)
 
 static void
 srv_update_screen(struct nh_dbuf_entry dbuf[ROWNO][COLNO], int ux, int uy)
+{
+    srv_update_screen_changes(dbuf, NULL, 0, ux, uy);
+}
+
+
+static void
+srv_update_screen_changes(struct nh_dbuf_entry dbuf[ROWNO][COLNO],
+                          const struct nh_dbuf_change *changes, int nchanges,
+                          int ux, int uy)
+{
+    int i;
+
+    if (!changes)
+        all_cols_dirty = TRUE;
+    for (i = 0; changes && i < nchanges; i++)
+        dirty_cols[changes[i].x] = TRUE;
+
+    if (settings.coalesce_display) {
+        memcpy(pending_dbuf, dbuf, sizeof (pending_dbuf));
+        pending_ux = ux;
+        pending_uy = uy;
+        screen_pending = TRUE;
+    } else
+        send_screen(dbuf, ux, uy);
+}
+
+
+/* send the differences from the screen the client already has */
+static void
+send_screen(struct nh_dbuf_entry dbuf[ROWNO][COLNO], int ux, int uy)
 {
     int i, x, y, samedbe, samecols, zerodbe, zerocols, is_same, is_zero;
     json_t *jmsg, *jdbuf, *dbufcol, *dbufent;
@@ -341,6 +429,12 @@ srv_update_screen(struct nh_dbuf_entry dbuf[ROWNO][COLNO], int ux, int uy)
     zerocols = 0;
     jdbuf = json_array();
     for (x = 0; x < COLNO; x++) {
+        if (!all_cols_dirty && !dirty_cols[x]) {
+            samecols++;
+            json_array_append_new(jdbuf, json_integer(1));
+            continue;
+        }
+
         samedbe = 0;
         zerodbe = 0;
         dbufcol = json_array();
@@ -388,6 +482,8 @@ srv_update_screen(struct nh_dbuf_entry dbuf[ROWNO][COLNO], int ux, int uy)
             json_array_append(jdbuf, dbufcol);
         json_decref(dbufcol);
     }
+    memset(dirty_cols, 0, sizeof (dirty_cols));
+    all_cols_dirty = FALSE;
 
     if (samecols == COLNO) {
         json_decref(jdbuf);
@@ -539,45 +635,97 @@ srv_display_objects(struct nh_objitem *items, int icount, const char *title,
 }
 
 
-static nh_bool
-srv_list_items(struct nh_objitem *items, int icount, nh_bool invent)
+static void
+free_item_list(struct item_list *list)
+{
+    free(list->items);
+    list->items = NULL;
+    list->icount = 0;
+    list->valid = FALSE;
+}
+
+
+static const struct nh_objitem *
+find_sent_item(const struct item_list *list, int id, int hint)
 {
     int i;
-    json_t *jobj, *jarr;
 
-    if (invent && prev_invent && icount == prev_invent_icount &&
-        !memcmp(items, prev_invent, sizeof (struct nh_objitem) * icount))
-        return TRUE;
-    if (!invent && icount == 0 && prev_floor_icount == 0)
-        return TRUE;
+    /* most items keep their position, or move by a few places at most */
+    if (hint < list->icount && list->items[hint].id == id)
+        return &list->items[hint];
+    for (i = 0; i < list->icount; i++)
+        if (list->items[i].id == id)
+            return &list->items[i];
+    return NULL;
+}
 
-    if (invent) {
-        prev_invent_icount = icount;
-        free(prev_invent);
-        prev_invent = malloc(sizeof (struct nh_objitem) * icount);
-        memcpy(prev_invent, items, sizeof (struct nh_objitem) * icount);
-    } else
-        prev_floor_icount = icount;
+
+/*
+ * Send the pending list for invent as a delta against the list the client
+ * already has: items that are unchanged since then are sent as just their id,
+ * items that are new or changed are sent in full and items that are gone are
+ * left out. Headings (id 0) are always sent in full. Without a previous list
+ * the whole list is sent in the old form.
+ */
+static void
+send_item_list(int invent)
+{
+    struct item_list *sent = &sent_lists[invent];
+    struct item_list *list = &pending_lists[invent];
+    const struct nh_objitem *old;
+    json_t *jobj, *jarr;
+    int i, refs = 0;
 
     jarr = json_array();
-    for (i = 0; i < icount; i++)
-        json_array_append_new(jarr, json_objitem(&items[i]));
-    jobj =
-        json_pack("{so,si,si}", "items", jarr, "icount", icount, "invent",
-                  invent);
+    for (i = 0; i < list->icount; i++) {
+        old = NULL;
+        if (sent->valid && list->items[i].id)
+            old = find_sent_item(sent, list->items[i].id, i);
+        if (old && !memcmp(old, &list->items[i], sizeof (struct nh_objitem))) {
+            json_array_append_new(jarr, json_integer(list->items[i].id));
+            refs++;
+        } else
+            json_array_append_new(jarr, json_objitem(&list->items[i]));
+    }
+    jobj = json_pack("{so,si,si}", "items", jarr, "icount", list->icount,
+                     "invent", invent);
+    if (refs)
+        json_object_set_new(jobj, "delta", json_true());
+
+    add_display_data("list_items", jobj);
+
+    free_item_list(sent);
+    *sent = *list;
+    list->items = NULL;
+    list->icount = 0;
+    list->valid = FALSE;
+}
+
+
+static nh_bool
+srv_list_items(struct nh_objitem *items, int icount, nh_bool invent)
+{
+    struct item_list *latest;
+
+    invent = ! !invent;
+    latest = pending_lists[invent].valid ? &pending_lists[invent] :
+        &sent_lists[invent];
+
+    if (latest->valid && icount == latest->icount &&
+        !memcmp(items, latest->items, sizeof (struct nh_objitem) * icount))
+        return TRUE;
+    if (!invent && icount == 0 && !latest->valid)
+        return TRUE;
 
     /* there cold be lots of list_item calls after each other if the player is
        picking up or dropping large numbers of items. We only care about the
-       last state. */
-    if (invent) {
-        if (jinvent_items)
-            json_decref(jinvent_items);
-        jinvent_items = jobj;
-    } else {
-        if (jfloor_items)
-            json_decref(jfloor_items);
-        jfloor_items = jobj;
-    }
+       last state, which is sent by get_display_data. */
+    free_item_list(&pending_lists[invent]);
+    pending_lists[invent].items = malloc(sizeof (struct nh_objitem) * icount);
+    memcpy(pending_lists[invent].items, items,
+           sizeof (struct nh_objitem) * icount);
+    pending_lists[invent].icount = icount;
+    pending_lists[invent].valid = TRUE;
 
     /* If list_items returns TRUE, the dialog "Things that are here" is not
        shown. The return value doesn't matter at all if the list doesn't
@@ -772,19 +920,37 @@ reset_cached_diplaydata(void)
 {
     if (display_data)
         json_decref(display_data);
-    if (jinvent_items)
-        json_decref(jinvent_items);
-    if (jfloor_items)
-        json_decref(jfloor_items);
-    display_data = jinvent_items = jfloor_items = NULL;
+    display_data = NULL;
 
-    if (prev_invent)
-        free(prev_invent);
-    prev_invent = NULL;
-    prev_invent_icount = prev_floor_icount = 0;
+    free_item_list(&pending_lists[FALSE]);
+    free_item_list(&pending_lists[TRUE]);
+    free_item_list(&sent_lists[FALSE]);
+    free_item_list(&sent_lists[TRUE]);
 
     memset(&player_info, 0, sizeof (player_info));
+    memset(&sent_player_info, 0, sizeof (sent_player_info));
     memset(&prev_dbuf, 0, sizeof (prev_dbuf));
+    all_cols_dirty = TRUE;
+    screen_pending = status_pending = FALSE;
+}
+
+
+/* The client may have lost its item lists (it reconnected, perhaps as a new
+ * process), so the next list of each kind must be sent in full. */
+void
+reset_sent_item_lists(void)
+{
+    int invent;
+
+    for (invent = FALSE; invent <= TRUE; invent++) {
+        /* a list that is identical to the one that was sent wouldn't be sent
+           again otherwise */
+        if (sent_lists[invent].valid && !pending_lists[invent].valid) {
+            pending_lists[invent] = sent_lists[invent];
+            sent_lists[invent].items = NULL;
+        }
+        free_item_list(&sent_lists[invent]);
+    }
 }
 
 /* winprocs.c */